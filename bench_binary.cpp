@@ -0,0 +1,265 @@
+// Copyright (C) 2023 Adam Lugowski. All rights reserved.
+// Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "common.hpp"
+#include "binary_format.hpp"
+#include "compress.hpp"
+#include "matrices.hpp"
+#include "packed_format.hpp"
+#include <fast_matrix_market/fast_matrix_market.hpp>
+
+/**
+ * Load a problem's .mtx into memory.
+ */
+void load_triplet(const problem& prob, triplet_matrix<INDEX_TYPE, VALUE_TYPE>& triplet) {
+    triplet = *get_reference_triplet(prob);
+}
+
+void load_csc(const problem& prob, csc_matrix<INDEX_TYPE, VALUE_TYPE>& csc, int num_threads) {
+    triplet_matrix<INDEX_TYPE, VALUE_TYPE> triplet;
+    load_triplet(prob, triplet);
+
+    csc.nrows = triplet.nrows;
+    csc.ncols = triplet.ncols;
+    compress_triplets(triplet.ncols, triplet.cols, triplet.rows, triplet.vals,
+                      csc.indptr, csc.indices, csc.vals, num_threads);
+}
+
+/**
+ * Load a problem as CSR with the columns of every row sorted.
+ * The CSC entries are ordered by column, so compressing them stably by row keeps each row's columns in order.
+ */
+void load_sorted_csr(const problem& prob, csr_matrix<INDEX_TYPE, VALUE_TYPE>& csr, int num_threads) {
+    csc_matrix<INDEX_TYPE, VALUE_TYPE> csc;
+    load_csc(prob, csc, num_threads);
+
+    std::vector<INDEX_TYPE> cols;
+    expand_indptr(csc.indptr, cols, num_threads);
+
+    csr.nrows = csc.nrows;
+    csr.ncols = csc.ncols;
+    compress_triplets(csc.nrows, csc.indices, cols, csc.vals, csr.indptr, csr.indices, csr.vals, num_threads);
+}
+
+std::string binary_suffix(binary_layout layout) {
+    switch (layout) {
+        case binary_layout::csc: return ".csc.smb";
+        case binary_layout::packed_csr: return ".packed.smb";
+        default: return ".smb";
+    }
+}
+
+/**
+ * Binary conversion of a problem, cached in the temporary directory. Converted again if the .mtx is newer.
+ */
+std::filesystem::path cached_binary(const problem& prob, binary_layout layout) {
+    auto path = temporary_write_dir / (prob.name + binary_suffix(layout));
+    if (std::filesystem::exists(path) &&
+        std::filesystem::last_write_time(path) >= std::filesystem::last_write_time(prob.mm_path)) {
+        return path;
+    }
+
+    int num_threads = (int)std::thread::hardware_concurrency();
+    if (layout == binary_layout::csc) {
+        csc_matrix<INDEX_TYPE, VALUE_TYPE> csc;
+        load_csc(prob, csc, num_threads);
+        write_binary_compressed(path, csc, num_threads);
+    } else if (layout == binary_layout::packed_csr) {
+        csr_matrix<INDEX_TYPE, VALUE_TYPE> csr;
+        load_sorted_csr(prob, csr, num_threads);
+        write_binary_packed_csr(path, csr, num_threads);
+    } else {
+        triplet_matrix<INDEX_TYPE, VALUE_TYPE> triplet;
+        load_triplet(prob, triplet);
+        write_binary_triplet(path, triplet, binary_sort_order::unsorted, num_threads);
+    }
+    return path;
+}
+
+/**
+ * Throughput against the size of the original .mtx file, comparable with the Polars and Pandas benchmarks.
+ */
+void set_mm_equivalent_bytes(benchmark::State& state, const problem& prob) {
+    using benchmark::Counter;
+    state.counters["MM_equivalent_bytes_per_second"] = Counter(
+        (double)state.iterations() * (double)std::filesystem::file_size(prob.mm_path), Counter::kIsRate);
+}
+
+/**
+ * Read the binary format into memory with parallel pread.
+ */
+void binary_read(benchmark::State& state, cache_mode cache, binary_layout layout) {
+    problem& prob = get_problem((int)state.range(0));
+    int num_threads = (int)state.range(1);
+
+    auto path = cached_binary(prob, layout);
+
+    std::size_t num_bytes = 0;
+    memory_meter meter{state};
+
+    for ([[maybe_unused]] auto _ : state) {
+        if (!prepare_page_cache(state, path, cache)) {
+            break;
+        }
+        meter.start();
+
+        if (layout == binary_layout::csc) {
+            csc_matrix<INDEX_TYPE, VALUE_TYPE> csc;
+            read_binary_compressed(path, csc, num_threads);
+            meter.record_structure(csc.size_bytes());
+        } else if (layout == binary_layout::packed_csr) {
+            csr_matrix<INDEX_TYPE, VALUE_TYPE> csr;
+            read_binary_packed_csr(path, csr, num_threads);
+            meter.record_structure(csr.size_bytes());
+        } else {
+            triplet_matrix<INDEX_TYPE, VALUE_TYPE> triplet;
+            read_binary_triplet(path, triplet, num_threads);
+            meter.record_structure(triplet.size_bytes());
+        }
+        meter.stop();
+
+        num_bytes += std::filesystem::file_size(path);
+        benchmark::ClobberMemory();
+    }
+
+    meter.report(prob.nnz, num_bytes);
+    state.SetBytesProcessed((int64_t)num_bytes);
+    set_mm_equivalent_bytes(state, prob);
+    state.SetLabel("problem_name=" + prob.name);
+}
+
+BENCHMARK_CAPTURE(binary_read, triplet_cold, cache_mode::cold, binary_layout::triplet)->Name("op:read/impl:native/format:binary(triplet)/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(binary_read, triplet_warm, cache_mode::warm, binary_layout::triplet)->Name("op:read/impl:native/format:binary(triplet)/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(binary_read, csc_cold, cache_mode::cold, binary_layout::csc)->Name("op:read/impl:native/format:binary(CSC)/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(binary_read, csc_warm, cache_mode::warm, binary_layout::csc)->Name("op:read/impl:native/format:binary(CSC)/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(binary_read, packed_csr_cold, cache_mode::cold, binary_layout::packed_csr)->Name("op:read/impl:native/format:binary(packed CSR)/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(binary_read, packed_csr_warm, cache_mode::warm, binary_layout::packed_csr)->Name("op:read/impl:native/format:binary(packed CSR)/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+
+/**
+ * Sum an array with `num_threads` threads. Makes a mapped read touch every page.
+ */
+template <typename T>
+double parallel_sum(const array_view<T>& array, int num_threads) {
+    std::vector<double> sums(num_threads, 0);
+    std::vector<std::thread> threads;
+    auto sum_slice = [&](int t) {
+        std::size_t begin = array.size() * t / num_threads;
+        std::size_t end = array.size() * (t + 1) / num_threads;
+        double sum = 0;
+        for (std::size_t i = begin; i < end; ++i) {
+            sum += (double)array[i];
+        }
+        sums[t] = sum;
+    };
+    for (int t = 1; t < num_threads; ++t) {
+        threads.emplace_back(sum_slice, t);
+    }
+    sum_slice(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    double total = 0;
+    for (auto s : sums) {
+        total += s;
+    }
+    return total;
+}
+
+/**
+ * Memory map the binary format. The mapping is zero-copy, so every array is summed to fault in its pages.
+ * Otherwise this would only measure mmap(), and the bytes processed would include pages that were never read.
+ */
+void binary_read_mmap(benchmark::State& state, cache_mode cache, binary_layout layout) {
+    problem& prob = get_problem((int)state.range(0));
+    int num_threads = (int)state.range(1);
+
+    auto path = cached_binary(prob, layout);
+
+    std::size_t num_bytes = 0;
+    memory_meter meter{state};
+
+    for ([[maybe_unused]] auto _ : state) {
+        if (!prepare_page_cache(state, path, cache)) {
+            break;
+        }
+        meter.start();
+
+        mapped_binary_file mapped(path);
+        if (layout == binary_layout::csc) {
+            auto csc = mapped.compressed<INDEX_TYPE, VALUE_TYPE>();
+            benchmark::DoNotOptimize(parallel_sum(csc.indptr, num_threads) + parallel_sum(csc.indices, num_threads) +
+                                     parallel_sum(csc.vals, num_threads));
+        } else {
+            auto triplet = mapped.triplet<INDEX_TYPE, VALUE_TYPE>();
+            benchmark::DoNotOptimize(parallel_sum(triplet.rows, num_threads) + parallel_sum(triplet.cols, num_threads) +
+                                     parallel_sum(triplet.vals, num_threads));
+        }
+        meter.stop();
+
+        num_bytes += std::filesystem::file_size(path);
+        benchmark::ClobberMemory();
+    }
+
+    meter.report(prob.nnz, num_bytes);
+    state.SetBytesProcessed((int64_t)num_bytes);
+    set_mm_equivalent_bytes(state, prob);
+    state.SetLabel("problem_name=" + prob.name);
+}
+
+BENCHMARK_CAPTURE(binary_read_mmap, triplet_cold, cache_mode::cold, binary_layout::triplet)->Name("op:read/impl:native_mmap/format:binary(triplet)/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(binary_read_mmap, triplet_warm, cache_mode::warm, binary_layout::triplet)->Name("op:read/impl:native_mmap/format:binary(triplet)/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(binary_read_mmap, csc_cold, cache_mode::cold, binary_layout::csc)->Name("op:read/impl:native_mmap/format:binary(CSC)/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(binary_read_mmap, csc_warm, cache_mode::warm, binary_layout::csc)->Name("op:read/impl:native_mmap/format:binary(CSC)/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+
+/**
+ * Write the binary format with parallel pwrite.
+ */
+void binary_write(benchmark::State& state, binary_layout layout) {
+    std::size_t num_bytes = 0;
+
+    problem& prob = get_problem((int)state.range(0));
+    int num_threads = (int)state.range(1);
+
+    // load the problem to be written later
+    triplet_matrix<INDEX_TYPE, VALUE_TYPE> triplet;
+    csc_matrix<INDEX_TYPE, VALUE_TYPE> csc;
+    if (layout == binary_layout::csc) {
+        load_csc(prob, csc, num_threads);
+    } else if (layout == binary_layout::packed_csr) {
+        load_sorted_csr(prob, csc, num_threads);
+    } else {
+        load_triplet(prob, triplet);
+    }
+
+    auto out_path = temporary_write_dir / ("write_" + prob.name + ".smb");
+    memory_meter meter{state};
+
+    for ([[maybe_unused]] auto _ : state) {
+        meter.start();
+        if (layout == binary_layout::csc) {
+            write_binary_compressed(out_path, csc, num_threads);
+        } else if (layout == binary_layout::packed_csr) {
+            write_binary_packed_csr(out_path, csc, num_threads);
+        } else {
+            write_binary_triplet(out_path, triplet, binary_sort_order::unsorted, num_threads);
+        }
+        meter.stop();
+
+        num_bytes += std::filesystem::file_size(out_path);
+        benchmark::ClobberMemory();
+    }
+
+    if (delete_written_files_on_finish) {
+        std::filesystem::remove(out_path);
+    }
+    meter.report(prob.nnz, num_bytes);
+    state.SetBytesProcessed((int64_t)num_bytes);
+    set_mm_equivalent_bytes(state, prob);
+    state.SetLabel("problem_name=" + prob.name);
+}
+
+BENCHMARK_CAPTURE(binary_write, triplet, binary_layout::triplet)->Name("op:write/impl:native/format:binary(triplet)")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(binary_write, csc, binary_layout::csc)->Name("op:write/impl:native/format:binary(CSC)")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(binary_write, packed_csr, binary_layout::packed_csr)->Name("op:write/impl:native/format:binary(packed CSR)")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
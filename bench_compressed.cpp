@@ -0,0 +1,169 @@
+// Copyright (C) 2023 Adam Lugowski. All rights reserved.
+// Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "common.hpp"
+#include "compressed_stream.hpp"
+#include "matrices.hpp"
+#include <fast_matrix_market/fast_matrix_market.hpp>
+
+/**
+ * Report throughput against both the compressed and the uncompressed size.
+ *
+ * bytes_per_second is against the uncompressed size, so it compares directly with the .mtx benchmarks.
+ */
+void set_compressed_bytes_processed(benchmark::State& state, std::size_t compressed_bytes, std::size_t uncompressed_bytes) {
+    using benchmark::Counter;
+    state.SetBytesProcessed((int64_t)uncompressed_bytes);
+    state.counters["compressed_bytes_per_second"] = Counter((double)compressed_bytes, Counter::kIsRate, Counter::kIs1024);
+    if (compressed_bytes > 0) {
+        state.counters["compression_ratio"] = Counter((double)uncompressed_bytes / (double)compressed_bytes);
+    }
+}
+
+/**
+ * Read the header of a compressed problem for load_problems(). Only the start of the file is decompressed.
+ */
+bool read_header_decompressing(problem& prob) {
+    auto type = compression_from_extension(prob.mm_path);
+    if (!compression_supported(type)) {
+        return false;
+    }
+    decompressing_streambuf buf(prob.mm_path, type, 1);
+    std::istream iss(&buf);
+    iss.exceptions(std::ios::badbit);
+
+    fast_matrix_market::matrix_market_header header;
+    fast_matrix_market::read_header(iss, header);
+    prob.nrows = header.nrows;
+    prob.ncols = header.ncols;
+    prob.nnz = header.nnz;
+    return true;
+}
+
+/**
+ * Registering the benchmarks below loads the compressed problems, so set the header reader first.
+ */
+static const bool header_reader_set = [] {
+    read_compressed_header = read_header_decompressing;
+    return true;
+}();
+
+/**
+ * Read compressed MatrixMarket with fast_matrix_market.
+ *
+ * The file is decompressed by `p` worker threads while fast_matrix_market parses it with another `p` threads.
+ */
+void FMM_read_decompressing(benchmark::State& state, cache_mode cache) {
+    problem* prob = get_compressed_problem((int)state.range(0));
+    if (prob == nullptr) {
+        state.SkipWithError("No .mtx.gz, .mtx.zst, or .mtx.lz4 files found.");
+        return;
+    }
+    auto type = compression_from_extension(prob->mm_path);
+    if (!compression_supported(type)) {
+        state.SkipWithError(("This build cannot decompress " + prob->name).c_str());
+        return;
+    }
+
+    // read options
+    fast_matrix_market::read_options options{};
+    options.parallel_ok = true;
+    options.num_threads = (int)state.range(1);
+
+    std::size_t compressed_bytes = 0;
+    std::size_t uncompressed_bytes = 0;
+    memory_meter meter{state};
+
+    for ([[maybe_unused]] auto _ : state) {
+        if (!prepare_page_cache(state, prob->mm_path, cache)) {
+            break;
+        }
+        meter.start();
+
+        fast_matrix_market::matrix_market_header header;
+        triplet_matrix<INDEX_TYPE, VALUE_TYPE> triplet;
+
+        decompressing_streambuf buf(prob->mm_path, type, options.num_threads);
+        std::istream iss(&buf);
+        // Decompression errors would otherwise only set badbit, which reads as the end of the file.
+        iss.exceptions(std::ios::badbit);
+        try {
+            fast_matrix_market::read_matrix_market_triplet(iss, header, triplet.rows, triplet.cols, triplet.vals, options);
+        } catch (const std::exception& e) {
+            state.SkipWithError(e.what());
+            break;
+        }
+        meter.record_structure(triplet.size_bytes());
+        meter.stop();
+
+        compressed_bytes += buf.compressed_bytes();
+        uncompressed_bytes += buf.decompressed_bytes();
+        benchmark::ClobberMemory();
+    }
+
+    meter.report(prob->nnz, uncompressed_bytes);
+    set_compressed_bytes_processed(state, compressed_bytes, uncompressed_bytes);
+    state.SetLabel("problem_name=" + prob->name);
+}
+
+BENCHMARK_CAPTURE(FMM_read_decompressing, cold, cache_mode::cold)->Name("op:read/impl:FMM/format:MatrixMarket(compressed)/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(CompressedBenchmarkArgument);
+BENCHMARK_CAPTURE(FMM_read_decompressing, warm, cache_mode::warm)->Name("op:read/impl:FMM/format:MatrixMarket(compressed)/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(CompressedBenchmarkArgument);
+
+/**
+ * Write compressed MatrixMarket with fast_matrix_market.
+ *
+ * fast_matrix_market formats the body with `p` threads, and another `p` threads compress line-aligned blocks of it
+ * into independent frames.
+ */
+void FMM_write_compressing(benchmark::State& state, compression_type type, const std::string& extension) {
+    problem& prob = get_problem((int)state.range(0));
+
+    fast_matrix_market::write_options options;
+    options.parallel_ok = true;
+    options.num_threads = (int)state.range(1);
+
+    // load the problem to be written later
+    auto reference = get_reference_triplet(prob);
+    const auto& triplet = *reference;
+
+    auto out_path = temporary_write_dir / ("write_" + prob.name + extension);
+
+    std::size_t compressed_bytes = 0;
+    std::size_t uncompressed_bytes = 0;
+    memory_meter meter{state};
+
+    for ([[maybe_unused]] auto _ : state) {
+        meter.start();
+        compressing_streambuf buf(out_path, type, options.num_threads);
+        std::ostream oss(&buf);
+
+        fast_matrix_market::write_matrix_market_triplet(oss,
+                                                        {triplet.nrows, triplet.ncols},
+                                                        triplet.rows, triplet.cols, triplet.vals,
+                                                        options);
+        buf.close();
+        meter.stop();
+
+        compressed_bytes += buf.compressed_bytes();
+        uncompressed_bytes += buf.uncompressed_bytes();
+        benchmark::ClobberMemory();
+    }
+
+    if (delete_written_files_on_finish) {
+        std::filesystem::remove(out_path);
+    }
+    meter.report(prob.nnz, uncompressed_bytes);
+    set_compressed_bytes_processed(state, compressed_bytes, uncompressed_bytes);
+    state.SetLabel("problem_name=" + prob.name);
+}
+
+#ifdef HAVE_ZLIB
+BENCHMARK_CAPTURE(FMM_write_compressing, gzip, compression_type::gzip, ".gz")->Name("op:write/impl:FMM/format:MatrixMarket(gzip)")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+#endif
+#ifdef HAVE_ZSTD
+BENCHMARK_CAPTURE(FMM_write_compressing, zstd, compression_type::zstd, ".zst")->Name("op:write/impl:FMM/format:MatrixMarket(zstd)")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+#endif
+#ifdef HAVE_LZ4
+BENCHMARK_CAPTURE(FMM_write_compressing, lz4, compression_type::lz4, ".lz4")->Name("op:write/impl:FMM/format:MatrixMarket(lz4)")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+#endif
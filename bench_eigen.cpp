@@ -11,26 +11,51 @@
 typedef Eigen::SparseMatrix<VALUE_TYPE> SpMat;
 
 /**
- * Read MatrixMarket with Eigen.
+ * Memory used by the arrays of a compressed sparse matrix.
  */
+template <typename IT, typename VT>
+static std::size_t size_bytes(const Eigen::SparseMatrix<VT, Eigen::ColMajor, IT>& A) {
+    return sizeof(IT) * (A.outerSize() + 1) + (sizeof(IT) + sizeof(VT)) * A.nonZeros();
+}
+
+/**
+ * Read MatrixMarket with Eigen into a matrix with index type IT and value type VT.
+ */
+template <typename IT, typename VT, cache_mode CACHE>
 void eigen_read(benchmark::State& state) {
     problem& prob = get_problem((int)state.range(0));
+    if (!check_index_type<IT>(state, prob, true)) {
+        return;
+    }
 
     std::size_t num_bytes = 0;
+    memory_meter meter{state};
 
     for ([[maybe_unused]] auto _ : state) {
-        SpMat A;
+        if (!prepare_page_cache(state, prob.mm_path, CACHE)) {
+            break;
+        }
+        meter.start();
+
+        Eigen::SparseMatrix<VT, Eigen::ColMajor, IT> A;
         Eigen::loadMarket(A, prob.mm_path);
 
+        meter.record_structure(size_bytes(A));
+        meter.stop();
+
         num_bytes += std::filesystem::file_size(prob.mm_path);
         benchmark::ClobberMemory();
     }
 
+    meter.report(prob.nnz, num_bytes);
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
 
-BENCHMARK(eigen_read)->Name("op:read/impl:Eigen/format:MatrixMarket")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read, int32_t, double, cache_mode::cold)->Name("op:read/impl:Eigen/format:MatrixMarket/index:int32/value:double/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read, int32_t, double, cache_mode::warm)->Name("op:read/impl:Eigen/format:MatrixMarket/index:int32/value:double/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read, int32_t, float, cache_mode::cold)->Name("op:read/impl:Eigen/format:MatrixMarket/index:int32/value:float/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read, int32_t, float, cache_mode::warm)->Name("op:read/impl:Eigen/format:MatrixMarket/index:int32/value:float/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
 
 /**
  * Write MatrixMarket with Eigen.
@@ -53,9 +78,14 @@ void eigen_write(benchmark::State& state) {
 
     auto out_path = temporary_write_dir / ("write_" + prob.name + ".mtx");
 
+    memory_meter meter{state};
+
     for ([[maybe_unused]] auto _ : state) {
+        meter.start();
         Eigen::saveMarket(A, out_path);
 
+        meter.stop();
+
         num_bytes += std::filesystem::file_size(out_path);
         benchmark::ClobberMemory();
     }
@@ -63,6 +93,7 @@ void eigen_write(benchmark::State& state) {
     if (delete_written_files_on_finish) {
         std::filesystem::remove(out_path);
     }
+    meter.report(prob.nnz, num_bytes);
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
@@ -3,35 +3,367 @@
 // SPDX-License-Identifier: BSD-2-Clause
 
 #include "common.hpp"
+#include "compress.hpp"
+#include "matrices.hpp"
+#include "parse_handlers.hpp"
+#include "phase_timer.hpp"
 #include <Eigen/Sparse>
 
 #include <fast_matrix_market/app/Eigen.hpp>
 
 typedef Eigen::SparseMatrix<VALUE_TYPE> SpMat;
 
+/*
+ * The Eigen reads are registered with Eigen's default int32 indices and double values, and with float values.
+ * The types appear in the benchmark name as `index:<type>/value:<type>`. Eigen's StorageIndex also holds the column
+ * offsets, so problems whose dimensions or nnz do not fit it are skipped with an index overflow error.
+ */
+
+/**
+ * Column-major Eigen sparse matrix with index type IT and value type VT.
+ */
+template <typename IT, typename VT>
+using eigen_matrix = Eigen::SparseMatrix<VT, Eigen::ColMajor, IT>;
+
+/**
+ * Memory used by the arrays of a compressed sparse matrix.
+ */
+template <typename IT, typename VT>
+static std::size_t size_bytes(const eigen_matrix<IT, VT>& A) {
+    return sizeof(IT) * (A.outerSize() + 1) + (sizeof(IT) + sizeof(VT)) * A.nonZeros();
+}
+
+/**
+ * Parse handler that fills a vector of Eigen triplets.
+ */
+template <typename IT, typename VT>
+class eigen_triplet_parse_handler {
+public:
+    using coordinate_type = IT;
+    using value_type = VT;
+    using triplet_iterator = typename std::vector<Eigen::Triplet<VT, IT>>::iterator;
+    static constexpr int flags = fast_matrix_market::kParallelOk;
+
+    explicit eigen_triplet_parse_handler(triplet_iterator begin, int64_t offset = 0)
+        : begin(begin), iter(begin + offset) {}
+
+    void handle(const coordinate_type row, const coordinate_type col, const value_type value) {
+        *iter++ = Eigen::Triplet<VT, IT>(row, col, value);
+    }
+
+    eigen_triplet_parse_handler get_chunk_handler(int64_t offset_from_begin) {
+        return eigen_triplet_parse_handler(begin, offset_from_begin);
+    }
+
+protected:
+    triplet_iterator begin;
+    triplet_iterator iter;
+};
+
 /**
- * Read MatrixMarket with Eigen.
+ * Read MatrixMarket with fast_matrix_market's Eigen binding.
+ *
+ * The binding parses and builds in one call, so the whole read is timed as the parse phase.
+ * eigen_read_FMM_phases times its steps separately.
  */
+template <typename IT, typename VT, cache_mode CACHE>
 void eigen_read_FMM(benchmark::State& state) {
     problem& prob = get_problem((int)state.range(0));
+    if (!check_index_type<IT>(state, prob, true)) {
+        return;
+    }
+
+    // read options
+    fast_matrix_market::read_options options{};
+    options.parallel_ok = true;
+    options.num_threads = (int)state.range(1);
 
     std::size_t num_bytes = 0;
+    memory_meter meter{state};
+    phase_timer timer{state, "Eigen_FMM " + prob.name};
 
     for ([[maybe_unused]] auto _ : state) {
-        SpMat A;
+        if (!prepare_page_cache(state, prob.mm_path, CACHE)) {
+            break;
+        }
+        meter.start();
 
-        std::ifstream f(prob.mm_path);
-        fast_matrix_market::read_matrix_market_eigen(f, A);
+        eigen_matrix<IT, VT> A;
+        try {
+            auto t = timer.time(phase::parse);
+            timed_ifstream f(prob.mm_path, timer);
+            fast_matrix_market::read_matrix_market_eigen(f, A, options);
+        } catch (const fast_matrix_market::out_of_range& e) {
+            state.SkipWithError((std::string("Index overflow: ") + e.what()).c_str());
+            break;
+        }
+
+        meter.record_structure(size_bytes(A));
+        meter.stop();
+
+        {
+            auto t = timer.time(phase::deallocate);
+            A = eigen_matrix<IT, VT>();
+        }
+
+        num_bytes += std::filesystem::file_size(prob.mm_path);
+        benchmark::ClobberMemory();
+    }
+
+    meter.report(prob.nnz, num_bytes);
+    timer.report(options.num_threads);
+    state.SetBytesProcessed((int64_t)num_bytes);
+    state.SetLabel("problem_name=" + prob.name);
+}
+
+BENCHMARK_TEMPLATE(eigen_read_FMM, int32_t, double, cache_mode::cold)->Name("op:read/impl:Eigen_FMM/format:MatrixMarket/index:int32/value:double/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read_FMM, int32_t, double, cache_mode::warm)->Name("op:read/impl:Eigen_FMM/format:MatrixMarket/index:int32/value:double/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read_FMM, int32_t, float, cache_mode::cold)->Name("op:read/impl:Eigen_FMM/format:MatrixMarket/index:int32/value:float/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read_FMM, int32_t, float, cache_mode::warm)->Name("op:read/impl:Eigen_FMM/format:MatrixMarket/index:int32/value:float/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+
+/**
+ * Read MatrixMarket with fast_matrix_market into an Eigen matrix.
+ *
+ * These are the steps of fast_matrix_market's Eigen binding, parse into Eigen triplets then setFromTriplets(),
+ * written out so that each phase can be timed.
+ */
+template <typename IT, typename VT, cache_mode CACHE>
+void eigen_read_FMM_phases(benchmark::State& state) {
+    problem& prob = get_problem((int)state.range(0));
+    if (!check_index_type<IT>(state, prob, true)) {
+        return;
+    }
+
+    // read options
+    fast_matrix_market::read_options options{};
+    options.parallel_ok = true;
+    options.num_threads = (int)state.range(1);
+
+    std::size_t num_bytes = 0;
+    memory_meter meter{state};
+    phase_timer timer{state, "Eigen_FMM_phases " + prob.name};
+
+    for ([[maybe_unused]] auto _ : state) {
+        if (!prepare_page_cache(state, prob.mm_path, CACHE)) {
+            break;
+        }
+        meter.start();
+
+        eigen_matrix<IT, VT> A;
+        {
+            fast_matrix_market::matrix_market_header header;
+            std::vector<Eigen::Triplet<VT, IT>> triplets;
+            try {
+                auto t = timer.time(phase::parse);
+                timed_ifstream f(prob.mm_path, timer);
+                fast_matrix_market::read_header(f, header);
+                triplets.resize(fast_matrix_market::get_storage_nnz(header, options));
+
+                timed_parse_handler<eigen_triplet_parse_handler<IT, VT>> handler(
+                    eigen_triplet_parse_handler<IT, VT>(triplets.begin()),
+                    [&timer](auto begin, auto end) { timer.add_parse_chunk(begin, end); });
+                fast_matrix_market::read_matrix_market_body(f, header, handler, 1, options);
+            } catch (const fast_matrix_market::out_of_range& e) {
+                state.SkipWithError((std::string("Index overflow: ") + e.what()).c_str());
+                break;
+            }
+
+            auto t = timer.time(phase::construct);
+            A.resize(header.nrows, header.ncols);
+            A.setFromTriplets(triplets.begin(), triplets.end());
+        }
+
+        meter.record_structure(size_bytes(A));
+        meter.stop();
+
+        {
+            auto t = timer.time(phase::deallocate);
+            A = eigen_matrix<IT, VT>();
+        }
 
         num_bytes += std::filesystem::file_size(prob.mm_path);
         benchmark::ClobberMemory();
     }
 
+    meter.report(prob.nnz, num_bytes);
+    timer.report(options.num_threads);
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
 
-BENCHMARK(eigen_read_FMM)->Name("op:read/impl:Eigen_FMM/format:MatrixMarket")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read_FMM_phases, int32_t, double, cache_mode::cold)->Name("op:read/impl:Eigen_FMM_phases/format:MatrixMarket/index:int32/value:double/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read_FMM_phases, int32_t, double, cache_mode::warm)->Name("op:read/impl:Eigen_FMM_phases/format:MatrixMarket/index:int32/value:double/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read_FMM_phases, int32_t, float, cache_mode::cold)->Name("op:read/impl:Eigen_FMM_phases/format:MatrixMarket/index:int32/value:float/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read_FMM_phases, int32_t, float, cache_mode::warm)->Name("op:read/impl:Eigen_FMM_phases/format:MatrixMarket/index:int32/value:float/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+
+/**
+ * Read a file and order its entries by row with a parallel counting sort.
+ *
+ * Compressing the result by column is a second stable pass, so each column's row indices come out sorted as Eigen
+ * requires. Eigen also requires them to be unique, so the callers then sum duplicate entries with sum_duplicates(),
+ * as setFromTriplets() does. Symmetric files always have some, because generalizing them adds an explicit zero next
+ * to each diagonal entry.
+ */
+template <typename IT, typename VT>
+void read_row_ordered(const problem& prob, const fast_matrix_market::read_options& options,
+                      triplet_matrix<IT, VT>& ordered, phase_timer& timer) {
+    triplet_matrix<IT, VT> triplet;
+    {
+        auto t = timer.time(phase::parse);
+        timed_ifstream f(prob.mm_path, timer);
+        fast_matrix_market::read_matrix_market_triplet(f, triplet.nrows, triplet.ncols,
+                                                       triplet.rows, triplet.cols, triplet.vals, options);
+    }
+
+    auto t = timer.time(phase::construct);
+    std::vector<IT> indptr;
+    compress_triplets(triplet.nrows, triplet.rows, triplet.cols, triplet.vals,
+                      indptr, ordered.cols, ordered.vals, options.num_threads);
+    expand_indptr(indptr, ordered.rows, options.num_threads);
+    ordered.nrows = triplet.nrows;
+    ordered.ncols = triplet.ncols;
+}
+
+/**
+ * Read MatrixMarket with fast_matrix_market and fill the arrays of an Eigen::SparseMatrix directly,
+ * instead of going through setFromTriplets. Duplicate entries are summed in place.
+ */
+template <typename IT, typename VT, cache_mode CACHE>
+void eigen_read_FMM_direct(benchmark::State& state) {
+    problem& prob = get_problem((int)state.range(0));
+    if (!check_index_type<IT>(state, prob, true)) {
+        return;
+    }
+
+    // read options
+    fast_matrix_market::read_options options{};
+    options.parallel_ok = true;
+    options.num_threads = (int)state.range(1);
+
+    std::size_t num_bytes = 0;
+    memory_meter meter{state};
+    phase_timer timer{state, "Eigen_FMM_direct " + prob.name};
+
+    for ([[maybe_unused]] auto _ : state) {
+        if (!prepare_page_cache(state, prob.mm_path, CACHE)) {
+            break;
+        }
+        meter.start();
+
+        eigen_matrix<IT, VT> A;
+        {
+            triplet_matrix<IT, VT> ordered;
+            try {
+                read_row_ordered(prob, options, ordered, timer);
+            } catch (const fast_matrix_market::out_of_range& e) {
+                state.SkipWithError((std::string("Index overflow: ") + e.what()).c_str());
+                break;
+            }
+
+            auto t = timer.time(phase::construct);
+            A.resize(ordered.nrows, ordered.ncols);
+            A.resizeNonZeros((Eigen::Index)ordered.cols.size());
+            triplet_compressor<IT, VT>(ordered.ncols, ordered.cols, ordered.rows, ordered.vals)
+                .compress_into(A.outerIndexPtr(), A.innerIndexPtr(), A.valuePtr(), options.num_threads);
+            sum_duplicates(A.outerSize(), A.outerIndexPtr(), A.innerIndexPtr(), A.valuePtr(), options.num_threads);
+            A.resizeNonZeros(A.outerIndexPtr()[A.outerSize()]);
+        }
+
+        meter.record_structure(size_bytes(A));
+        meter.stop();
+
+        {
+            auto t = timer.time(phase::deallocate);
+            A = eigen_matrix<IT, VT>();
+        }
+
+        num_bytes += std::filesystem::file_size(prob.mm_path);
+        benchmark::ClobberMemory();
+    }
+
+    meter.report(prob.nnz, num_bytes);
+    timer.report(options.num_threads);
+    state.SetBytesProcessed((int64_t)num_bytes);
+    state.SetLabel("problem_name=" + prob.name);
+}
+
+BENCHMARK_TEMPLATE(eigen_read_FMM_direct, int32_t, double, cache_mode::cold)->Name("op:read/impl:Eigen_FMM_direct/format:MatrixMarket/index:int32/value:double/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read_FMM_direct, int32_t, double, cache_mode::warm)->Name("op:read/impl:Eigen_FMM_direct/format:MatrixMarket/index:int32/value:double/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read_FMM_direct, int32_t, float, cache_mode::cold)->Name("op:read/impl:Eigen_FMM_direct/format:MatrixMarket/index:int32/value:float/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read_FMM_direct, int32_t, float, cache_mode::warm)->Name("op:read/impl:Eigen_FMM_direct/format:MatrixMarket/index:int32/value:float/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+
+/**
+ * Read MatrixMarket with fast_matrix_market into CSC arrays and view them as an Eigen::Map<SparseMatrix>.
+ * The map does not copy, so the arrays are built in place and never handed to Eigen. Duplicate entries are summed
+ * before mapping.
+ */
+template <typename IT, typename VT, cache_mode CACHE>
+void eigen_read_FMM_map(benchmark::State& state) {
+    problem& prob = get_problem((int)state.range(0));
+    if (!check_index_type<IT>(state, prob, true)) {
+        return;
+    }
+
+    // read options
+    fast_matrix_market::read_options options{};
+    options.parallel_ok = true;
+    options.num_threads = (int)state.range(1);
+
+    std::size_t num_bytes = 0;
+    memory_meter meter{state};
+    phase_timer timer{state, "Eigen_FMM_map " + prob.name};
+
+    for ([[maybe_unused]] auto _ : state) {
+        if (!prepare_page_cache(state, prob.mm_path, CACHE)) {
+            break;
+        }
+        meter.start();
+
+        csc_matrix<IT, VT> csc;
+        {
+            triplet_matrix<IT, VT> ordered;
+            try {
+                read_row_ordered(prob, options, ordered, timer);
+            } catch (const fast_matrix_market::out_of_range& e) {
+                state.SkipWithError((std::string("Index overflow: ") + e.what()).c_str());
+                break;
+            }
+
+            auto t = timer.time(phase::construct);
+            csc.nrows = ordered.nrows;
+            csc.ncols = ordered.ncols;
+            compress_triplets(ordered.ncols, ordered.cols, ordered.rows, ordered.vals,
+                              csc.indptr, csc.indices, csc.vals, options.num_threads);
+            sum_duplicates(csc.ncols, csc.indptr.data(), csc.indices.data(), csc.vals.data(), options.num_threads);
+            csc.indices.resize(csc.indptr.back());
+            csc.vals.resize(csc.indptr.back());
+        }
+        Eigen::Map<const eigen_matrix<IT, VT>> A(csc.nrows, csc.ncols, (Eigen::Index)csc.indices.size(),
+                                  csc.indptr.data(), csc.indices.data(), csc.vals.data());
+        benchmark::DoNotOptimize(A.nonZeros());
+
+        meter.record_structure(csc.size_bytes());
+        meter.stop();
+
+        {
+            auto t = timer.time(phase::deallocate);
+            csc = {};
+        }
+
+        num_bytes += std::filesystem::file_size(prob.mm_path);
+        benchmark::ClobberMemory();
+    }
+
+    meter.report(prob.nnz, num_bytes);
+    timer.report(options.num_threads);
+    state.SetBytesProcessed((int64_t)num_bytes);
+    state.SetLabel("problem_name=" + prob.name);
+}
+
+BENCHMARK_TEMPLATE(eigen_read_FMM_map, int32_t, double, cache_mode::cold)->Name("op:read/impl:Eigen_FMM_map/format:MatrixMarket/index:int32/value:double/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read_FMM_map, int32_t, double, cache_mode::warm)->Name("op:read/impl:Eigen_FMM_map/format:MatrixMarket/index:int32/value:double/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read_FMM_map, int32_t, float, cache_mode::cold)->Name("op:read/impl:Eigen_FMM_map/format:MatrixMarket/index:int32/value:float/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(eigen_read_FMM_map, int32_t, float, cache_mode::warm)->Name("op:read/impl:Eigen_FMM_map/format:MatrixMarket/index:int32/value:float/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
 
 /**
  * Write MatrixMarket with Eigen.
@@ -54,10 +386,15 @@ void eigen_write_FMM(benchmark::State& state) {
 
     auto out_path = temporary_write_dir / ("write_" + prob.name + ".mtx");
 
+    memory_meter meter{state};
+
     for ([[maybe_unused]] auto _ : state) {
+        meter.start();
         std::ofstream f{out_path, std::ios_base::binary};
         fast_matrix_market::write_matrix_market_eigen(f, A);
 
+        meter.stop();
+
         num_bytes += std::filesystem::file_size(out_path);
         benchmark::ClobberMemory();
     }
@@ -65,6 +402,7 @@ void eigen_write_FMM(benchmark::State& state) {
     if (delete_written_files_on_finish) {
         std::filesystem::remove(out_path);
     }
+    meter.report(prob.nnz, num_bytes);
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
@@ -2,48 +2,75 @@
 // Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
 // SPDX-License-Identifier: BSD-2-Clause
 
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <mutex>
+
 #include "common.hpp"
+#include "compress.hpp"
+#include "matrices.hpp"
+#include "parse_handlers.hpp"
+#include "phase_timer.hpp"
+#include "pipelined_write_stream.hpp"
+#include "read_backends.hpp"
 #include <fast_matrix_market/fast_matrix_market.hpp>
 
-template <typename IT, typename VT>
-struct triplet_matrix {
-    int64_t nrows = 0, ncols = 0;
-    std::vector<IT> rows;
-    std::vector<IT> cols;
-    std::vector<VT> vals;
-
-    [[nodiscard]] size_t size_bytes() const {
-        return sizeof(IT)*rows.size() + sizeof(IT)*cols.size() + sizeof(VT)*vals.size();
-    }
-};
+/*
+ * The fast_matrix_market benchmarks are registered for every combination of int32/int64 indices and float/double
+ * values, plus pattern (no values). The types appear in the benchmark name as `index:<type>/value:<type>`.
+ * Problems whose dimensions do not fit the index type are skipped with an index overflow error.
+ */
 
-template <typename IT, typename VT>
-struct csc_matrix {
-    int64_t nrows = 0, ncols = 0;
-    std::vector<IT> indptr;
-    std::vector<IT> indices;
-    std::vector<VT> vals;
-
-    [[nodiscard]] size_t size_bytes() const {
-        return sizeof(IT)*indptr.size() + sizeof(IT)*indices.size() + sizeof(VT)*vals.size();
+/**
+ * Read a Matrix Market body with `handler`. If there is a `timer`, each parsed chunk is added to it.
+ */
+template <typename HANDLER>
+void read_body(std::istream& instream, const fast_matrix_market::matrix_market_header& header, HANDLER& handler,
+               const fast_matrix_market::read_options& options, phase_timer* timer) {
+    if (timer == nullptr) {
+        fast_matrix_market::read_matrix_market_body(instream, header, handler, 1, options);
+        return;
     }
-};
-
-template <typename VT>
-struct array_matrix {
-    int64_t nrows = 0, ncols = 0;
-    std::vector<VT> vals;
+    timed_parse_handler<HANDLER> timed_handler(handler, [timer](auto begin, auto end) {
+        timer->add_parse_chunk(begin, end);
+    });
+    fast_matrix_market::read_matrix_market_body(instream, header, timed_handler, 1, options);
+}
 
-    [[nodiscard]] size_t size_bytes() const {
-        return sizeof(VT)*vals.size();
+/**
+ * Read a Matrix Market file into triplets of the requested types. Pattern reads keep only the coordinates.
+ */
+template <typename IT, typename VT>
+void read_triplet(std::istream& instream, fast_matrix_market::matrix_market_header& header,
+                  triplet_matrix<IT, VT>& triplet, const fast_matrix_market::read_options& options,
+                  phase_timer* timer = nullptr) {
+    fast_matrix_market::read_header(instream, header);
+    auto storage_nnz = fast_matrix_market::get_storage_nnz(header, options);
+    triplet.rows.resize(storage_nnz);
+    triplet.cols.resize(storage_nnz);
+    if constexpr (is_pattern_v<VT>) {
+        auto handler = coordinate_parse_handler(triplet.rows.begin(), triplet.cols.begin());
+        read_body(instream, header, handler, options, timer);
+    } else {
+        triplet.vals.resize(storage_nnz);
+        auto handler = fast_matrix_market::triplet_parse_handler(triplet.rows.begin(), triplet.cols.begin(),
+                                                                 triplet.vals.begin());
+        read_body(instream, header, handler, options, timer);
     }
-};
+    triplet.nrows = header.nrows;
+    triplet.ncols = header.ncols;
+}
 
 /**
  * Read MatrixMarket with fast_matrix_market.
  */
+template <typename IT, typename VT, cache_mode CACHE>
 void FMM_read(benchmark::State& state) {
     problem& prob = get_problem((int)state.range(0));
+    if (!check_index_type<IT>(state, prob)) {
+        return;
+    }
 
     // read options
     fast_matrix_market::read_options options{};
@@ -51,109 +78,320 @@ void FMM_read(benchmark::State& state) {
     options.num_threads = (int)state.range(1);
 
     std::size_t num_bytes = 0;
+    memory_meter meter{state};
+    phase_timer timer{state, "FMM " + prob.name};
 
     for ([[maybe_unused]] auto _ : state) {
+        if (!prepare_page_cache(state, prob.mm_path, CACHE)) {
+            break;
+        }
+        meter.start();
+
         fast_matrix_market::matrix_market_header header;
-        triplet_matrix<INDEX_TYPE, VALUE_TYPE> triplet;
+        triplet_matrix<IT, VT> triplet;
+
+        try {
+            auto t = timer.time(phase::parse);
+            timed_ifstream iss(prob.mm_path, timer);
+            read_triplet(iss, header, triplet, options, &timer);
+        } catch (const fast_matrix_market::out_of_range& e) {
+            state.SkipWithError((std::string("Index overflow: ") + e.what()).c_str());
+            break;
+        }
+        meter.record_structure(triplet.size_bytes());
+        meter.stop();
+
+        {
+            auto t = timer.time(phase::deallocate);
+            triplet = {};
+        }
 
-        std::ifstream iss(prob.mm_path);
-        fast_matrix_market::read_matrix_market_triplet(iss, header, triplet.rows, triplet.cols, triplet.vals, options);
         num_bytes += std::filesystem::file_size(prob.mm_path);
         benchmark::ClobberMemory();
     }
 
+    meter.report(prob.nnz, num_bytes);
+    timer.report(options.num_threads);
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
 
-BENCHMARK(FMM_read)->Name("op:read/impl:FMM/format:MatrixMarket")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read, int32_t, float, cache_mode::cold)->Name("op:read/impl:FMM/format:MatrixMarket/index:int32/value:float/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read, int32_t, float, cache_mode::warm)->Name("op:read/impl:FMM/format:MatrixMarket/index:int32/value:float/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read, int32_t, double, cache_mode::cold)->Name("op:read/impl:FMM/format:MatrixMarket/index:int32/value:double/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read, int32_t, double, cache_mode::warm)->Name("op:read/impl:FMM/format:MatrixMarket/index:int32/value:double/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read, int64_t, float, cache_mode::cold)->Name("op:read/impl:FMM/format:MatrixMarket/index:int64/value:float/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read, int64_t, float, cache_mode::warm)->Name("op:read/impl:FMM/format:MatrixMarket/index:int64/value:float/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read, int64_t, double, cache_mode::cold)->Name("op:read/impl:FMM/format:MatrixMarket/index:int64/value:double/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read, int64_t, double, cache_mode::warm)->Name("op:read/impl:FMM/format:MatrixMarket/index:int64/value:double/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read, int32_t, pattern_value, cache_mode::cold)->Name("op:read/impl:FMM/format:MatrixMarket/index:int32/value:pattern/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read, int32_t, pattern_value, cache_mode::warm)->Name("op:read/impl:FMM/format:MatrixMarket/index:int32/value:pattern/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read, int64_t, pattern_value, cache_mode::cold)->Name("op:read/impl:FMM/format:MatrixMarket/index:int64/value:pattern/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read, int64_t, pattern_value, cache_mode::warm)->Name("op:read/impl:FMM/format:MatrixMarket/index:int64/value:pattern/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
 
 /**
- * Write MatrixMarket with fast_matrix_market.
+ * Read MatrixMarket with fast_matrix_market into CSC or CSR.
+ *
+ * Includes the conversion from triplets, like the Eigen and GraphBLAS reads include their matrix construction.
+ * Files already ordered along the compressed dimension skip the sort.
  */
-void FMM_write(benchmark::State& state) {
-    std::size_t num_bytes = 0;
-
+template <typename IT, typename VT, cache_mode CACHE, bool CSR>
+void FMM_read_compressed(benchmark::State& state) {
     problem& prob = get_problem((int)state.range(0));
+    if (!check_index_type<IT>(state, prob, true)) {
+        return;
+    }
 
-    fast_matrix_market::write_options options;
+    // read options
+    fast_matrix_market::read_options options{};
     options.parallel_ok = true;
     options.num_threads = (int)state.range(1);
 
-    // load the problem to be written later
-    triplet_matrix<INDEX_TYPE, VALUE_TYPE> triplet;
-    {
-        std::ifstream f(prob.mm_path);
-        fast_matrix_market::read_matrix_market_triplet(f, triplet.nrows, triplet.ncols, triplet.rows, triplet.cols, triplet.vals);
+    std::size_t num_bytes = 0;
+    memory_meter meter{state};
+    phase_timer timer{state, (CSR ? "FMM->CSR " : "FMM->CSC ") + prob.name};
+
+    for ([[maybe_unused]] auto _ : state) {
+        if (!prepare_page_cache(state, prob.mm_path, CACHE)) {
+            break;
+        }
+        meter.start();
+
+        csc_matrix<IT, VT> compressed;
+        {
+            fast_matrix_market::matrix_market_header header;
+            triplet_matrix<IT, VT> triplet;
+
+            try {
+                auto t = timer.time(phase::parse);
+                timed_ifstream iss(prob.mm_path, timer);
+                read_triplet(iss, header, triplet, options, &timer);
+            } catch (const fast_matrix_market::out_of_range& e) {
+                state.SkipWithError((std::string("Index overflow: ") + e.what()).c_str());
+                break;
+            }
+
+            auto t = timer.time(phase::construct);
+            compressed.nrows = header.nrows;
+            compressed.ncols = header.ncols;
+            if (CSR) {
+                compress_triplets(header.nrows, triplet.rows, triplet.cols, triplet.vals,
+                                  compressed.indptr, compressed.indices, compressed.vals, options.num_threads);
+            } else {
+                compress_triplets(header.ncols, triplet.cols, triplet.rows, triplet.vals,
+                                  compressed.indptr, compressed.indices, compressed.vals, options.num_threads);
+            }
+        }
+        meter.record_structure(compressed.size_bytes());
+        meter.stop();
+
+        {
+            auto t = timer.time(phase::deallocate);
+            compressed = {};
+        }
+
+        num_bytes += std::filesystem::file_size(prob.mm_path);
+        benchmark::ClobberMemory();
     }
 
-    auto out_path = temporary_write_dir / ("write_" + prob.name + ".mtx");
+    meter.report(prob.nnz, num_bytes);
+    timer.report(options.num_threads);
+    state.SetBytesProcessed((int64_t)num_bytes);
+    state.SetLabel("problem_name=" + prob.name);
+}
+
+BENCHMARK_TEMPLATE(FMM_read_compressed, int32_t, float, cache_mode::cold, false)->Name("op:read/impl:FMM/format:MatrixMarket->CSC/index:int32/value:float/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int32_t, float, cache_mode::warm, false)->Name("op:read/impl:FMM/format:MatrixMarket->CSC/index:int32/value:float/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int32_t, double, cache_mode::cold, false)->Name("op:read/impl:FMM/format:MatrixMarket->CSC/index:int32/value:double/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int32_t, double, cache_mode::warm, false)->Name("op:read/impl:FMM/format:MatrixMarket->CSC/index:int32/value:double/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int64_t, float, cache_mode::cold, false)->Name("op:read/impl:FMM/format:MatrixMarket->CSC/index:int64/value:float/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int64_t, float, cache_mode::warm, false)->Name("op:read/impl:FMM/format:MatrixMarket->CSC/index:int64/value:float/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int64_t, double, cache_mode::cold, false)->Name("op:read/impl:FMM/format:MatrixMarket->CSC/index:int64/value:double/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int64_t, double, cache_mode::warm, false)->Name("op:read/impl:FMM/format:MatrixMarket->CSC/index:int64/value:double/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int32_t, pattern_value, cache_mode::cold, false)->Name("op:read/impl:FMM/format:MatrixMarket->CSC/index:int32/value:pattern/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int32_t, pattern_value, cache_mode::warm, false)->Name("op:read/impl:FMM/format:MatrixMarket->CSC/index:int32/value:pattern/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int64_t, pattern_value, cache_mode::cold, false)->Name("op:read/impl:FMM/format:MatrixMarket->CSC/index:int64/value:pattern/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int64_t, pattern_value, cache_mode::warm, false)->Name("op:read/impl:FMM/format:MatrixMarket->CSC/index:int64/value:pattern/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int32_t, float, cache_mode::cold, true)->Name("op:read/impl:FMM/format:MatrixMarket->CSR/index:int32/value:float/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int32_t, float, cache_mode::warm, true)->Name("op:read/impl:FMM/format:MatrixMarket->CSR/index:int32/value:float/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int32_t, double, cache_mode::cold, true)->Name("op:read/impl:FMM/format:MatrixMarket->CSR/index:int32/value:double/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int32_t, double, cache_mode::warm, true)->Name("op:read/impl:FMM/format:MatrixMarket->CSR/index:int32/value:double/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int64_t, float, cache_mode::cold, true)->Name("op:read/impl:FMM/format:MatrixMarket->CSR/index:int64/value:float/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int64_t, float, cache_mode::warm, true)->Name("op:read/impl:FMM/format:MatrixMarket->CSR/index:int64/value:float/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int64_t, double, cache_mode::cold, true)->Name("op:read/impl:FMM/format:MatrixMarket->CSR/index:int64/value:double/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int64_t, double, cache_mode::warm, true)->Name("op:read/impl:FMM/format:MatrixMarket->CSR/index:int64/value:double/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int32_t, pattern_value, cache_mode::cold, true)->Name("op:read/impl:FMM/format:MatrixMarket->CSR/index:int32/value:pattern/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int32_t, pattern_value, cache_mode::warm, true)->Name("op:read/impl:FMM/format:MatrixMarket->CSR/index:int32/value:pattern/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int64_t, pattern_value, cache_mode::cold, true)->Name("op:read/impl:FMM/format:MatrixMarket->CSR/index:int64/value:pattern/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_compressed, int64_t, pattern_value, cache_mode::warm, true)->Name("op:read/impl:FMM/format:MatrixMarket->CSR/index:int64/value:pattern/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+
+/**
+ * Read MatrixMarket with fast_matrix_market from an ifstream, a memory map, or io_uring with O_DIRECT.
+ *
+ * Only the I/O backend differs, so the benchmarks show how much of a read is spent waiting on the file.
+ * The io_uring reads bypass the page cache, so they read from storage even in the `cache:warm` state.
+ */
+template <read_backend BACKEND, cache_mode CACHE>
+void FMM_read_backend(benchmark::State& state) {
+    problem& prob = get_problem((int)state.range(0));
+
+    // read options
+    fast_matrix_market::read_options options{};
+    options.parallel_ok = true;
+    options.num_threads = (int)state.range(1);
+
+    std::size_t num_bytes = 0;
+    [[maybe_unused]] bool direct = false;
+    memory_meter meter{state};
+    phase_timer timer{state, std::string("FMM(") + read_backend_name(BACKEND) + ") " + prob.name};
 
     for ([[maybe_unused]] auto _ : state) {
-#define USE_OSS 0
-#if USE_OSS
-        std::ostringstream oss;
-#else
-        std::ofstream oss{out_path, std::ios_base::binary};
-#endif
+        if (!prepare_page_cache(state, prob.mm_path, CACHE)) {
+            break;
+        }
+        meter.start();
 
-        fast_matrix_market::write_matrix_market_triplet(oss,
-                                                        {triplet.nrows, triplet.ncols},
-                                                        triplet.rows, triplet.cols, triplet.vals,
-                                                        options);
-#if USE_OSS
-        num_bytes += oss.str().size();
-#else
-        num_bytes += std::filesystem::file_size(out_path);
+        fast_matrix_market::matrix_market_header header;
+        triplet_matrix<int64_t, double> triplet;
+
+        try {
+            auto t = timer.time(phase::parse);
+            if constexpr (BACKEND == read_backend::ifstream) {
+                timed_ifstream iss(prob.mm_path, timer);
+                read_triplet(iss, header, triplet, options, &timer);
+            } else if constexpr (BACKEND == read_backend::mmap) {
+                mmap_streambuf buf(prob.mm_path);
+                std::istream iss(&buf);
+                read_triplet(iss, header, triplet, options, &timer);
+            } else {
+#ifdef HAVE_IO_URING
+                uring_streambuf buf(prob.mm_path, true, &timer);
+                direct = buf.is_direct();
+                std::istream iss(&buf);
+                // read errors would otherwise only set badbit, which reads as the end of the file
+                iss.exceptions(std::ios::badbit);
+                read_triplet(iss, header, triplet, options, &timer);
 #endif
+            }
+        } catch (const fast_matrix_market::out_of_range& e) {
+            state.SkipWithError((std::string("Index overflow: ") + e.what()).c_str());
+            break;
+        } catch (const std::runtime_error& e) {
+            state.SkipWithError(e.what());
+            break;
+        }
+        meter.record_structure(triplet.size_bytes());
+        meter.stop();
+
+        {
+            auto t = timer.time(phase::deallocate);
+            triplet = {};
+        }
+
+        num_bytes += std::filesystem::file_size(prob.mm_path);
         benchmark::ClobberMemory();
     }
 
-    if (delete_written_files_on_finish) {
-        std::filesystem::remove(out_path);
+    meter.report(prob.nnz, num_bytes);
+    timer.report(options.num_threads);
+#ifdef HAVE_IO_URING
+    if (BACKEND == read_backend::io_uring) {
+        state.counters["o_direct"] = direct ? 1 : 0;
+        state.counters["queue_depth"] = uring_streambuf::default_queue_depth;
     }
+#endif
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
 
-BENCHMARK(FMM_write)->Name("op:write/impl:FMM/format:MatrixMarket")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_backend, read_backend::ifstream, cache_mode::cold)->Name("op:read/impl:FMM/format:MatrixMarket/io:ifstream/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_backend, read_backend::ifstream, cache_mode::warm)->Name("op:read/impl:FMM/format:MatrixMarket/io:ifstream/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_backend, read_backend::mmap, cache_mode::cold)->Name("op:read/impl:FMM/format:MatrixMarket/io:mmap/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_backend, read_backend::mmap, cache_mode::warm)->Name("op:read/impl:FMM/format:MatrixMarket/io:mmap/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+#ifdef HAVE_IO_URING
+BENCHMARK_TEMPLATE(FMM_read_backend, read_backend::io_uring, cache_mode::cold)->Name("op:read/impl:FMM/format:MatrixMarket/io:io_uring/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_read_backend, read_backend::io_uring, cache_mode::warm)->Name("op:read/impl:FMM/format:MatrixMarket/io:io_uring/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+#endif
 
 /**
- * Write MatrixMarket with fast_matrix_market.
+ * Write MatrixMarket with fast_matrix_market. Pattern writes omit the values.
+ *
+ * If PIPELINED, the output goes through a pipelined_write_streambuf instead of a std::ofstream, so formatting
+ * threads keep working while a writer thread waits on the disk.
+ *
+ * Reports `overlap_efficiency`, the CPU time of all threads divided by the wall time of the write. A write that is
+ * serialized on the output stream stays near 1 no matter how many threads format.
  */
-void FMM_write_pattern(benchmark::State& state) {
+template <typename IT, typename VT, bool PIPELINED = false>
+void FMM_write(benchmark::State& state) {
     std::size_t num_bytes = 0;
 
     problem& prob = get_problem((int)state.range(0));
+    if (!check_index_type<IT>(state, prob)) {
+        return;
+    }
 
     fast_matrix_market::write_options options;
     options.parallel_ok = true;
     options.num_threads = (int)state.range(1);
 
     // load the problem to be written later
-    triplet_matrix<INDEX_TYPE, VALUE_TYPE> triplet;
-    {
-        std::ifstream f(prob.mm_path);
-        fast_matrix_market::read_matrix_market_triplet(f, triplet.nrows, triplet.ncols, triplet.rows, triplet.cols, triplet.vals);
-
-        // do not care about the values
-        triplet.vals.clear();
+    triplet_matrix<IT, VT> triplet;
+    convert_triplet(*get_reference_triplet(prob), triplet);
+
+    // pattern matrices are written from an empty value vector
+    using WRITE_VT = std::conditional_t<is_pattern_v<VT>, double, VT>;
+    std::vector<WRITE_VT> no_vals;
+    const std::vector<WRITE_VT>* vals = &no_vals;
+    if constexpr (!is_pattern_v<VT>) {
+        vals = &triplet.vals;
     }
 
-    auto out_path = temporary_write_dir / ("write_" + prob.name + "-pattern.mtx");
+    auto out_path = temporary_write_dir / ("write_" + prob.name + (is_pattern_v<VT> ? "-pattern.mtx" : ".mtx"));
+
+    auto write = [&](std::ostream& os) {
+        fast_matrix_market::write_matrix_market_triplet(os,
+                                                        {triplet.nrows, triplet.ncols},
+                                                        triplet.rows, triplet.cols, *vals,
+                                                        options);
+    };
+
+    memory_meter meter{state};
+    double wall_seconds = 0;
+    double cpu_seconds = 0;
+    double writer_seconds = 0;
+    double stall_seconds = 0;
 
     for ([[maybe_unused]] auto _ : state) {
+        meter.start();
+        auto wall_begin = std::chrono::steady_clock::now();
+        std::clock_t cpu_begin = std::clock();
 #define USE_OSS 0
 #if USE_OSS
         std::ostringstream oss;
+        write(oss);
 #else
-        std::ofstream oss{out_path, std::ios_base::binary};
+        if constexpr (PIPELINED) {
+            // Opening the file and the writer thread's pwritev errors throw, the latter from close().
+            try {
+                pipelined_write_streambuf buf(out_path);
+                std::ostream oss(&buf);
+                write(oss);
+                buf.close();
+                writer_seconds += buf.write_seconds();
+                stall_seconds += buf.stall_seconds();
+            } catch (const std::exception& e) {
+                state.SkipWithError(e.what());
+                break;
+            }
+        } else {
+            std::ofstream oss{out_path, std::ios_base::binary};
+            write(oss);
+        }
 #endif
-
-        fast_matrix_market::write_matrix_market_triplet(oss,
-                                                        {triplet.nrows, triplet.ncols},
-                                                        triplet.rows, triplet.cols, triplet.vals,
-                                                        options);
+        cpu_seconds += (double)(std::clock() - cpu_begin) / CLOCKS_PER_SEC;
+        wall_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_begin).count();
+        meter.stop();
 #if USE_OSS
         num_bytes += oss.str().size();
 #else
@@ -165,8 +403,107 @@ void FMM_write_pattern(benchmark::State& state) {
     if (delete_written_files_on_finish) {
         std::filesystem::remove(out_path);
     }
+    meter.report(prob.nnz, num_bytes);
+    if (wall_seconds > 0) {
+        state.counters["overlap_efficiency"] = cpu_seconds / wall_seconds;
+        if (PIPELINED) {
+            // Fraction of the write the writer thread spent in pwritev, and the formatters spent waiting for it.
+            state.counters["writer_busy"] = writer_seconds / wall_seconds;
+            state.counters["format_stall"] = stall_seconds / wall_seconds;
+        }
+    }
+    state.SetBytesProcessed((int64_t)num_bytes);
+    state.SetLabel("problem_name=" + prob.name);
+}
+
+BENCHMARK_TEMPLATE(FMM_write, int32_t, float)->Name("op:write/impl:FMM/format:MatrixMarket/index:int32/value:float")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_write, int32_t, double)->Name("op:write/impl:FMM/format:MatrixMarket/index:int32/value:double")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_write, int64_t, float)->Name("op:write/impl:FMM/format:MatrixMarket/index:int64/value:float")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_write, int64_t, double)->Name("op:write/impl:FMM/format:MatrixMarket/index:int64/value:double")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_write, int32_t, pattern_value)->Name("op:write/impl:FMM/format:MatrixMarket/index:int32/value:pattern")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_write, int64_t, pattern_value)->Name("op:write/impl:FMM/format:MatrixMarket/index:int64/value:pattern")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_write, int64_t, double, true)->Name("op:write/impl:FMM/format:MatrixMarket/io:pipelined/index:int64/value:double")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(FMM_write, int64_t, pattern_value, true)->Name("op:write/impl:FMM/format:MatrixMarket/io:pipelined/index:int64/value:pattern")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+
+/**
+ * What a streaming read computes from each batch.
+ */
+enum class stream_consumer {
+    /**
+     * Number of entries in each row.
+     */
+    row_degrees,
+
+    /**
+     * Sum of all values.
+     */
+    value_sum
+};
+
+/**
+ * Stream MatrixMarket through fast_matrix_market in fixed-size batches without storing the matrix.
+ *
+ * Batches are consumed on the parser's worker threads. Memory is bounded by one batch per thread plus the consumer's
+ * own result, which peak_rss_delta confirms.
+ */
+void FMM_stream(benchmark::State& state, cache_mode cache, stream_consumer consumer) {
+    constexpr std::size_t batch_size = 1u << 16;
+    problem& prob = get_problem((int)state.range(0));
+
+    // read options
+    fast_matrix_market::read_options options{};
+    options.parallel_ok = true;
+    options.num_threads = (int)state.range(1);
+
+    std::size_t num_bytes = 0;
+    memory_meter meter{state};
+
+    for ([[maybe_unused]] auto _ : state) {
+        if (!prepare_page_cache(state, prob.mm_path, cache)) {
+            break;
+        }
+        meter.start();
+
+        std::ifstream iss(prob.mm_path);
+        fast_matrix_market::matrix_market_header header;
+        fast_matrix_market::read_header(iss, header);
+
+        std::vector<std::atomic<int64_t>> degrees(consumer == stream_consumer::row_degrees ? header.nrows : 0);
+        std::mutex sum_mutex;
+        double sum = 0;
+
+        batching_parse_handler<INDEX_TYPE, VALUE_TYPE> handler(batch_size, [&](const auto& batch) {
+            if (consumer == stream_consumer::row_degrees) {
+                for (auto row : batch.rows) {
+                    degrees[row].fetch_add(1, std::memory_order_relaxed);
+                }
+            } else {
+                double batch_sum = 0;
+                for (auto value : batch.vals) {
+                    batch_sum += value;
+                }
+                std::lock_guard<std::mutex> lock(sum_mutex);
+                sum += batch_sum;
+            }
+        });
+        fast_matrix_market::read_matrix_market_body(iss, header, handler, 1, options);
+        handler.flush();
+
+        meter.record_structure(degrees.size() * sizeof(int64_t));
+        meter.stop();
+
+        benchmark::DoNotOptimize(sum);
+        num_bytes += std::filesystem::file_size(prob.mm_path);
+        benchmark::ClobberMemory();
+    }
+
+    meter.report(prob.nnz, num_bytes);
+    state.counters["batch_size"] = (double)batch_size;
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
 
-BENCHMARK(FMM_write_pattern)->Name("op:write/impl:FMM/format:MatrixMarket(pattern)")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(FMM_stream, degrees_cold, cache_mode::cold, stream_consumer::row_degrees)->Name("op:stream/impl:FMM/format:MatrixMarket/consumer:row_degrees/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(FMM_stream, degrees_warm, cache_mode::warm, stream_consumer::row_degrees)->Name("op:stream/impl:FMM/format:MatrixMarket/consumer:row_degrees/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(FMM_stream, sum_cold, cache_mode::cold, stream_consumer::value_sum)->Name("op:stream/impl:FMM/format:MatrixMarket/consumer:value_sum/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(FMM_stream, sum_warm, cache_mode::warm, stream_consumer::value_sum)->Name("op:stream/impl:FMM/format:MatrixMarket/consumer:value_sum/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
@@ -2,16 +2,25 @@
 // Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
 // SPDX-License-Identifier: BSD-2-Clause
 
+#include <algorithm>
+
 #include "common.hpp"
+#include "compress.hpp"
+#include "matrices.hpp"
+#include "phase_timer.hpp"
 #include <fast_matrix_market/app/GraphBLAS.hpp>
 
 /**
  * Initialize and finalize GraphBLAS using a global so the rest of the code doesn't have to worry about it.
  * GraphBLAS needs GrB_init() to be called before any other methods, else you get a GrB_PANIC.
+ *
+ * When bench_all also links bench_lagraph.cpp, LAGr_Init() initializes GraphBLAS instead, with the same allocators.
  */
+#ifndef HAVE_LAGRAPH
 struct GraphBLASInitializer {
     GraphBLASInitializer() {
-        GrB_init(GrB_BLOCKING);
+        // count GraphBLAS's allocations along with C++ allocations
+        GxB_init(GrB_BLOCKING, counting_malloc, counting_calloc, counting_realloc, counting_free);
     }
 
     ~GraphBLASInitializer() {
@@ -19,11 +28,23 @@ struct GraphBLASInitializer {
     }
 };
 [[maybe_unused]] GraphBLASInitializer graphblas_init_and_finalizer{};
+#endif
+
+/**
+ * Memory used by a GraphBLAS matrix. Requires SuiteSparse:GraphBLAS 7 or newer, else returns 0.
+ */
+static std::size_t size_bytes([[maybe_unused]] GrB_Matrix mat) {
+    std::size_t size = 0;
+#if defined(GxB_IMPLEMENTATION_MAJOR) && GxB_IMPLEMENTATION_MAJOR >= 7
+    GxB_Matrix_memoryUsage(&size, mat);
+#endif
+    return size;
+}
 
 /**
  * Read MatrixMarket with fast_matrix_market.
  */
-void GraphBLAS_read_FMM(benchmark::State& state) {
+void GraphBLAS_read_FMM(benchmark::State& state, cache_mode cache) {
     problem& prob = get_problem((int)state.range(0));
 
     // read options
@@ -32,23 +53,176 @@ void GraphBLAS_read_FMM(benchmark::State& state) {
     options.num_threads = (int)state.range(1);
 
     std::size_t num_bytes = 0;
+    memory_meter meter{state};
 
     for ([[maybe_unused]] auto _ : state) {
+        if (!prepare_page_cache(state, prob.mm_path, cache)) {
+            break;
+        }
+        meter.start();
+
         std::ifstream iss(prob.mm_path);
 
         GrB_Matrix mat;
         fast_matrix_market::read_matrix_market_graphblas(iss, &mat, options);
+
+        meter.record_structure(size_bytes(mat));
+        meter.stop();
         GrB_Matrix_free(&mat);
 
         num_bytes += std::filesystem::file_size(prob.mm_path);
         benchmark::ClobberMemory();
     }
 
+    meter.report(prob.nnz, num_bytes);
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
 
-BENCHMARK(GraphBLAS_read_FMM)->Name("op:read/impl:GraphBLAS_FMM/format:MatrixMarket")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(GraphBLAS_read_FMM, cold, cache_mode::cold)->Name("op:read/impl:GraphBLAS_FMM/format:MatrixMarket/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(GraphBLAS_read_FMM, warm, cache_mode::warm)->Name("op:read/impl:GraphBLAS_FMM/format:MatrixMarket/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+
+/**
+ * Size in bytes of an array of `n` T allocated for GraphBLAS. GraphBLAS does not accept NULL arrays, even when empty,
+ * so at least one element is allocated.
+ */
+template <typename T>
+std::size_t graphblas_array_size(int64_t n) {
+    return std::max(n, (int64_t)1) * sizeof(T);
+}
+
+/**
+ * Allocate an array of `n` T with GraphBLAS's malloc, so GraphBLAS can take ownership of it.
+ */
+template <typename T>
+T* alloc_graphblas_array(int64_t n) {
+    return static_cast<T*>(counting_malloc(graphblas_array_size<T>(n)));
+}
+
+/**
+ * Whether GraphBLAS_read_FMM_import can import the file directly. Others fall back to the fast_matrix_market binding.
+ *
+ * Only general real and pattern matrices are imported. Pattern matrices are imported as GrB_FP64 ones.
+ * Symmetric matrices are left to the binding, which generalizes them.
+ */
+bool can_import_directly(const fast_matrix_market::matrix_market_header& header) {
+    return header.object == fast_matrix_market::matrix &&
+           header.format == fast_matrix_market::coordinate &&
+           header.symmetry == fast_matrix_market::general &&
+           (header.field == fast_matrix_market::real || header.field == fast_matrix_market::double_ ||
+            header.field == fast_matrix_market::pattern);
+}
+
+/**
+ * Read MatrixMarket with fast_matrix_market and import the result as CSR, without GrB_Matrix_build.
+ *
+ * The triplets are partitioned by row with the parallel counting sort from compress.hpp, directly into arrays
+ * allocated with GraphBLAS's malloc, so the import takes them over without a copy. CSR import does not accept
+ * duplicate entries, so each row's columns are then sorted and duplicates are summed, as GrB_Matrix_build with a
+ * plus operator would. Reports the number of summed entries per iteration as `duplicates_summed`.
+ *
+ * Files that cannot be imported directly go through the binding, which parses and builds in one call, so their
+ * whole read is timed as the parse phase.
+ */
+void GraphBLAS_read_FMM_import(benchmark::State& state, cache_mode cache) {
+    problem& prob = get_problem((int)state.range(0));
+
+    // read options
+    fast_matrix_market::read_options options{};
+    options.parallel_ok = true;
+    options.num_threads = (int)state.range(1);
+
+    bool direct;
+    {
+        std::ifstream f(prob.mm_path);
+        fast_matrix_market::matrix_market_header header;
+        fast_matrix_market::read_header(f, header);
+        direct = can_import_directly(header);
+    }
+
+    std::size_t num_bytes = 0;
+    int64_t duplicates = 0;
+    memory_meter meter{state};
+    phase_timer timer{state, "GraphBLAS_FMM_import " + prob.name};
+
+    for ([[maybe_unused]] auto _ : state) {
+        if (!prepare_page_cache(state, prob.mm_path, cache)) {
+            break;
+        }
+        meter.start();
+
+        timed_ifstream iss(prob.mm_path, timer);
+
+        GrB_Matrix mat;
+        if (direct) {
+            fast_matrix_market::matrix_market_header header;
+            int64_t nnz;
+            GrB_Index* Ap;
+            GrB_Index* Aj;
+            void* Ax;
+            {
+                triplet_matrix<GrB_Index, double> triplet;
+                {
+                    auto t = timer.time(phase::parse);
+                    fast_matrix_market::read_matrix_market_triplet(iss, header, triplet.rows, triplet.cols, triplet.vals, options);
+                }
+
+                auto t = timer.time(phase::construct);
+                // pattern files are read with values of 1, so there is always a value array
+                nnz = (int64_t)triplet.rows.size();
+                Ap = alloc_graphblas_array<GrB_Index>(header.nrows + 1);
+                Aj = alloc_graphblas_array<GrB_Index>(nnz);
+                Ax = alloc_graphblas_array<double>(nnz);
+                triplet_compressor<GrB_Index, double>(header.nrows, triplet.rows, triplet.cols, triplet.vals)
+                    .compress_into(Ap, Aj, static_cast<double*>(Ax), options.num_threads);
+            }
+
+            auto t = timer.time(phase::construct);
+            sort_inner_indices(header.nrows, Ap, Aj, static_cast<double*>(Ax), options.num_threads);
+            duplicates += sum_duplicates(header.nrows, Ap, Aj, static_cast<double*>(Ax), options.num_threads);
+
+            // the sizes are of the allocations, which may be larger than the entries left after summing
+            GrB_Info info = GxB_Matrix_import_CSR(&mat, GrB_FP64, header.nrows, header.ncols, &Ap, &Aj, &Ax,
+                                                  graphblas_array_size<GrB_Index>(header.nrows + 1),
+                                                  graphblas_array_size<GrB_Index>(nnz),
+                                                  graphblas_array_size<double>(nnz),
+                                                  false, false, nullptr);
+            if (info != GrB_SUCCESS) {
+                // GraphBLAS only takes ownership of the arrays on success
+                counting_free(Ap);
+                counting_free(Aj);
+                counting_free(Ax);
+                state.SkipWithError(("GxB_Matrix_import_CSR failed with GrB_Info " + std::to_string(info)).c_str());
+                break;
+            }
+        } else {
+            auto t = timer.time(phase::parse);
+            fast_matrix_market::read_matrix_market_graphblas(iss, &mat, options);
+        }
+
+        meter.record_structure(size_bytes(mat));
+        meter.stop();
+        {
+            auto t = timer.time(phase::deallocate);
+            GrB_Matrix_free(&mat);
+        }
+
+        num_bytes += std::filesystem::file_size(prob.mm_path);
+        benchmark::ClobberMemory();
+    }
+
+    meter.report(prob.nnz, num_bytes);
+    timer.report(options.num_threads);
+    state.counters["direct_import"] = direct ? 1 : 0;
+    if (direct) {
+        state.counters["duplicates_summed"] = benchmark::Counter((double)duplicates, benchmark::Counter::kAvgIterations);
+    }
+    state.SetBytesProcessed((int64_t)num_bytes);
+    state.SetLabel("problem_name=" + prob.name);
+}
+
+BENCHMARK_CAPTURE(GraphBLAS_read_FMM_import, cold, cache_mode::cold)->Name("op:read/impl:GraphBLAS_FMM_import/format:MatrixMarket/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(GraphBLAS_read_FMM_import, warm, cache_mode::warm)->Name("op:read/impl:GraphBLAS_FMM_import/format:MatrixMarket/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
 
 /**
  * Write MatrixMarket with fast_matrix_market.
@@ -71,11 +245,16 @@ void GraphBLAS_write_FMM(benchmark::State& state) {
 
     auto out_path = temporary_write_dir / ("write_" + prob.name + ".mtx");
 
+    memory_meter meter{state};
+
     for ([[maybe_unused]] auto _ : state) {
+        meter.start();
         std::ofstream oss{out_path, std::ios_base::binary};
 
         fast_matrix_market::write_matrix_market_graphblas(oss, mat, options);
 
+        meter.stop();
+
         num_bytes += std::filesystem::file_size(out_path);
         benchmark::ClobberMemory();
     }
@@ -84,6 +263,7 @@ void GraphBLAS_write_FMM(benchmark::State& state) {
     if (delete_written_files_on_finish) {
         std::filesystem::remove(out_path);
     }
+    meter.report(prob.nnz, num_bytes);
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
@@ -14,7 +14,8 @@ extern "C" {
  */
 struct LAGraphInitializer {
     LAGraphInitializer() {
-        LAGraph_Init(msg);
+        // count GraphBLAS's allocations along with C++ allocations
+        LAGr_Init(GrB_BLOCKING, counting_malloc, counting_calloc, counting_realloc, counting_free, msg);
     }
 
     ~LAGraphInitializer() {
@@ -25,14 +26,31 @@ struct LAGraphInitializer {
 [[maybe_unused]] LAGraphInitializer lagraph_init_and_finalizer{};
 
 /**
- * Read MatrixMarket with fast_matrix_market.
+ * Memory used by a GraphBLAS matrix. Requires SuiteSparse:GraphBLAS 7 or newer, else returns 0.
  */
-void GraphBLAS_read_FMM(benchmark::State& state) {
+static std::size_t size_bytes([[maybe_unused]] GrB_Matrix mat) {
+    std::size_t size = 0;
+#if defined(GxB_IMPLEMENTATION_MAJOR) && GxB_IMPLEMENTATION_MAJOR >= 7
+    GxB_Matrix_memoryUsage(&size, mat);
+#endif
+    return size;
+}
+
+/**
+ * Read MatrixMarket with LAGraph.
+ */
+void lagraph_read(benchmark::State& state, cache_mode cache) {
     problem& prob = get_problem((int)state.range(0));
 
     std::size_t num_bytes = 0;
+    memory_meter meter{state};
 
     for ([[maybe_unused]] auto _ : state) {
+        if (!prepare_page_cache(state, prob.mm_path, cache)) {
+            break;
+        }
+        meter.start();
+
         char msg[LAGRAPH_MSG_LEN];
 
         FILE *in_file  = fopen(prob.mm_path.c_str(), "r");
@@ -46,22 +64,27 @@ void GraphBLAS_read_FMM(benchmark::State& state) {
         LAGraph_MMRead (&mat, in_file, msg) ;
 
         fclose(in_file);
+
+        meter.record_structure(size_bytes(mat));
+        meter.stop();
         GrB_Matrix_free(&mat);
 
         num_bytes += std::filesystem::file_size(prob.mm_path);
         benchmark::ClobberMemory();
     }
 
+    meter.report(prob.nnz, num_bytes);
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
 
-BENCHMARK(GraphBLAS_read_FMM)->Name("op:read/impl:LAGraph/format:MatrixMarket")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(lagraph_read, cold, cache_mode::cold)->Name("op:read/impl:LAGraph/format:MatrixMarket/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_CAPTURE(lagraph_read, warm, cache_mode::warm)->Name("op:read/impl:LAGraph/format:MatrixMarket/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
 
 /**
- * Write MatrixMarket with fast_matrix_market.
+ * Write MatrixMarket with LAGraph.
  */
-void GraphBLAS_write_FMM(benchmark::State& state) {
+void lagraph_write(benchmark::State& state) {
     std::size_t num_bytes = 0;
 
     problem& prob = get_problem((int)state.range(0));
@@ -79,7 +102,10 @@ void GraphBLAS_write_FMM(benchmark::State& state) {
 
     auto out_path = temporary_write_dir / ("write_" + prob.name + ".mtx");
 
+    memory_meter meter{state};
+
     for ([[maybe_unused]] auto _ : state) {
+        meter.start();
         char msg[LAGRAPH_MSG_LEN];
 
         FILE *out_file  = fopen(out_path.c_str(), "wb");
@@ -90,6 +116,8 @@ void GraphBLAS_write_FMM(benchmark::State& state) {
 
         LAGraph_MMWrite(mat, out_file, nullptr, msg);
 
+        meter.stop();
+
         num_bytes += std::filesystem::file_size(out_path);
         benchmark::ClobberMemory();
     }
@@ -98,8 +126,9 @@ void GraphBLAS_write_FMM(benchmark::State& state) {
     if (delete_written_files_on_finish) {
         std::filesystem::remove(out_path);
     }
+    meter.report(prob.nnz, num_bytes);
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
 
-BENCHMARK(GraphBLAS_write_FMM)->Name("op:write/impl:LAGraph/format:MatrixMarket")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK(lagraph_write)->Name("op:write/impl:LAGraph/format:MatrixMarket")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
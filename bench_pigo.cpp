@@ -2,16 +2,19 @@
 // Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
 // SPDX-License-Identifier: BSD-2-Clause
 
+#include <algorithm>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include <unistd.h>
+
 #include "common.hpp"
+#include "matrix_market_writer.hpp"
 
 #include "pigo.hpp"
 
-// PIGO memory maps the input file. Multiple iterations
-// can mean that the second and following iterations are on a warm cache.
-// Both cold and warm caches are valid benchmark options, but default to cold.
-//#define PIGO_iterations num_iterations
-#define PIGO_iterations 1
-
 // PIGO's types
 // User warning! pigo::COO is unweighted by default!
 using pigo_COO = pigo::COO<
@@ -35,29 +38,56 @@ using pigo_COO_pattern = pigo::COO<
     false        // bool weighted=false,
 >;
 
+/**
+ * Weighted PIGO COO with label (index) type IT and weight (value) type VT.
+ */
+template <typename IT, typename VT>
+using pigo_COO_typed = pigo::COO<IT, IT, IT*, false, false, false, true, VT>;
+
 /**
  * Read MatrixMarket with PIGO.
+ *
+ * PIGO memory maps the input file, so it is especially sensitive to the page cache state.
+ * Registered with the default int64/double types and with int32/float. PIGO's Ordinal, which counts the entries, is
+ * the label type, so nnz must fit the index type too.
  */
+template <typename IT, typename VT, cache_mode CACHE>
 static void PIGO_read(benchmark::State& state) {
     problem& prob = get_problem((int)state.range(0));
+    if (!check_index_type<IT>(state, prob, true)) {
+        return;
+    }
     int num_threads = (int)state.range(1);
     omp_set_num_threads(num_threads);
 
     std::size_t num_bytes = 0;
+    memory_meter meter{state};
 
     for ([[maybe_unused]] auto _ : state) {
-        pigo_COO c {prob.mm_path};
+        if (!prepare_page_cache(state, prob.mm_path, CACHE)) {
+            break;
+        }
+        meter.start();
+
+        pigo_COO_typed<IT, VT> c {prob.mm_path};
         benchmark::DoNotOptimize(c);
 
+        meter.record_structure(c.m() * (2 * sizeof(IT) + sizeof(VT)));
+        meter.stop();
+
         num_bytes += std::filesystem::file_size(prob.mm_path);
         benchmark::ClobberMemory();
     }
 
+    meter.report(prob.nnz, num_bytes);
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
 
-BENCHMARK(PIGO_read)->Name("op:read/impl:PIGO/format:MatrixMarket")->UseRealTime()->Iterations(PIGO_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(PIGO_read, int64_t, double, cache_mode::cold)->Name("op:read/impl:PIGO/format:MatrixMarket/index:int64/value:double/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(PIGO_read, int64_t, double, cache_mode::warm)->Name("op:read/impl:PIGO/format:MatrixMarket/index:int64/value:double/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(PIGO_read, int32_t, float, cache_mode::cold)->Name("op:read/impl:PIGO/format:MatrixMarket/index:int32/value:float/cache:cold")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(PIGO_read, int32_t, float, cache_mode::warm)->Name("op:read/impl:PIGO/format:MatrixMarket/index:int32/value:float/cache:warm")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
 
 /**
  * Write an ASCII file with PIGO.
@@ -75,8 +105,13 @@ static void PIGO_write_binary(benchmark::State& state) {
     omp_set_num_threads(num_threads);
     auto out_path = temporary_write_dir / ("write_" + prob.name + ".bin");
 
+    memory_meter meter{state};
+
     for ([[maybe_unused]] auto _ : state) {
+        meter.start();
         c.save(out_path);
+        meter.stop();
+
         num_bytes += std::filesystem::file_size(out_path);
         benchmark::ClobberMemory();
     }
@@ -85,11 +120,12 @@ static void PIGO_write_binary(benchmark::State& state) {
         std::filesystem::remove(out_path);
     }
 
+    meter.report(prob.nnz, num_bytes);
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
 
-BENCHMARK(PIGO_write_binary)->Name("op:write/impl:PIGO/format:binary")->UseRealTime()->Iterations(PIGO_iterations)->Apply(BenchmarkArgument);
+BENCHMARK(PIGO_write_binary)->Name("op:write/impl:PIGO/format:binary")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
 
 /**
  * Write an ASCII file with PIGO.
@@ -107,8 +143,13 @@ static void PIGO_write_ascii(benchmark::State& state) {
     omp_set_num_threads(num_threads);
     auto out_path = temporary_write_dir / ("write_" + prob.name + ".txt");
 
+    memory_meter meter{state};
+
     for ([[maybe_unused]] auto _ : state) {
+        meter.start();
         c.write(out_path);
+        meter.stop();
+
         num_bytes += std::filesystem::file_size(out_path);
         benchmark::ClobberMemory();
     }
@@ -117,6 +158,7 @@ static void PIGO_write_ascii(benchmark::State& state) {
         std::filesystem::remove(out_path);
     }
 
+    meter.report(prob.nnz, num_bytes);
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
@@ -124,7 +166,7 @@ static void PIGO_write_ascii(benchmark::State& state) {
 // pigo::COO::write uses std::to_string to write values. This method does not paralellize, so this
 // benchmark is very slow on large datasets.
 #if ENABLE_SLOW_BENCHMARKS
-BENCHMARK(PIGO_write_ascii)->Name("op:write/impl:PIGO/format:ASCII(MatrixMarket_body_only)")->UseRealTime()->Iterations(PIGO_iterations)->Apply(BenchmarkArgument);
+BENCHMARK(PIGO_write_ascii)->Name("op:write/impl:PIGO/format:ASCII(MatrixMarket_body_only)")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
 #endif
 
 /**
@@ -143,8 +185,13 @@ static void PIGO_write_ascii_pattern(benchmark::State& state) {
     omp_set_num_threads(num_threads);
     auto out_path = temporary_write_dir / ("write_" + prob.name + ".txt");
 
+    memory_meter meter{state};
+
     for ([[maybe_unused]] auto _ : state) {
+        meter.start();
         c.write(out_path);
+        meter.stop();
+
         num_bytes += std::filesystem::file_size(out_path);
         benchmark::ClobberMemory();
     }
@@ -153,6 +200,7 @@ static void PIGO_write_ascii_pattern(benchmark::State& state) {
         std::filesystem::remove(out_path);
     }
 
+    meter.report(prob.nnz, num_bytes);
     state.SetBytesProcessed((int64_t)num_bytes);
     state.SetLabel("problem_name=" + prob.name);
 }
@@ -160,5 +208,113 @@ static void PIGO_write_ascii_pattern(benchmark::State& state) {
 // pigo::COO::write uses std::to_string to write values. This method does not paralellize, so this
 // benchmark is very slow on large datasets.
 #if ENABLE_SLOW_BENCHMARKS
-BENCHMARK(PIGO_write_ascii_pattern)->Name("op:write/impl:PIGO/format:ASCII(MatrixMarket_body_only(pattern))")->UseRealTime()->Iterations(PIGO_iterations)->Apply(BenchmarkArgument);
+BENCHMARK(PIGO_write_ascii_pattern)->Name("op:write/impl:PIGO/format:ASCII(MatrixMarket_body_only(pattern))")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
 #endif
+
+/**
+ * Directory that is removed with everything in it when this goes out of scope.
+ */
+struct scoped_directory {
+    explicit scoped_directory(std::filesystem::path path) : path(std::move(path)) {
+        std::filesystem::create_directories(this->path);
+    }
+
+    ~scoped_directory() {
+        std::error_code ec;
+        std::filesystem::remove_all(path, ec);
+    }
+
+    std::filesystem::path path;
+};
+
+/**
+ * Offset that turns the labels PIGO reads from a Matrix Market file into 1-based indices: 0 if PIGO keeps the
+ * file's indices, 1 if it makes them 0-based. Returns -1 if PIGO does neither.
+ *
+ * The problems' labels cannot tell, because generated files use neither the first nor always the last index.
+ * Instead PIGO reads a one-entry file once. The file is written in a subdirectory, so that if a crash leaves it
+ * behind it is not mistaken for a problem: only the working directory itself is scanned for .mtx files.
+ */
+static INDEX_TYPE pigo_mtx_index_offset() {
+    static const INDEX_TYPE offset = [] {
+        INDEX_TYPE ret = -1;
+        try {
+            scoped_directory probe_dir(temporary_write_dir / ("pigo_index_probe-" + std::to_string(getpid())));
+            auto probe_path = probe_dir.path / "probe.mtx";
+            {
+                std::ofstream f(probe_path);
+                f << "%%MatrixMarket matrix coordinate real general\n2 3 1\n1 2 1\n";
+            }
+            pigo_COO c {probe_path};
+            if (c.m() == 1 && c.x()[0] == 1 && c.y()[0] == 2) {
+                ret = 0;
+            } else if (c.m() == 1 && c.x()[0] == 0 && c.y()[0] == 1) {
+                ret = 1;
+            }
+        } catch (...) {
+        }
+        return ret;
+    }();
+    return offset;
+}
+
+/**
+ * Write Matrix Market from a pigo::COO's arrays with the parallel to_chars formatter.
+ *
+ * The replacement for pigo::COO::write, which formats with std::to_string on one thread and writes no header.
+ */
+template <typename COO>
+static void PIGO_write_matrix_market(benchmark::State& state) {
+    std::size_t num_bytes = 0;
+
+    problem& prob = get_problem((int)state.range(0));
+    int num_threads = (int)state.range(1);
+
+    // load the problem to be written later
+    omp_set_num_threads(0);
+    COO c {prob.mm_path};
+    const VALUE_TYPE* vals = nullptr;
+    if constexpr (std::is_same_v<COO, pigo_COO>) {
+        vals = c.w();
+    }
+    const auto nnz = (int64_t)c.m();
+
+    const INDEX_TYPE offset = pigo_mtx_index_offset();
+    if (offset < 0) {
+        state.SkipWithError("Could not tell whether PIGO reads Matrix Market indices as 0- or 1-based.");
+        return;
+    }
+    if (nnz > 0) {
+        // the labels must be valid indices of the header's dimensions
+        auto [min_x, max_x] = std::minmax_element(c.x(), c.x() + nnz);
+        auto [min_y, max_y] = std::minmax_element(c.y(), c.y() + nnz);
+        if (std::min(*min_x, *min_y) + offset < 1 || *max_x + offset > prob.nrows || *max_y + offset > prob.ncols) {
+            state.SkipWithError(("PIGO's labels of " + prob.name + " do not fit the header's dimensions.").c_str());
+            return;
+        }
+    }
+
+    auto out_path = temporary_write_dir / ("write_" + prob.name + (vals == nullptr ? "-pattern.mtx" : ".mtx"));
+
+    memory_meter meter{state};
+
+    for ([[maybe_unused]] auto _ : state) {
+        meter.start();
+        num_bytes += write_matrix_market_arrays(out_path, prob.nrows, prob.ncols, nnz, c.x(), c.y(), vals, offset,
+                                                num_threads);
+        meter.stop();
+
+        benchmark::ClobberMemory();
+    }
+
+    if (delete_written_files_on_finish) {
+        std::filesystem::remove(out_path);
+    }
+
+    meter.report(prob.nnz, num_bytes);
+    state.SetBytesProcessed((int64_t)num_bytes);
+    state.SetLabel("problem_name=" + prob.name);
+}
+
+BENCHMARK_TEMPLATE(PIGO_write_matrix_market, pigo_COO)->Name("op:write/impl:PIGO_to_chars/format:MatrixMarket")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
+BENCHMARK_TEMPLATE(PIGO_write_matrix_market, pigo_COO_pattern)->Name("op:write/impl:PIGO_to_chars/format:MatrixMarket/value:pattern")->UseRealTime()->Iterations(num_iterations)->Apply(BenchmarkArgument);
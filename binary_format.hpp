@@ -0,0 +1,422 @@
+// Copyright (C) 2023 Adam Lugowski. All rights reserved.
+// Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "matrices.hpp"
+
+/*
+ * Native binary sparse matrix container.
+ *
+ * A fixed-size header describes the shape, nnz, index and value widths, layout, and sort order. It is followed by
+ * three arrays, each starting on a page boundary so they can be memory mapped and read with O_DIRECT:
+ *  - triplet: rows[nnz], cols[nnz], vals[nnz]
+ *  - CSC:     indptr[ncols + 1], indices[nnz], vals[nnz]
+ *  - CSR:     indptr[nrows + 1], indices[nnz], vals[nnz]
+ * Pattern matrices have an empty value array. Numbers are stored in native byte order.
+ * The packed_csr layout stores its index arrays bit-packed, see packed_format.hpp.
+ */
+
+enum class binary_layout : uint8_t {triplet = 0, csc = 1, csr = 2, packed_csr = 3};
+enum class binary_sort_order : uint8_t {unsorted = 0, row_major = 1, col_major = 2};
+enum class binary_value_kind : uint8_t {pattern = 0, integer = 1, unsigned_integer = 2, real = 3, complex = 4};
+
+constexpr char binary_magic[8] = {'S', 'P', 'M', 'A', 'T', 'B', 'I', 'N'};
+constexpr uint32_t binary_version = 1;
+constexpr uint64_t binary_alignment = 4096;
+
+struct binary_header {
+    char magic[8];
+    uint32_t version;
+    binary_layout layout;
+    uint8_t index_bytes;
+    uint8_t value_bytes;
+    binary_value_kind value_kind;
+    binary_sort_order sort_order;
+    uint8_t reserved[7];
+    int64_t nrows;
+    int64_t ncols;
+    int64_t nnz;
+    uint64_t array_offsets[3];
+    uint64_t array_bytes[3];
+};
+static_assert(sizeof(binary_header) == 96 && std::is_trivially_copyable_v<binary_header>);
+
+template <typename VT> struct is_complex : std::false_type {};
+template <typename T> struct is_complex<std::complex<T>> : std::true_type {};
+
+template <typename VT>
+constexpr binary_value_kind binary_value_kind_of() {
+    if constexpr (is_complex<VT>::value) {
+        return binary_value_kind::complex;
+    } else if constexpr (std::is_floating_point_v<VT>) {
+        return binary_value_kind::real;
+    } else if constexpr (std::is_signed_v<VT>) {
+        return binary_value_kind::integer;
+    } else {
+        return binary_value_kind::unsigned_integer;
+    }
+}
+
+inline uint64_t align_up(uint64_t offset, uint64_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+/**
+ * Place the arrays on aligned offsets. `array_bytes` must be set.
+ */
+inline void place_binary_arrays(binary_header& header) {
+    uint64_t offset = sizeof(binary_header);
+    for (int i = 0; i < 3; ++i) {
+        offset = align_up(offset, binary_alignment);
+        header.array_offsets[i] = offset;
+        offset += header.array_bytes[i];
+    }
+}
+
+inline uint64_t binary_file_size(const binary_header& header) {
+    return header.array_offsets[2] + header.array_bytes[2];
+}
+
+inline std::runtime_error binary_io_error(const std::string& what, const std::filesystem::path& path) {
+    return std::runtime_error(what + " " + path.string() + ": " + std::strerror(errno));
+}
+
+/**
+ * Reads and writes the arrays of a binary file with parallel pread/pwrite calls.
+ */
+class binary_file_io {
+public:
+    static constexpr uint64_t chunk_bytes = 4u << 20;
+
+    /**
+     * Write the header and arrays. Each array is split into chunks that the threads write concurrently.
+     */
+    static void write(const std::filesystem::path& path, const binary_header& header,
+                      const std::array<const void*, 3>& arrays, int num_threads) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw binary_io_error("Could not create", path);
+        }
+        binary_header header_copy = header;
+        bool ok = ftruncate(fd, (off_t)binary_file_size(header)) == 0 &&
+                  transfer_all(fd, reinterpret_cast<char*>(&header_copy), sizeof(header_copy), 0, true);
+        if (ok) {
+            ok = for_each_chunk(header, num_threads, [&](int a, uint64_t begin, uint64_t end) {
+                auto src = static_cast<const char*>(arrays[a]) + begin;
+                return transfer_all(fd, const_cast<char*>(src), end - begin, header.array_offsets[a] + begin, true);
+            });
+        }
+        close(fd);
+        if (!ok) {
+            throw binary_io_error("Could not write", path);
+        }
+    }
+
+    /**
+     * Read the arrays described by `header` into `arrays`, which must be large enough.
+     */
+    static void read(const std::filesystem::path& path, const binary_header& header,
+                     const std::array<void*, 3>& arrays, int num_threads) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw binary_io_error("Could not open", path);
+        }
+        bool ok = for_each_chunk(header, num_threads, [&](int a, uint64_t begin, uint64_t end) {
+            auto dest = static_cast<char*>(arrays[a]) + begin;
+            return transfer_all(fd, dest, end - begin, header.array_offsets[a] + begin, false);
+        });
+        close(fd);
+        if (!ok) {
+            throw binary_io_error("Could not read", path);
+        }
+    }
+
+protected:
+    /**
+     * pread or pwrite `length` bytes, retrying short transfers.
+     */
+    static bool transfer_all(int fd, char* buf, uint64_t length, uint64_t offset, bool write) {
+        while (length > 0) {
+            ssize_t n = write ? pwrite(fd, buf, length, (off_t)offset) : pread(fd, buf, length, (off_t)offset);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            buf += n;
+            length -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+    /**
+     * Call `func(array, begin, end)` for every chunk of every array. Threads pick up the next chunk.
+     */
+    template <typename FUNC>
+    static bool for_each_chunk(const binary_header& header, int num_threads, FUNC func) {
+        std::vector<std::pair<int, uint64_t>> chunks;
+        for (int a = 0; a < 3; ++a) {
+            for (uint64_t begin = 0; begin < header.array_bytes[a]; begin += chunk_bytes) {
+                chunks.emplace_back(a, begin);
+            }
+        }
+
+        std::atomic<std::size_t> next_chunk{0};
+        std::atomic<bool> ok{true};
+        auto worker = [&]() {
+            for (std::size_t c = next_chunk++; c < chunks.size() && ok; c = next_chunk++) {
+                auto [a, begin] = chunks[c];
+                if (!func(a, begin, std::min(begin + chunk_bytes, header.array_bytes[a]))) {
+                    ok = false;
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (int t = 1; t < std::min(num_threads, (int)chunks.size()); ++t) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        return ok;
+    }
+};
+
+template <typename IT, typename VT>
+binary_header make_binary_header(binary_layout layout, binary_sort_order order, int64_t nrows, int64_t ncols,
+                                 int64_t nnz, std::size_t first_length, bool has_vals) {
+    binary_header header{};
+    std::memcpy(header.magic, binary_magic, sizeof(binary_magic));
+    header.version = binary_version;
+    header.layout = layout;
+    header.index_bytes = sizeof(IT);
+    header.value_bytes = has_vals ? sizeof(VT) : 0;
+    header.value_kind = has_vals ? binary_value_kind_of<VT>() : binary_value_kind::pattern;
+    header.sort_order = order;
+    header.nrows = nrows;
+    header.ncols = ncols;
+    header.nnz = nnz;
+    header.array_bytes[0] = first_length * sizeof(IT);
+    header.array_bytes[1] = nnz * sizeof(IT);
+    header.array_bytes[2] = has_vals ? nnz * sizeof(VT) : 0;
+    place_binary_arrays(header);
+    return header;
+}
+
+/**
+ * Read and validate the header of a binary file.
+ */
+inline binary_header read_binary_header(const std::filesystem::path& path) {
+    binary_header header{};
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw binary_io_error("Could not open", path);
+    }
+    ssize_t n = pread(fd, &header, sizeof(header), 0);
+    close(fd);
+
+    if (n != (ssize_t)sizeof(header) || std::memcmp(header.magic, binary_magic, sizeof(binary_magic)) != 0) {
+        throw std::invalid_argument("Not a binary sparse matrix file: " + path.string());
+    }
+    if (header.version != binary_version) {
+        throw std::invalid_argument("Unsupported binary sparse matrix version " + std::to_string(header.version) +
+                                    ": " + path.string());
+    }
+    return header;
+}
+
+/**
+ * Check that a file's index and value widths match IT and VT.
+ */
+template <typename IT, typename VT>
+void check_binary_types(const binary_header& header, binary_layout layout) {
+    if (header.layout != layout) {
+        throw std::invalid_argument("Binary file has a different layout than requested.");
+    }
+    if (header.index_bytes != sizeof(IT)) {
+        throw std::invalid_argument("Binary file has " + std::to_string(header.index_bytes) +
+                                    "-byte indices, expected " + std::to_string(sizeof(IT)));
+    }
+    if (header.value_kind != binary_value_kind::pattern &&
+        (header.value_bytes != sizeof(VT) || header.value_kind != binary_value_kind_of<VT>())) {
+        throw std::invalid_argument("Binary file value type does not match the requested type.");
+    }
+}
+
+/**
+ * Write triplets. `order` records how the triplets are sorted, if at all.
+ */
+template <typename IT, typename VT>
+void write_binary_triplet(const std::filesystem::path& path, const triplet_matrix<IT, VT>& triplet,
+                          binary_sort_order order, int num_threads) {
+    auto header = make_binary_header<IT, VT>(binary_layout::triplet, order, triplet.nrows, triplet.ncols,
+                                             (int64_t)triplet.rows.size(), triplet.rows.size(), !triplet.vals.empty());
+    binary_file_io::write(path, header, {triplet.rows.data(), triplet.cols.data(), triplet.vals.data()}, num_threads);
+}
+
+/**
+ * Write a CSC matrix, or a CSR matrix if `layout` is binary_layout::csr.
+ */
+template <typename IT, typename VT>
+void write_binary_compressed(const std::filesystem::path& path, const csc_matrix<IT, VT>& mat, int num_threads,
+                             binary_layout layout = binary_layout::csc) {
+    auto order = (layout == binary_layout::csr) ? binary_sort_order::row_major : binary_sort_order::col_major;
+    auto header = make_binary_header<IT, VT>(layout, order, mat.nrows, mat.ncols,
+                                             (int64_t)mat.indices.size(), mat.indptr.size(), !mat.vals.empty());
+    binary_file_io::write(path, header, {mat.indptr.data(), mat.indices.data(), mat.vals.data()}, num_threads);
+}
+
+/**
+ * Read triplets into memory.
+ */
+template <typename IT, typename VT>
+void read_binary_triplet(const std::filesystem::path& path, triplet_matrix<IT, VT>& triplet, int num_threads) {
+    binary_header header = read_binary_header(path);
+    check_binary_types<IT, VT>(header, binary_layout::triplet);
+
+    triplet.nrows = header.nrows;
+    triplet.ncols = header.ncols;
+    triplet.rows.resize(header.nnz);
+    triplet.cols.resize(header.nnz);
+    triplet.vals.resize(header.value_bytes > 0 ? header.nnz : 0);
+    binary_file_io::read(path, header, {triplet.rows.data(), triplet.cols.data(), triplet.vals.data()}, num_threads);
+}
+
+/**
+ * Read a CSC matrix (or a CSR matrix if `layout` is binary_layout::csr) into memory.
+ */
+template <typename IT, typename VT>
+void read_binary_compressed(const std::filesystem::path& path, csc_matrix<IT, VT>& mat, int num_threads,
+                            binary_layout layout = binary_layout::csc) {
+    binary_header header = read_binary_header(path);
+    check_binary_types<IT, VT>(header, layout);
+
+    mat.nrows = header.nrows;
+    mat.ncols = header.ncols;
+    mat.indptr.resize(header.array_bytes[0] / sizeof(IT));
+    mat.indices.resize(header.nnz);
+    mat.vals.resize(header.value_bytes > 0 ? header.nnz : 0);
+    binary_file_io::read(path, header, {mat.indptr.data(), mat.indices.data(), mat.vals.data()}, num_threads);
+}
+
+/**
+ * Read-only view of a contiguous array.
+ */
+template <typename T>
+struct array_view {
+    const T* ptr = nullptr;
+    std::size_t length = 0;
+
+    [[nodiscard]] const T* data() const { return ptr; }
+    [[nodiscard]] std::size_t size() const { return length; }
+    [[nodiscard]] bool empty() const { return length == 0; }
+    [[nodiscard]] const T* begin() const { return ptr; }
+    [[nodiscard]] const T* end() const { return ptr + length; }
+    const T& operator[](std::size_t i) const { return ptr[i]; }
+};
+
+/**
+ * triplet_matrix with its arrays in a memory mapped file.
+ */
+template <typename IT, typename VT>
+struct triplet_view {
+    int64_t nrows = 0, ncols = 0;
+    array_view<IT> rows;
+    array_view<IT> cols;
+    array_view<VT> vals;
+};
+
+/**
+ * csc_matrix with its arrays in a memory mapped file.
+ */
+template <typename IT, typename VT>
+struct csc_view {
+    int64_t nrows = 0, ncols = 0;
+    array_view<IT> indptr;
+    array_view<IT> indices;
+    array_view<VT> vals;
+};
+
+/**
+ * Zero-copy reader. Maps the whole file read-only and hands out views into the mapping.
+ * The views are valid for the lifetime of this object. Pages are read on first access.
+ */
+class mapped_binary_file {
+public:
+    explicit mapped_binary_file(const std::filesystem::path& path) : header(read_binary_header(path)) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw binary_io_error("Could not open", path);
+        }
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < binary_file_size(header)) {
+            close(fd);
+            throw std::invalid_argument("Truncated binary sparse matrix file: " + path.string());
+        }
+        length = (std::size_t)st.st_size;
+        void* addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            throw binary_io_error("Could not map", path);
+        }
+        base = static_cast<const char*>(addr);
+    }
+
+    mapped_binary_file(const mapped_binary_file&) = delete;
+    mapped_binary_file& operator=(const mapped_binary_file&) = delete;
+
+    ~mapped_binary_file() {
+        munmap(const_cast<char*>(base), length);
+    }
+
+    [[nodiscard]] const binary_header& get_header() const {
+        return header;
+    }
+
+    template <typename IT, typename VT>
+    triplet_view<IT, VT> triplet() const {
+        check_binary_types<IT, VT>(header, binary_layout::triplet);
+        return {header.nrows, header.ncols, array<IT>(0), array<IT>(1), array<VT>(2)};
+    }
+
+    template <typename IT, typename VT>
+    csc_view<IT, VT> compressed(binary_layout layout = binary_layout::csc) const {
+        check_binary_types<IT, VT>(header, layout);
+        return {header.nrows, header.ncols, array<IT>(0), array<IT>(1), array<VT>(2)};
+    }
+
+protected:
+    template <typename T>
+    array_view<T> array(int i) const {
+        return {reinterpret_cast<const T*>(base + header.array_offsets[i]), header.array_bytes[i] / sizeof(T)};
+    }
+
+    binary_header header;
+    const char* base = nullptr;
+    std::size_t length = 0;
+};
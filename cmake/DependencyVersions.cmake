@@ -0,0 +1,32 @@
+# Records the git commit of each fetched dependency so benchmark results can name the versions they ran against.
+# Several dependencies track a branch, so the commit changes from one configure to the next.
+#
+# record_dependency_version(<name> <source dir>) after fetching a dependency.
+# write_dependency_versions() once at the end, to generate dependency_versions.hpp.
+
+set(DEPENDENCY_VERSIONS_DIR "${CMAKE_BINARY_DIR}/generated")
+include_directories("${DEPENDENCY_VERSIONS_DIR}")
+
+function(record_dependency_version NAME SOURCE_DIR)
+    find_package(Git QUIET)
+    set(SHA "unknown")
+    if (GIT_FOUND AND EXISTS "${SOURCE_DIR}")
+        execute_process(COMMAND "${GIT_EXECUTABLE}" rev-parse HEAD
+                WORKING_DIRECTORY "${SOURCE_DIR}"
+                OUTPUT_VARIABLE SHA OUTPUT_STRIP_TRAILING_WHITESPACE
+                RESULT_VARIABLE RESULT ERROR_QUIET)
+        if (NOT RESULT EQUAL 0)
+            set(SHA "unknown")
+        endif()
+    endif()
+    set_property(GLOBAL APPEND PROPERTY DEPENDENCY_VERSIONS "${NAME}=${SHA}")
+endfunction()
+
+function(write_dependency_versions)
+    get_property(VERSIONS GLOBAL PROPERTY DEPENDENCY_VERSIONS)
+    file(WRITE "${DEPENDENCY_VERSIONS_DIR}/dependency_versions.hpp.tmp"
+            "// Generated by cmake/DependencyVersions.cmake\n#pragma once\n#define DEPENDENCY_VERSIONS \"${VERSIONS}\"\n")
+    # Only touch the header when a version changed, so reconfiguring does not rebuild everything.
+    configure_file("${DEPENDENCY_VERSIONS_DIR}/dependency_versions.hpp.tmp"
+            "${DEPENDENCY_VERSIONS_DIR}/dependency_versions.hpp" COPYONLY)
+endfunction()
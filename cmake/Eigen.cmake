@@ -11,3 +11,4 @@ set(CMAKE_POLICY_DEFAULT_CMP0077 NEW)
 set(EIGEN_BUILD_DOC OFF)
 set(BUILD_TESTING OFF)
 FetchContent_MakeAvailable(Eigen)
+record_dependency_version(Eigen "${eigen_SOURCE_DIR}")
@@ -10,4 +10,5 @@ FetchContent_Declare(
         GIT_SHALLOW TRUE
 )
 
-FetchContent_MakeAvailable(googlebenchmark)
\ No newline at end of file
+FetchContent_MakeAvailable(googlebenchmark)
+record_dependency_version(benchmark "${googlebenchmark_SOURCE_DIR}")
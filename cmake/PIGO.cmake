@@ -8,3 +8,4 @@ FetchContent_Declare(
         GIT_PROGRESS TRUE)
 
 FetchContent_MakeAvailable(PIGO)
+record_dependency_version(PIGO "${pigo_SOURCE_DIR}")
@@ -5,4 +5,5 @@ FetchContent_Declare(
         GIT_TAG main
         GIT_SHALLOW TRUE
 )
-FetchContent_MakeAvailable(fast_matrix_market)
\ No newline at end of file
+FetchContent_MakeAvailable(fast_matrix_market)
+record_dependency_version(fast_matrix_market "${fast_matrix_market_SOURCE_DIR}")
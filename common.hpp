@@ -8,14 +8,26 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <sstream>
+#include <string>
 #include <vector>
 
 #include <benchmark/benchmark.h>
 
+#include "matrices.hpp"
+
 struct problem {
     std::string name;
     std::filesystem::path mm_path;
+
+    /**
+     * Dimensions and number of stored entries, from the file header.
+     */
+    int64_t nrows = 0;
+    int64_t ncols = 0;
+    int64_t nnz = 0;
 };
 
 /**
@@ -57,4 +69,162 @@ extern std::filesystem::path temporary_write_dir;
 
 void BenchmarkArgument(benchmark::internal::Benchmark* b);
 
-problem& get_problem(int i);
\ No newline at end of file
+/**
+ * Like BenchmarkArgument, but over the compressed Matrix Market files (`*.mtx.gz`, `*.mtx.zst`, `*.mtx.lz4`).
+ */
+void CompressedBenchmarkArgument(benchmark::internal::Benchmark* b);
+
+/**
+ * Page cache state that a read benchmark runs against.
+ */
+enum class cache_mode {
+    /**
+     * The input file is evicted from the page cache before each iteration.
+     */
+    cold,
+
+    /**
+     * The input file is read into the page cache before each iteration.
+     */
+    warm
+};
+
+/**
+ * Put `path` into the page cache state requested by `mode`. Runs with the benchmark timer paused.
+ *
+ * Calls state.SkipWithError() and returns false if the state cannot be established on this platform.
+ */
+bool prepare_page_cache(benchmark::State& state, const std::filesystem::path& path, cache_mode mode);
+
+problem& get_problem(int i);
+
+/**
+ * The problem's matrix, read with fast_matrix_market. Write benchmarks write this matrix.
+ *
+ * If the BENCHMARK_SHARE_REFERENCE environment variable is set, each problem is read once and kept in memory for every
+ * benchmark in the process. Otherwise the file is read on every call and freed when the caller drops it.
+ */
+std::shared_ptr<const triplet_matrix<INDEX_TYPE, VALUE_TYPE>> get_reference_triplet(const problem& prob);
+
+/**
+ * Check that the problem's dimensions fit in index type IT. Compressed formats also store offsets up to nnz in IT,
+ * so set `nnz_is_index` for those.
+ *
+ * Calls state.SkipWithError() and returns false if they do not fit.
+ */
+template <typename IT>
+bool check_index_type(benchmark::State& state, const problem& prob, bool nnz_is_index = false) {
+    const auto max_index = (int64_t)std::numeric_limits<IT>::max();
+    if (prob.nrows > max_index || prob.ncols > max_index || (nnz_is_index && prob.nnz > max_index)) {
+        std::string msg = "Index overflow: " + prob.name + " does not fit in " + std::to_string(8 * sizeof(IT)) +
+                          "-bit indices.";
+        state.SkipWithError(msg.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Compressed problem `i`, or nullptr if there are no compressed problems.
+ */
+problem* get_compressed_problem(int i);
+
+/**
+ * Reads the dimensions and nnz of a compressed problem from its header. Returns false if this build cannot
+ * decompress the file.
+ */
+using compressed_header_reader = bool (*)(problem& prob);
+
+/**
+ * Used by load_problems() for compressed problems. Benchmarks that decompress set it before they register, so it is
+ * null in executables that cannot decompress and their compressed problems keep zero dimensions.
+ */
+extern compressed_header_reader read_compressed_header;
+
+/**
+ * Hardware and software event counts of each benchmark iteration, from Linux perf_event_open:
+ * cycles, instructions, last-level cache misses, branch misses, and minor and major page faults.
+ *
+ * Enabled by setting the BENCHMARK_PERF environment variable. Counters follow the benchmark thread and the threads it
+ * creates while counting, such as fast_matrix_market's thread pool. Threads that already existed when counting began,
+ * like an OpenMP pool, are not counted. Events the kernel or hardware does not allow are left out, e.g. hardware
+ * events in most VMs or when /proc/sys/kernel/perf_event_paranoid is too high.
+ */
+class perf_counters {
+public:
+    perf_counters();
+    ~perf_counters();
+    perf_counters(const perf_counters&) = delete;
+    perf_counters& operator=(const perf_counters&) = delete;
+
+    /**
+     * Whether BENCHMARK_PERF is set.
+     */
+    static bool enabled();
+
+    void start();
+    void stop();
+
+    /**
+     * Export the per-iteration counts, IPC, and the per-nonzero and per-byte ratios as user counters.
+     * `bytes` is the total over all iterations, as passed to state.SetBytesProcessed().
+     */
+    void report(benchmark::State& state, int64_t iterations, int64_t nnz, std::size_t bytes) const;
+
+    static constexpr int num_events = 6;
+
+protected:
+    std::array<int, num_events> fds;
+    std::array<int64_t, num_events> start_values{};
+    std::array<int64_t, num_events> totals{};
+};
+
+/**
+ * Measures the memory used by each benchmark iteration:
+ *  - bytes and count of allocations made through global operator new and the counting_* malloc functions,
+ *  - growth of the peak resident set size.
+ *
+ * Call start() at the beginning of each iteration, record_structure() with the size of the data structure the
+ * iteration built, and stop() before that structure is freed. report() exports the results as user counters.
+ *
+ * If BENCHMARK_PERF is set the same iterations are also measured with perf_counters.
+ */
+class memory_meter {
+public:
+    explicit memory_meter(benchmark::State& state)
+        : state(state), perf(perf_counters::enabled() ? std::make_unique<perf_counters>() : nullptr) {}
+
+    void start();
+    void record_structure(std::size_t bytes);
+    void stop();
+
+    /**
+     * Export the counters. `nnz` is used for the per-nonzero overhead and `bytes`, the total passed to
+     * state.SetBytesProcessed(), for the per-byte perf counter ratios.
+     */
+    void report(int64_t nnz, std::size_t bytes = 0);
+
+protected:
+    benchmark::State& state;
+
+    int64_t start_alloc_bytes = 0;
+    int64_t start_alloc_count = 0;
+    int64_t start_rss = 0;
+
+    int64_t alloc_bytes = 0;
+    int64_t alloc_count = 0;
+    int64_t peak_rss_delta = 0;
+    int64_t structure_bytes = 0;
+    int64_t iterations = 0;
+
+    std::unique_ptr<perf_counters> perf;
+};
+
+/*
+ * malloc family that counts allocations like the replaced global operator new does.
+ * For C libraries that accept custom allocators, such as GraphBLAS and LAGraph.
+ */
+void* counting_malloc(std::size_t size);
+void* counting_calloc(std::size_t num, std::size_t size);
+void* counting_realloc(void* ptr, std::size_t size);
+void counting_free(void* ptr);
\ No newline at end of file
@@ -0,0 +1,185 @@
+# Copyright (C) 2023 Adam Lugowski. All rights reserved.
+# Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+# SPDX-License-Identifier: BSD-2-Clause
+
+"""
+Compare two sets of benchmark results and flag throughput regressions.
+
+Each set is a Google Benchmark JSON file, or a directory of them such as the `results/` directory the benchmarks
+write to. A directory holds one file per run, named `<executable>-<UTC time>.json`; only the latest run of each
+executable is used. The files of a set must come from the same machine and configuration.
+
+Run with `--benchmark_repetitions=N` to get N samples of each benchmark. A benchmark is flagged when the
+confidence interval of the change in its mean throughput lies entirely beyond the noise threshold. Benchmarks
+with fewer than 2 samples on either side cannot be tested.
+
+Exits with status 1 if there are regressions, 2 if some benchmarks could not be tested and none regressed.
+
+    python compare_results.py old_results/ results/
+"""
+
+import argparse
+import json
+import math
+import sys
+from collections import defaultdict
+from pathlib import Path
+
+from scipy import stats
+
+# Context fields that describe the machine and library versions. Differences are printed before the comparison.
+CONTEXT_KEYS = ["host_name", "cpu_model", "num_cpus", "hardware_concurrency", "physical_memory_bytes",
+                "problem_filesystem", "library_build_type", "BENCHMARK_THREADS"]
+
+
+def load_results(paths):
+    """
+    Returns (context, samples), where samples maps each benchmark run name to the list of its
+    per-repetition throughputs. Aggregates and skipped or failed runs are ignored.
+
+    Exits if the files disagree on any of CONTEXT_KEYS, as their samples would not be comparable.
+    """
+    context = {}
+    samples = defaultdict(list)
+    for path in paths:
+        with open(path) as f:
+            data = json.load(f)
+        file_context = data.get("context", {})
+        for key in CONTEXT_KEYS:
+            if key in context and key in file_context and context[key] != file_context[key]:
+                sys.exit(f"error: {path} has {key}={file_context[key]}, but other files in its set have "
+                         f"{context[key]}. Compare files from one machine and configuration.")
+        context.update(file_context)
+
+        for run in data.get("benchmarks", []):
+            if run.get("run_type", "iteration") != "iteration" or run.get("error_occurred") or run.get("skipped"):
+                continue
+            throughput = run_throughput(run)
+            if throughput is not None:
+                samples[run["run_name"]].append(throughput)
+    return context, samples
+
+
+def json_files(path):
+    """
+    The file itself, or the latest `<executable>-<UTC time>.json` of each executable in a directory.
+    """
+    if not path.is_dir():
+        return [path]
+    latest = {}
+    # the timestamps sort chronologically
+    for file in sorted(path.glob("*.json")):
+        executable = file.stem.rsplit("-", 1)[0]
+        latest[executable] = file
+    return sorted(latest.values())
+
+
+def run_throughput(run):
+    """
+    bytes_per_second if the benchmark reports it, otherwise iterations per second of real time.
+    """
+    if "bytes_per_second" in run:
+        return run["bytes_per_second"]
+    time = run.get("real_time", 0)
+    if time <= 0:
+        return None
+    seconds = time * {"ns": 1e-9, "us": 1e-6, "ms": 1e-3, "s": 1}[run.get("time_unit", "ns")]
+    return 1 / seconds
+
+
+def mean_and_variance(values):
+    mean = sum(values) / len(values)
+    if len(values) < 2:
+        return mean, 0
+    return mean, sum((v - mean) ** 2 for v in values) / (len(values) - 1)
+
+
+def relative_change_interval(base, new, confidence):
+    """
+    Confidence interval of (mean(new) - mean(base)) / mean(base), from Welch's t-test.
+    Returns (change, low, high). The interval is unbounded if either side has a single sample.
+    """
+    base_mean, base_var = mean_and_variance(base)
+    new_mean, new_var = mean_and_variance(new)
+    change = (new_mean - base_mean) / base_mean
+    if len(base) < 2 or len(new) < 2:
+        return change, -math.inf, math.inf
+
+    base_se2 = base_var / len(base)
+    new_se2 = new_var / len(new)
+    se = math.sqrt(base_se2 + new_se2)
+    if se == 0:
+        return change, change, change
+
+    dof = (base_se2 + new_se2) ** 2 / (base_se2 ** 2 / (len(base) - 1) + new_se2 ** 2 / (len(new) - 1))
+    margin = stats.t.ppf(0.5 + confidence / 2, dof) * se / base_mean
+    return change, change - margin, change + margin
+
+
+def print_context_differences(base_context, new_context):
+    differences = [(key, base_context.get(key), new_context.get(key)) for key in CONTEXT_KEYS]
+    differences += [(key, base_context.get(key), new_context.get(key))
+                    for key in sorted(set(base_context) | set(new_context)) if key.startswith("version:")]
+    differences = [d for d in differences if d[1] != d[2]]
+    if not differences:
+        return
+    print("Context differences:")
+    for key, base_value, new_value in differences:
+        print(f"  {key}: {base_value} -> {new_value}")
+    print()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("baseline", type=Path, help="JSON file, or directory of JSON files")
+    parser.add_argument("candidate", type=Path, help="JSON file, or directory of JSON files")
+    parser.add_argument("--threshold", type=float, default=0.05,
+                        help="relative throughput change considered noise (default: 0.05)")
+    parser.add_argument("--confidence", type=float, default=0.95,
+                        help="confidence level of the intervals (default: 0.95)")
+    parser.add_argument("--all", action="store_true", help="print every benchmark, not only the flagged ones")
+    args = parser.parse_args()
+
+    base_files = json_files(args.baseline)
+    new_files = json_files(args.candidate)
+    for label, files in (("baseline", base_files), ("candidate", new_files)):
+        print(f"{label}: {', '.join(str(f) for f in files)}")
+    print()
+    base_context, base = load_results(base_files)
+    new_context, new = load_results(new_files)
+    print_context_differences(base_context, new_context)
+
+    regressions = 0
+    untested = 0
+    print(f"{'change':>8} {'interval':>19} {'n':>5}  benchmark")
+    for name in sorted(set(base) & set(new)):
+        change, low, high = relative_change_interval(base[name], new[name], args.confidence)
+        if not math.isfinite(low):
+            status = "untested"
+            untested += 1
+        elif high < -args.threshold:
+            status = "REGRESSION"
+            regressions += 1
+        elif low > args.threshold:
+            status = "improvement"
+        else:
+            status = ""
+        if status or args.all:
+            interval = f"[{low:+.1%}, {high:+.1%}]" if math.isfinite(low) else "[n/a]"
+            counts = f"{len(base[name])}/{len(new[name])}"
+            print(f"{change:>+8.1%} {interval:>19} {counts:>5}  {name} {status}")
+
+    for name in sorted(set(base) ^ set(new)):
+        print(f"only in {'baseline' if name in base else 'candidate'}: {name}")
+
+    print(f"\n{regressions} regression(s) beyond {args.threshold:.0%} at {args.confidence:.0%} confidence.")
+    if untested:
+        print(f"warning: {untested} benchmark(s) have fewer than 2 samples in a set and were not tested. "
+              f"Run them with --benchmark_repetitions=5 or more.", file=sys.stderr)
+    if regressions:
+        return 1
+    return 2 if untested else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
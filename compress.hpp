@@ -0,0 +1,398 @@
+// Copyright (C) 2023 Adam Lugowski. All rights reserved.
+// Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Builds compressed sparse arrays (CSC or CSR) from triplets.
+ *
+ * `outer` holds each entry's index in the compressed dimension (columns for CSC, rows for CSR), and `inner` holds
+ * the other index. Entries with the same outer index keep their input order, so a row-sorted file yields CSC with
+ * sorted row indices and CSR with sorted column indices.
+ *
+ * If the triplets are already ordered by outer index, `inner` and `vals` are moved into the result as-is and only
+ * `indptr` is built. Otherwise the entries are placed with a parallel two-pass counting sort: the first pass
+ * distributes them into ranges of outer indices, then each range is counting sorted by one thread. The per-index
+ * counts of the second pass are prefix summed directly into `indptr`.
+ *
+ * If `vals` is empty (pattern matrix) only the indices are compressed.
+ */
+template <typename IT, typename VT>
+class triplet_compressor {
+public:
+    triplet_compressor(int64_t num_outer, const std::vector<IT>& outer, std::vector<IT>& inner, std::vector<VT>& vals)
+        : num_outer(num_outer), outer(outer), inner(inner), vals(vals), has_vals(!vals.empty()) {}
+
+    /**
+     * Fill `indptr`, `indices`, and `compressed_vals`. Consumes `inner` and `vals`.
+     */
+    void compress(std::vector<IT>& indptr, std::vector<IT>& indices, std::vector<VT>& compressed_vals, int num_threads) {
+        const auto n = (int64_t)outer.size();
+        num_threads = usable_threads(num_threads);
+
+        indptr.resize(num_outer + 1);
+
+        if (is_ordered(num_threads)) {
+            build_ordered_indptr(indptr.data(), num_threads);
+            indices = std::move(inner);
+            compressed_vals = std::move(vals);
+            return;
+        }
+
+        indices.resize(n);
+        compressed_vals.resize(has_vals ? n : 0);
+        counting_sort(indptr.data(), indices.data(), compressed_vals.data(), num_threads);
+    }
+
+    /**
+     * Like compress(), but into preallocated arrays of `num_outer + 1` and nnz elements, such as the arrays of
+     * another library's matrix. Ordered triplets are copied instead of moved. Consumes `inner` and `vals`.
+     */
+    void compress_into(IT* indptr, IT* indices, VT* compressed_vals, int num_threads) {
+        num_threads = usable_threads(num_threads);
+
+        if (is_ordered(num_threads)) {
+            build_ordered_indptr(indptr, num_threads);
+            run_on_threads(num_threads, [&](int t) {
+                int64_t begin = slice_begin(t, num_threads);
+                int64_t end = slice_begin(t + 1, num_threads);
+                std::copy(inner.begin() + begin, inner.begin() + end, indices + begin);
+                if (has_vals) {
+                    std::move(vals.begin() + begin, vals.begin() + end, compressed_vals + begin);
+                }
+            });
+            inner = std::vector<IT>();
+            vals = std::vector<VT>();
+            return;
+        }
+
+        counting_sort(indptr, indices, compressed_vals, num_threads);
+    }
+
+protected:
+    static constexpr int64_t parallel_cutoff = 1u << 16;
+    static constexpr int64_t max_ranges = 1024;
+
+    template <typename FUNC>
+    static void run_on_threads(int num_threads, FUNC func) {
+        std::vector<std::thread> threads;
+        for (int t = 1; t < num_threads; ++t) {
+            threads.emplace_back(func, t);
+        }
+        func(0);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    [[nodiscard]] int usable_threads(int num_threads) const {
+        if ((int64_t)outer.size() < parallel_cutoff) {
+            return 1;
+        }
+        return std::max(num_threads, 1);
+    }
+
+    [[nodiscard]] int64_t slice_begin(int t, int num_threads) const {
+        return (int64_t)outer.size() * t / num_threads;
+    }
+
+    /**
+     * Whether `outer` is non-decreasing.
+     */
+    bool is_ordered(int num_threads) const {
+        std::atomic<bool> ordered{true};
+        run_on_threads(num_threads, [&](int t) {
+            // Each slice also checks the boundary with the previous slice.
+            int64_t begin = std::max(slice_begin(t, num_threads), (int64_t)1);
+            for (int64_t i = begin; i < slice_begin(t + 1, num_threads) && ordered.load(std::memory_order_relaxed); ++i) {
+                if (outer[i] < outer[i - 1]) {
+                    ordered = false;
+                }
+            }
+        });
+        return ordered;
+    }
+
+    /**
+     * indptr of ordered triplets: each outer index starts where the entries first reach it.
+     * Every thread writes the indptr entries for the outer indices that begin in its slice.
+     */
+    void build_ordered_indptr(IT* indptr, int num_threads) const {
+        const auto n = (int64_t)outer.size();
+        run_on_threads(num_threads, [&](int t) {
+            for (int64_t i = slice_begin(t, num_threads); i < slice_begin(t + 1, num_threads); ++i) {
+                int64_t prev = (i == 0) ? -1 : (int64_t)outer[i - 1];
+                for (int64_t o = prev + 1; o <= (int64_t)outer[i]; ++o) {
+                    indptr[o] = (IT)i;
+                }
+            }
+        });
+
+        int64_t last = (n == 0) ? -1 : (int64_t)outer[n - 1];
+        for (int64_t o = last + 1; o <= num_outer; ++o) {
+            indptr[o] = (IT)n;
+        }
+    }
+
+    void counting_sort(IT* indptr, IT* indices, VT* compressed_vals, int num_threads) {
+        const auto n = (int64_t)outer.size();
+        const int64_t range_width = std::max((num_outer + max_ranges - 1) / max_ranges, (int64_t)1);
+        const int64_t num_ranges = (num_outer + range_width - 1) / range_width;
+
+        // Pass 1: distribute into ranges of outer indices. Stable because each thread has its own cursor per range.
+        std::vector<std::vector<int64_t>> cursors(num_threads, std::vector<int64_t>(num_ranges, 0));
+        run_on_threads(num_threads, [&](int t) {
+            auto& counts = cursors[t];
+            for (int64_t i = slice_begin(t, num_threads); i < slice_begin(t + 1, num_threads); ++i) {
+                ++counts[outer[i] / range_width];
+            }
+        });
+
+        std::vector<int64_t> range_starts(num_ranges + 1);
+        int64_t sum = 0;
+        for (int64_t r = 0; r < num_ranges; ++r) {
+            range_starts[r] = sum;
+            for (int t = 0; t < num_threads; ++t) {
+                int64_t count = cursors[t][r];
+                cursors[t][r] = sum;
+                sum += count;
+            }
+        }
+        range_starts[num_ranges] = sum;
+
+        std::vector<IT> scratch_outer(n);
+        std::vector<IT> scratch_inner(n);
+        std::vector<VT> scratch_vals(has_vals ? n : 0);
+        run_on_threads(num_threads, [&](int t) {
+            auto& range_cursors = cursors[t];
+            for (int64_t i = slice_begin(t, num_threads); i < slice_begin(t + 1, num_threads); ++i) {
+                int64_t dest = range_cursors[outer[i] / range_width]++;
+                scratch_outer[dest] = outer[i];
+                scratch_inner[dest] = inner[i];
+                if (has_vals) {
+                    scratch_vals[dest] = std::move(vals[i]);
+                }
+            }
+        });
+        inner = std::vector<IT>();
+        vals = std::vector<VT>();
+
+        // Pass 2: counting sort within each range. Threads pick up the next unsorted range.
+        std::atomic<int64_t> next_range{0};
+        run_on_threads(num_threads, [&](int) {
+            std::vector<int64_t> heads(range_width);
+            for (int64_t r = next_range++; r < num_ranges; r = next_range++) {
+                const int64_t first_outer = r * range_width;
+                const int64_t width = std::min(range_width, num_outer - first_outer);
+
+                std::fill(heads.begin(), heads.begin() + width, 0);
+                for (int64_t i = range_starts[r]; i < range_starts[r + 1]; ++i) {
+                    ++heads[scratch_outer[i] - first_outer];
+                }
+
+                int64_t pos = range_starts[r];
+                for (int64_t o = 0; o < width; ++o) {
+                    indptr[first_outer + o] = (IT)pos;
+                    int64_t count = heads[o];
+                    heads[o] = pos;
+                    pos += count;
+                }
+
+                for (int64_t i = range_starts[r]; i < range_starts[r + 1]; ++i) {
+                    int64_t dest = heads[scratch_outer[i] - first_outer]++;
+                    indices[dest] = scratch_inner[i];
+                    if (has_vals) {
+                        compressed_vals[dest] = std::move(scratch_vals[i]);
+                    }
+                }
+            }
+        });
+        indptr[num_outer] = (IT)n;
+    }
+
+    int64_t num_outer;
+    const std::vector<IT>& outer;
+    std::vector<IT>& inner;
+    std::vector<VT>& vals;
+    const bool has_vals;
+};
+
+/**
+ * Compress triplets along `outer` using `num_threads` threads. Consumes `inner` and `vals`.
+ */
+template <typename IT, typename VT>
+void compress_triplets(int64_t num_outer, const std::vector<IT>& outer, std::vector<IT>& inner, std::vector<VT>& vals,
+                       std::vector<IT>& indptr, std::vector<IT>& indices, std::vector<VT>& compressed_vals,
+                       int num_threads) {
+    triplet_compressor<IT, VT>(num_outer, outer, inner, vals).compress(indptr, indices, compressed_vals, num_threads);
+}
+
+/**
+ * Expand compressed `indptr` back into one outer index per entry, e.g. the row of every CSR entry.
+ */
+template <typename IT>
+void expand_indptr(const std::vector<IT>& indptr, std::vector<IT>& outer, int num_threads) {
+    const auto num_outer = (int64_t)indptr.size() - 1;
+    outer.resize(num_outer < 0 ? 0 : indptr[num_outer]);
+    num_threads = std::max(1, std::min(num_threads, (int)std::max(num_outer, (int64_t)1)));
+
+    std::vector<std::thread> threads;
+    auto expand_slice = [&](int t) {
+        for (int64_t o = num_outer * t / num_threads; o < num_outer * (t + 1) / num_threads; ++o) {
+            std::fill(outer.begin() + indptr[o], outer.begin() + indptr[o + 1], (IT)o);
+        }
+    };
+    for (int t = 1; t < num_threads; ++t) {
+        threads.emplace_back(expand_slice, t);
+    }
+    expand_slice(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+/**
+ * Sort the inner indices of each outer index, e.g. the columns of each CSR row, moving `vals` along.
+ * Already sorted outer indices are left alone. `vals` may be null for pattern matrices.
+ */
+template <typename IT, typename VT>
+void sort_inner_indices(int64_t num_outer, const IT* indptr, IT* indices, VT* vals, int num_threads) {
+    num_threads = std::max(1, std::min(num_threads, (int)std::max(num_outer, (int64_t)1)));
+
+    std::vector<std::thread> threads;
+    auto sort_slice = [&](int t) {
+        std::vector<std::pair<IT, VT>> entries;
+        for (int64_t o = num_outer * t / num_threads; o < num_outer * (t + 1) / num_threads; ++o) {
+            IT* begin = indices + indptr[o];
+            IT* end = indices + indptr[o + 1];
+            if (std::is_sorted(begin, end)) {
+                continue;
+            }
+            if (vals == nullptr) {
+                std::sort(begin, end);
+                continue;
+            }
+
+            // stable, so duplicates stay in file order
+            entries.clear();
+            for (IT i = indptr[o]; i < indptr[o + 1]; ++i) {
+                entries.emplace_back(indices[i], std::move(vals[i]));
+            }
+            std::stable_sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+                return a.first < b.first;
+            });
+            for (IT i = indptr[o]; i < indptr[o + 1]; ++i) {
+                indices[i] = entries[i - indptr[o]].first;
+                vals[i] = std::move(entries[i - indptr[o]].second);
+            }
+        }
+    };
+    for (int t = 1; t < num_threads; ++t) {
+        threads.emplace_back(sort_slice, t);
+    }
+    sort_slice(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+/**
+ * Sum the entries that share an outer and inner index, like Eigen's setFromTriplets() does. The inner indices of
+ * each outer index must be sorted. Pattern matrices pass null `vals` and keep one of each duplicate.
+ *
+ * `indices` and `vals` are compacted in place and `indptr` is updated, so `indptr[num_outer]` is the new number of
+ * entries. Returns the number of entries removed.
+ */
+template <typename IT, typename VT>
+int64_t sum_duplicates(int64_t num_outer, IT* indptr, IT* indices, VT* vals, int num_threads) {
+    num_threads = std::max(1, std::min(num_threads, (int)std::max(num_outer, (int64_t)1)));
+    auto outer_begin = [&](int t) { return num_outer * t / num_threads; };
+
+    auto run_on_threads = [&](auto func) {
+        std::vector<std::thread> threads;
+        for (int t = 1; t < num_threads; ++t) {
+            threads.emplace_back(func, t);
+        }
+        func(0);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    };
+
+    // Most files have no duplicates, so check before changing anything.
+    std::atomic<bool> any_duplicates{false};
+    run_on_threads([&](int t) {
+        for (int64_t o = outer_begin(t); o < outer_begin(t + 1) && !any_duplicates.load(std::memory_order_relaxed); ++o) {
+            for (IT i = indptr[o] + 1; i < indptr[o + 1]; ++i) {
+                if (indices[i] == indices[i - 1]) {
+                    any_duplicates = true;
+                    break;
+                }
+            }
+        }
+    });
+    if (!any_duplicates) {
+        return 0;
+    }
+
+    // Each thread compacts its slice of outer indices in place, then the slices are moved together.
+    std::vector<int64_t> slice_starts(num_threads + 1);
+    for (int t = 0; t <= num_threads; ++t) {
+        slice_starts[t] = indptr[outer_begin(t)];
+    }
+    std::vector<int64_t> slice_sizes(num_threads);
+    run_on_threads([&](int t) {
+        int64_t pos = slice_starts[t];
+        int64_t start = slice_starts[t];
+        for (int64_t o = outer_begin(t); o < outer_begin(t + 1); ++o) {
+            // the next slice rewrites its first indptr entry, so the last end comes from slice_starts
+            int64_t end = (o + 1 == outer_begin(t + 1)) ? slice_starts[t + 1] : (int64_t)indptr[o + 1];
+            indptr[o] = (IT)pos;
+            for (int64_t i = start; i < end; ++i) {
+                if (i > start && indices[i] == indices[pos - 1]) {
+                    if (vals != nullptr) {
+                        vals[pos - 1] += vals[i];
+                    }
+                    continue;
+                }
+                indices[pos] = indices[i];
+                if (vals != nullptr) {
+                    vals[pos] = std::move(vals[i]);
+                }
+                ++pos;
+            }
+            start = end;
+        }
+        slice_sizes[t] = pos - slice_starts[t];
+    });
+
+    std::vector<int64_t> shifts(num_threads);
+    int64_t dest = slice_starts[0];
+    for (int t = 0; t < num_threads; ++t) {
+        shifts[t] = slice_starts[t] - dest;
+        if (shifts[t] > 0) {
+            std::move(indices + slice_starts[t], indices + slice_starts[t] + slice_sizes[t], indices + dest);
+            if (vals != nullptr) {
+                std::move(vals + slice_starts[t], vals + slice_starts[t] + slice_sizes[t], vals + dest);
+            }
+        }
+        dest += slice_sizes[t];
+    }
+    run_on_threads([&](int t) {
+        for (int64_t o = outer_begin(t); o < outer_begin(t + 1); ++o) {
+            indptr[o] = (IT)((int64_t)indptr[o] - shifts[t]);
+        }
+    });
+
+    auto removed = slice_starts[num_threads] - dest;
+    indptr[num_outer] = (IT)dest;
+    return removed;
+}
@@ -0,0 +1,949 @@
+// Copyright (C) 2023 Adam Lugowski. All rights reserved.
+// Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+/*
+ * Decompression of compressed Matrix Market files into a std::streambuf, so fast_matrix_market can parse them.
+ *
+ * The compressed file is cut into independently decodable frames, which worker threads decompress concurrently
+ * while the parser consumes the output in order:
+ *  - zstd: every zstd frame, e.g. from pzstd, concatenated files, or the seekable format.
+ *  - lz4: every LZ4 frame. Frame boundaries are found by walking the block headers, without decompressing.
+ *  - gzip: every member that declares its own length in the gzip header, like BGZF (bgzip) blocks.
+ *    Members may also declare their length in an `SZ` extra subfield that holds the 8-byte little-endian member
+ *    length. Standard gzip tools ignore it.
+ * Files that cannot be split, such as the single frame written by `zstd -T0` or by `gzip`, are decompressed
+ * sequentially by one worker thread, which still overlaps decompression with parsing.
+ *
+ * compressing_streambuf does the reverse for writers: formatted output is cut into line-aligned blocks that worker
+ * threads compress into such frames.
+ */
+
+enum class compression_type {none, gzip, zstd, lz4};
+
+/**
+ * Compression type from a file name: `.gz`, `.zst`, or `.lz4`.
+ */
+inline compression_type compression_from_extension(const std::filesystem::path& path) {
+    auto ext = path.extension();
+    if (ext == ".gz") return compression_type::gzip;
+    if (ext == ".zst") return compression_type::zstd;
+    if (ext == ".lz4") return compression_type::lz4;
+    return compression_type::none;
+}
+
+/**
+ * Whether this build can decompress `type`.
+ */
+inline bool compression_supported(compression_type type) {
+    switch (type) {
+#ifdef HAVE_ZLIB
+        case compression_type::gzip: return true;
+#endif
+#ifdef HAVE_ZSTD
+        case compression_type::zstd: return true;
+#endif
+#ifdef HAVE_LZ4
+        case compression_type::lz4: return true;
+#endif
+        default: return false;
+    }
+}
+
+/**
+ * Receives decompressed chunks. Returns false to stop decompression.
+ */
+using chunk_sink = std::function<bool(std::vector<char>&&)>;
+
+struct compressed_frame {
+    std::size_t offset;
+    std::size_t size;
+};
+
+inline uint64_t read_le(const unsigned char* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; --i) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+inline void write_le(unsigned char* p, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+/**
+ * Fast compression level of each type. Writes should be bound by compression throughput, not by the ratio.
+ */
+inline int fast_compression_level(compression_type type) {
+    switch (type) {
+        case compression_type::gzip: return 1;
+        case compression_type::zstd: return 1;
+        default: return 0;
+    }
+}
+
+#ifdef HAVE_ZLIB
+/**
+ * Length of the gzip member at `src` if its header declares one in a BGZF `BC` or an `SZ` extra subfield, else 0.
+ */
+inline std::size_t declared_gzip_member_size(const unsigned char* src, std::size_t size) {
+    constexpr unsigned char FEXTRA = 4;
+    if (size < 12 || src[0] != 0x1f || src[1] != 0x8b || src[2] != 8 || !(src[3] & FEXTRA)) {
+        return 0;
+    }
+    std::size_t xlen = read_le(src + 10, 2);
+    const unsigned char* field = src + 12;
+    const unsigned char* extra_end = field + std::min(xlen, size - 12);
+    while (field + 4 <= extra_end) {
+        std::size_t len = read_le(field + 2, 2);
+        if (field + 4 + len > extra_end) {
+            break;
+        }
+        if (field[0] == 'B' && field[1] == 'C' && len == 2) {
+            return read_le(field + 4, 2) + 1;
+        }
+        if (field[0] == 'S' && field[1] == 'Z' && len == 8) {
+            return read_le(field + 4, 8);
+        }
+        field += 4 + len;
+    }
+    return 0;
+}
+
+inline std::vector<compressed_frame> find_gzip_frames(const char* src, std::size_t size) {
+    std::vector<compressed_frame> frames;
+    std::size_t offset = 0;
+    while (offset < size) {
+        std::size_t member = declared_gzip_member_size(reinterpret_cast<const unsigned char*>(src) + offset, size - offset);
+        if (member == 0 || member > size - offset) {
+            // The rest cannot be split without decompressing it.
+            member = size - offset;
+        }
+        frames.push_back({offset, member});
+        offset += member;
+    }
+    return frames;
+}
+
+/**
+ * Decompress one or more concatenated gzip members.
+ */
+inline void decompress_gzip(const char* src, std::size_t size, std::size_t chunk_size, const chunk_sink& sink) {
+    z_stream zs{};
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+        throw std::runtime_error("inflateInit2 failed");
+    }
+    std::size_t consumed = 0;
+    bool more = true;
+    while (more) {
+        std::vector<char> chunk(chunk_size);
+        zs.next_out = reinterpret_cast<Bytef*>(chunk.data());
+        zs.avail_out = (uInt)chunk.size();
+
+        int ret = Z_OK;
+        while (zs.avail_out > 0) {
+            if (zs.avail_in == 0) {
+                // zlib counts input in 32 bits
+                std::size_t feed = std::min(size - consumed, (std::size_t)UINT_MAX);
+                zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(src + consumed));
+                zs.avail_in = (uInt)feed;
+                consumed += feed;
+            }
+            ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                if (zs.avail_in == 0 && consumed == size) {
+                    more = false;
+                    break;
+                }
+                // next member
+                inflateReset(&zs);
+            } else if (ret != Z_OK) {
+                if (ret == Z_BUF_ERROR && zs.avail_in == 0 && consumed == size) {
+                    inflateEnd(&zs);
+                    throw std::runtime_error("Truncated gzip stream");
+                }
+                std::string msg = zs.msg ? zs.msg : "inflate error " + std::to_string(ret);
+                inflateEnd(&zs);
+                throw std::runtime_error(msg);
+            }
+        }
+
+        chunk.resize(chunk.size() - zs.avail_out);
+        if (!chunk.empty() && !sink(std::move(chunk))) {
+            break;
+        }
+    }
+    inflateEnd(&zs);
+}
+
+/**
+ * Compress `src` into one gzip member. The header has an `SZ` extra subfield with the member length.
+ */
+inline std::vector<char> compress_gzip_member(const char* src, std::size_t size, int level) {
+    constexpr std::size_t header_size = 10 + 2 + 12;
+    constexpr std::size_t trailer_size = 8;
+    if (size > UINT_MAX) {
+        throw std::invalid_argument("gzip block too large");
+    }
+
+    z_stream zs{};
+    if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("deflateInit2 failed");
+    }
+    std::vector<char> member(header_size + deflateBound(&zs, (uLong)size) + trailer_size);
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(src));
+    zs.avail_in = (uInt)size;
+    zs.next_out = reinterpret_cast<Bytef*>(member.data() + header_size);
+    zs.avail_out = (uInt)(member.size() - header_size - trailer_size);
+    int ret = deflate(&zs, Z_FINISH);
+    std::size_t deflated = zs.total_out;
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        throw std::runtime_error("deflate error " + std::to_string(ret));
+    }
+    member.resize(header_size + deflated + trailer_size);
+
+    auto* header = reinterpret_cast<unsigned char*>(member.data());
+    const unsigned char fixed[] = {0x1f, 0x8b, 8, 4 /* FEXTRA */, 0, 0, 0, 0 /* MTIME */, 0, 255 /* OS */,
+                                   12, 0 /* XLEN */, 'S', 'Z', 8, 0};
+    std::memcpy(header, fixed, sizeof(fixed));
+    write_le(header + sizeof(fixed), member.size(), 8);
+
+    auto* trailer = header + header_size + deflated;
+    write_le(trailer, crc32(crc32(0, Z_NULL, 0), reinterpret_cast<const Bytef*>(src), (uInt)size), 4);
+    write_le(trailer + 4, size, 4);
+    return member;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+inline std::vector<compressed_frame> find_zstd_frames(const char* src, std::size_t size) {
+    std::vector<compressed_frame> frames;
+    std::size_t offset = 0;
+    while (offset < size) {
+        std::size_t frame = ZSTD_findFrameCompressedSize(src + offset, size - offset);
+        if (ZSTD_isError(frame)) {
+            throw std::runtime_error(std::string("Invalid zstd frame: ") + ZSTD_getErrorName(frame));
+        }
+        frames.push_back({offset, frame});
+        offset += frame;
+    }
+    return frames;
+}
+
+/**
+ * Decompress one or more concatenated zstd frames.
+ */
+inline void decompress_zstd(const char* src, std::size_t size, std::size_t chunk_size, const chunk_sink& sink) {
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    ZSTD_inBuffer in{src, size, 0};
+    std::size_t ret = 0;
+    while (true) {
+        std::vector<char> chunk(chunk_size);
+        ZSTD_outBuffer out{chunk.data(), chunk.size(), 0};
+        ret = ZSTD_decompressStream(dctx, &out, &in);
+        if (ZSTD_isError(ret)) {
+            ZSTD_freeDCtx(dctx);
+            throw std::runtime_error(std::string("zstd error: ") + ZSTD_getErrorName(ret));
+        }
+        bool done = in.pos == in.size && out.pos < out.size;
+        chunk.resize(out.pos);
+        if (!chunk.empty() && !sink(std::move(chunk))) {
+            break;
+        }
+        if (done) {
+            break;
+        }
+    }
+    ZSTD_freeDCtx(dctx);
+    if (ret != 0 && in.pos == in.size) {
+        throw std::runtime_error("Truncated zstd stream");
+    }
+}
+
+/**
+ * Compress `src` into one zstd frame.
+ */
+inline std::vector<char> compress_zstd_frame(const char* src, std::size_t size, int level) {
+    std::vector<char> frame(ZSTD_compressBound(size));
+    std::size_t ret = ZSTD_compress(frame.data(), frame.size(), src, size, level);
+    if (ZSTD_isError(ret)) {
+        throw std::runtime_error(std::string("zstd error: ") + ZSTD_getErrorName(ret));
+    }
+    frame.resize(ret);
+    return frame;
+}
+
+/**
+ * Seek table of the zstd seekable format: a skippable frame with the compressed and decompressed size of every frame.
+ */
+inline std::vector<char> zstd_seek_table(const std::vector<std::pair<uint32_t, uint32_t>>& frame_sizes) {
+    constexpr std::size_t footer_size = 9;
+    std::vector<char> table(8 + 8 * frame_sizes.size() + footer_size);
+    auto* p = reinterpret_cast<unsigned char*>(table.data());
+    write_le(p, 0x184D2A5Eu, 4);
+    write_le(p + 4, table.size() - 8, 4);
+    p += 8;
+    for (const auto& [compressed_size, decompressed_size] : frame_sizes) {
+        write_le(p, compressed_size, 4);
+        write_le(p + 4, decompressed_size, 4);
+        p += 8;
+    }
+    write_le(p, frame_sizes.size(), 4);
+    p[4] = 0; // no checksums
+    write_le(p + 5, 0x8F92EAB1u, 4);
+    return table;
+}
+#endif
+
+#ifdef HAVE_LZ4
+/**
+ * Length of the LZ4 frame at `src`, found from the frame and block headers. Returns 0 if it is malformed.
+ */
+inline std::size_t lz4_frame_size(const unsigned char* src, std::size_t size) {
+    if (size < 8) {
+        return 0;
+    }
+    uint64_t magic = read_le(src, 4);
+    if ((magic & 0xFFFFFFF0u) == 0x184D2A50u) {
+        // skippable frame
+        return 8 + read_le(src + 4, 4);
+    }
+    if (magic != 0x184D2204u) {
+        return 0;
+    }
+
+    unsigned flags = src[4];
+    bool block_checksum = flags & 0x10;
+    bool content_size = flags & 0x08;
+    bool content_checksum = flags & 0x04;
+    bool dict_id = flags & 0x01;
+    std::size_t pos = 4 + 2 + (content_size ? 8 : 0) + (dict_id ? 4 : 0) + 1;
+
+    while (pos + 4 <= size) {
+        uint64_t block = read_le(src + pos, 4);
+        pos += 4;
+        if (block == 0) {
+            pos += content_checksum ? 4 : 0;
+            return pos <= size ? pos : 0;
+        }
+        pos += (block & 0x7FFFFFFFu) + (block_checksum ? 4 : 0);
+    }
+    return 0;
+}
+
+inline std::vector<compressed_frame> find_lz4_frames(const char* src, std::size_t size) {
+    std::vector<compressed_frame> frames;
+    std::size_t offset = 0;
+    while (offset < size) {
+        std::size_t frame = lz4_frame_size(reinterpret_cast<const unsigned char*>(src) + offset, size - offset);
+        if (frame == 0) {
+            throw std::runtime_error("Invalid LZ4 frame");
+        }
+        frames.push_back({offset, frame});
+        offset += frame;
+    }
+    return frames;
+}
+
+/**
+ * Decompress one or more concatenated LZ4 frames.
+ */
+inline void decompress_lz4(const char* src, std::size_t size, std::size_t chunk_size, const chunk_sink& sink) {
+    LZ4F_dctx* dctx = nullptr;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+        throw std::runtime_error("LZ4F_createDecompressionContext failed");
+    }
+    std::size_t consumed = 0;
+    while (true) {
+        std::vector<char> chunk(chunk_size);
+        std::size_t filled = 0;
+        bool progress = true;
+        while (filled < chunk.size() && progress) {
+            std::size_t src_size = size - consumed;
+            std::size_t dst_size = chunk.size() - filled;
+            std::size_t ret = LZ4F_decompress(dctx, chunk.data() + filled, &dst_size, src + consumed, &src_size, nullptr);
+            if (LZ4F_isError(ret)) {
+                LZ4F_freeDecompressionContext(dctx);
+                throw std::runtime_error(std::string("lz4 error: ") + LZ4F_getErrorName(ret));
+            }
+            consumed += src_size;
+            filled += dst_size;
+            progress = src_size > 0 || dst_size > 0;
+        }
+        chunk.resize(filled);
+        if (chunk.empty() || !sink(std::move(chunk)) || !progress) {
+            break;
+        }
+    }
+    LZ4F_freeDecompressionContext(dctx);
+}
+
+/**
+ * Compress `src` into one LZ4 frame.
+ */
+inline std::vector<char> compress_lz4_frame(const char* src, std::size_t size, int level) {
+    LZ4F_preferences_t prefs{};
+    prefs.frameInfo.contentSize = size;
+    prefs.compressionLevel = level;
+    std::vector<char> frame(LZ4F_compressFrameBound(size, &prefs));
+    std::size_t ret = LZ4F_compressFrame(frame.data(), frame.size(), src, size, &prefs);
+    if (LZ4F_isError(ret)) {
+        throw std::runtime_error(std::string("lz4 error: ") + LZ4F_getErrorName(ret));
+    }
+    frame.resize(ret);
+    return frame;
+}
+#endif
+
+/**
+ * Read-only stream over a compressed file, decompressed on worker threads.
+ *
+ * Up to `2 * num_threads` frames are decompressed ahead of the reader, so memory use is bounded by the frame size.
+ * Decompression errors are rethrown by the reading thread.
+ */
+class decompressing_streambuf : public std::streambuf {
+public:
+    static constexpr std::size_t chunk_size = 4u << 20;
+
+    /**
+     * Frames larger than this are not decompressed whole. The file is decompressed sequentially instead.
+     */
+    static constexpr std::size_t max_parallel_frame_size = 64u << 20;
+
+    decompressing_streambuf(const std::filesystem::path& path, compression_type type, int num_threads)
+        : type(type), window(std::max(2 * num_threads, 2)) {
+        if (!compression_supported(type)) {
+            throw std::invalid_argument("Compression not supported by this build: " + path.string());
+        }
+        map_file(path);
+
+        frames = find_frames();
+        bool parallel = frames.size() > 1 && std::all_of(frames.begin(), frames.end(), [](const compressed_frame& f) {
+            return f.size <= max_parallel_frame_size;
+        });
+
+        if (parallel) {
+            total_slots = frames.size();
+            for (int t = 0; t < std::min(num_threads, (int)frames.size()); ++t) {
+                workers.emplace_back([this]() { decompress_frames(); });
+            }
+        } else {
+            workers.emplace_back([this]() { decompress_sequentially(); });
+        }
+    }
+
+    decompressing_streambuf(const decompressing_streambuf&) = delete;
+    decompressing_streambuf& operator=(const decompressing_streambuf&) = delete;
+
+    ~decompressing_streambuf() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        if (compressed != nullptr) {
+            munmap(const_cast<char*>(compressed), compressed_size);
+        }
+    }
+
+    [[nodiscard]] std::size_t compressed_bytes() const {
+        return compressed_size;
+    }
+
+    /**
+     * Decompressed bytes handed to the reader so far.
+     */
+    [[nodiscard]] std::size_t decompressed_bytes() const {
+        return delivered_bytes;
+    }
+
+protected:
+    int_type underflow() override {
+        while (gptr() == egptr()) {
+            if (current_chunk + 1 < current.size()) {
+                ++current_chunk;
+            } else if (!next_slot()) {
+                return traits_type::eof();
+            }
+            auto& chunk = current[current_chunk];
+            setg(chunk.data(), chunk.data(), chunk.data() + chunk.size());
+            delivered_bytes += chunk.size();
+        }
+        return traits_type::to_int_type(*gptr());
+    }
+
+    /**
+     * Wait for the next slot of decompressed chunks. Returns false at the end of the stream.
+     */
+    bool next_slot() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return error || ready.count(next_consume) > 0 || next_consume >= total_slots; });
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        if (ready.count(next_consume) == 0) {
+            return false;
+        }
+        current = std::move(ready[next_consume]);
+        ready.erase(next_consume);
+        ++next_consume;
+        current_chunk = 0;
+        lock.unlock();
+        cv.notify_all();
+
+        // skippable frames decompress to nothing
+        if (current.empty()) {
+            current.emplace_back();
+        }
+        return true;
+    }
+
+    void map_file(const std::filesystem::path& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + path.string());
+        }
+        struct stat st{};
+        fstat(fd, &st);
+        compressed_size = (std::size_t)st.st_size;
+        if (compressed_size > 0) {
+            void* addr = mmap(nullptr, compressed_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Could not map " + path.string());
+            }
+            compressed = static_cast<const char*>(addr);
+        }
+        close(fd);
+    }
+
+    std::vector<compressed_frame> find_frames() const {
+        switch (type) {
+#ifdef HAVE_ZLIB
+            case compression_type::gzip: return find_gzip_frames(compressed, compressed_size);
+#endif
+#ifdef HAVE_ZSTD
+            case compression_type::zstd: return find_zstd_frames(compressed, compressed_size);
+#endif
+#ifdef HAVE_LZ4
+            case compression_type::lz4: return find_lz4_frames(compressed, compressed_size);
+#endif
+            default: return {};
+        }
+    }
+
+    void decompress(const char* src, std::size_t size, const chunk_sink& sink) const {
+        switch (type) {
+#ifdef HAVE_ZLIB
+            case compression_type::gzip: decompress_gzip(src, size, chunk_size, sink); break;
+#endif
+#ifdef HAVE_ZSTD
+            case compression_type::zstd: decompress_zstd(src, size, chunk_size, sink); break;
+#endif
+#ifdef HAVE_LZ4
+            case compression_type::lz4: decompress_lz4(src, size, chunk_size, sink); break;
+#endif
+            default: break;
+        }
+    }
+
+    /**
+     * Wait until `slot` is within the read-ahead window. Returns false if the stream is being destroyed.
+     */
+    bool wait_for_window(std::size_t slot) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return stopping || error || slot < next_consume + window; });
+        return !stopping && !error;
+    }
+
+    void publish(std::size_t slot, std::vector<std::vector<char>>&& chunks) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready[slot] = std::move(chunks);
+        }
+        cv.notify_all();
+    }
+
+    void fail(std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = e;
+            }
+        }
+        cv.notify_all();
+    }
+
+    /**
+     * Worker: decompress whole frames, one slot per frame.
+     */
+    void decompress_frames() {
+        try {
+            for (std::size_t f = next_frame++; f < frames.size(); f = next_frame++) {
+                if (!wait_for_window(f)) {
+                    return;
+                }
+                std::vector<std::vector<char>> chunks;
+                decompress(compressed + frames[f].offset, frames[f].size, [&](std::vector<char>&& chunk) {
+                    chunks.push_back(std::move(chunk));
+                    return true;
+                });
+                publish(f, std::move(chunks));
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    }
+
+    /**
+     * Worker: decompress the whole file, one slot per chunk.
+     */
+    void decompress_sequentially() {
+        std::size_t slot = 0;
+        try {
+            decompress(compressed, compressed_size, [&](std::vector<char>&& chunk) {
+                if (!wait_for_window(slot)) {
+                    return false;
+                }
+                std::vector<std::vector<char>> chunks;
+                chunks.push_back(std::move(chunk));
+                publish(slot++, std::move(chunks));
+                return true;
+            });
+        } catch (...) {
+            fail(std::current_exception());
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            total_slots = slot;
+        }
+        cv.notify_all();
+    }
+
+    compression_type type;
+    std::size_t window;
+    const char* compressed = nullptr;
+    std::size_t compressed_size = 0;
+    std::vector<compressed_frame> frames;
+
+    std::vector<std::thread> workers;
+    std::atomic<std::size_t> next_frame{0};
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::map<std::size_t, std::vector<std::vector<char>>> ready;
+    std::size_t next_consume = 0;
+    std::size_t total_slots = SIZE_MAX;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    std::vector<std::vector<char>> current;
+    std::size_t current_chunk = 0;
+    std::size_t delivered_bytes = 0;
+};
+
+/**
+ * Write-only stream that compresses into a file on worker threads.
+ *
+ * The output is cut after the last newline of every `block_size` bytes, and each block is compressed by a worker
+ * into an independent frame: a gzip member with an `SZ` subfield, a zstd frame, or an LZ4 frame. The frames are
+ * written in order, so the file is readable by the standard tools and can be decompressed in parallel by
+ * decompressing_streambuf. zstd files end with a zstd seekable format seek table.
+ *
+ * Call close() to finish the file and to see errors. The destructor also closes, but discards errors.
+ */
+class compressing_streambuf : public std::streambuf {
+public:
+    static constexpr std::size_t block_size = 4u << 20;
+
+    compressing_streambuf(const std::filesystem::path& path, compression_type type, int num_threads, int level)
+        : type(type), level(level), window(std::max(2 * num_threads, 2)) {
+        if (!compression_supported(type)) {
+            throw std::invalid_argument("Compression not supported by this build: " + path.string());
+        }
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + path.string());
+        }
+        buffer.resize(block_size);
+        setp(buffer.data(), buffer.data() + buffer.size());
+
+        for (int t = 0; t < std::max(num_threads, 1); ++t) {
+            workers.emplace_back([this]() { compress_blocks(); });
+        }
+    }
+
+    compressing_streambuf(const std::filesystem::path& path, compression_type type, int num_threads)
+        : compressing_streambuf(path, type, num_threads, fast_compression_level(type)) {}
+
+    compressing_streambuf(const compressing_streambuf&) = delete;
+    compressing_streambuf& operator=(const compressing_streambuf&) = delete;
+
+    ~compressing_streambuf() override {
+        try {
+            close();
+        } catch (...) {
+        }
+    }
+
+    /**
+     * Compress the remaining output, wait for the workers, and close the file.
+     */
+    void close() {
+        if (fd < 0) {
+            return;
+        }
+        try {
+            buffer.resize(pptr() - pbase());
+            setp(nullptr, nullptr);
+            if (!buffer.empty()) {
+                submit(std::move(buffer));
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finishing = true;
+        }
+        cv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+
+        try {
+            if (!error && type == compression_type::zstd) {
+#ifdef HAVE_ZSTD
+                write_all(zstd_seek_table(frame_sizes));
+#endif
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        int ret = ::close(fd);
+        fd = -1;
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        if (ret != 0) {
+            throw std::runtime_error("Error closing compressed file");
+        }
+    }
+
+    /**
+     * Bytes written to the file so far.
+     */
+    [[nodiscard]] std::size_t compressed_bytes() const {
+        return written_bytes;
+    }
+
+    /**
+     * Uncompressed bytes written to the stream.
+     */
+    [[nodiscard]] std::size_t uncompressed_bytes() const {
+        return submitted_bytes + (pptr() - pbase());
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        cut_block();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    /**
+     * Flushing does not end a frame. Frames are only cut at block boundaries and on close().
+     */
+    int sync() override {
+        return 0;
+    }
+
+    /**
+     * Submit the full buffer up to its last newline. The remaining partial line starts the next block.
+     */
+    void cut_block() {
+        std::size_t filled = pptr() - pbase();
+        std::reverse_iterator<char*> rbegin(pptr()), rend(pbase());
+        auto newline = std::find(rbegin, rend, '\n');
+        // A line longer than the whole block is cut anyway.
+        std::size_t cut = (newline == rend) ? filled : (std::size_t)(newline.base() - pbase());
+
+        std::vector<char> next(block_size);
+        std::copy(pbase() + cut, pbase() + filled, next.data());
+        buffer.resize(cut);
+        submit(std::move(buffer));
+
+        buffer = std::move(next);
+        setp(buffer.data(), buffer.data() + buffer.size());
+        pbump((int)(filled - cut));
+    }
+
+    /**
+     * Queue a block for compression. Blocks once `window` blocks are waiting to be compressed or written.
+     */
+    void submit(std::vector<char>&& block) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return error || next_block < next_write + window; });
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        submitted_bytes += block.size();
+        queue.emplace_back(next_block++, std::move(block));
+        lock.unlock();
+        cv.notify_all();
+    }
+
+    std::vector<char> compress(const std::vector<char>& block) const {
+        switch (type) {
+#ifdef HAVE_ZLIB
+            case compression_type::gzip: return compress_gzip_member(block.data(), block.size(), level);
+#endif
+#ifdef HAVE_ZSTD
+            case compression_type::zstd: return compress_zstd_frame(block.data(), block.size(), level);
+#endif
+#ifdef HAVE_LZ4
+            case compression_type::lz4: return compress_lz4_frame(block.data(), block.size(), level);
+#endif
+            default: return {};
+        }
+    }
+
+    void write_all(const std::vector<char>& data) {
+        std::size_t offset = 0;
+        while (offset < data.size()) {
+            ssize_t ret = ::write(fd, data.data() + offset, data.size() - offset);
+            if (ret < 0) {
+                throw std::runtime_error("Error writing compressed file");
+            }
+            offset += ret;
+        }
+        written_bytes += data.size();
+    }
+
+    void fail(std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = e;
+            }
+        }
+        cv.notify_all();
+    }
+
+    /**
+     * Worker: compress blocks from the queue. Whichever worker finishes the next frame in file order writes it,
+     * along with any later frames that are already done.
+     */
+    void compress_blocks() {
+        try {
+            while (true) {
+                std::pair<std::size_t, std::vector<char>> block;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&] { return error || finishing || !queue.empty(); });
+                    if (error || queue.empty()) {
+                        return;
+                    }
+                    block = std::move(queue.front());
+                    queue.pop_front();
+                }
+
+                auto frame = compress(block.second);
+
+                std::unique_lock<std::mutex> lock(mutex);
+                done[block.first] = {std::move(frame), block.second.size()};
+                if (writing) {
+                    continue;
+                }
+                writing = true;
+                while (!error && done.count(next_write) > 0) {
+                    auto [data, uncompressed_size] = std::move(done[next_write]);
+                    done.erase(next_write);
+                    lock.unlock();
+                    write_all(data);
+                    lock.lock();
+                    frame_sizes.emplace_back((uint32_t)data.size(), (uint32_t)uncompressed_size);
+                    ++next_write;
+                    cv.notify_all();
+                }
+                writing = false;
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    }
+
+    compression_type type;
+    int level;
+    std::size_t window;
+    int fd = -1;
+    std::vector<char> buffer;
+    std::size_t submitted_bytes = 0;
+    std::size_t written_bytes = 0;
+
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<std::size_t, std::vector<char>>> queue;
+    std::map<std::size_t, std::pair<std::vector<char>, std::size_t>> done;
+    std::size_t next_block = 0;
+    std::size_t next_write = 0;
+    bool writing = false;
+    bool finishing = false;
+    std::exception_ptr error;
+
+    std::vector<std::pair<uint32_t, uint32_t>> frame_sizes;
+};
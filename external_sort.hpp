@@ -0,0 +1,331 @@
+// Copyright (C) 2023 Adam Lugowski. All rights reserved.
+// Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <queue>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+#include <fast_matrix_market/fast_matrix_market.hpp>
+
+#include "parse_handlers.hpp"
+#include "radix_sort.hpp"
+
+/*
+ * Out-of-core sort of a Matrix Market file.
+ *
+ * The body is read in blocks that fit the memory limit. Each block is parsed with fast_matrix_market, sorted, and
+ * written to a temporary run file. The runs are then k-way merged into the output file.
+ */
+
+template <typename T>
+void write_binary_value(std::ostream& os, const T& value) {
+    static_assert(std::is_trivially_copyable_v<T>, "value type must be trivially copyable or have an overload");
+    os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+inline void write_binary_value(std::ostream& os, const std::string& value) {
+    auto length = (uint32_t)value.size();
+    os.write(reinterpret_cast<const char*>(&length), sizeof(length));
+    os.write(value.data(), length);
+}
+
+template <typename T>
+void read_binary_value(std::istream& is, T& value) {
+    is.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+inline void read_binary_value(std::istream& is, std::string& value) {
+    uint32_t length = 0;
+    is.read(reinterpret_cast<char*>(&length), sizeof(length));
+    value.resize(length);
+    is.read(value.data(), length);
+}
+
+/**
+ * Read-only stream over an existing string, to avoid the copy std::istringstream makes.
+ */
+class string_streambuf : public std::streambuf {
+public:
+    explicit string_streambuf(std::string& str) {
+        setg(str.data(), str.data(), str.data() + str.size());
+    }
+};
+
+/**
+ * Sequential reader of a sorted run file. Holds a fixed number of entries in memory at a time.
+ */
+template <typename IT, typename VT>
+class run_reader {
+public:
+    run_reader(const std::filesystem::path& path, int64_t num_entries, bool has_vals, int64_t buffer_entries)
+        : stream(path, std::ios_base::binary), remaining(num_entries), has_vals(has_vals),
+          buffer_entries(std::max(buffer_entries, (int64_t)1)) {
+        refill();
+    }
+
+    [[nodiscard]] bool empty() const {
+        return pos == (int64_t)rows.size();
+    }
+
+    [[nodiscard]] IT row() const { return rows[pos]; }
+    [[nodiscard]] IT col() const { return cols[pos]; }
+    [[nodiscard]] VT& val() { return vals[pos]; }
+
+    void pop() {
+        if (++pos == (int64_t)rows.size()) {
+            refill();
+        }
+    }
+
+protected:
+    void refill() {
+        int64_t count = std::min(remaining, buffer_entries);
+        rows.resize(count);
+        cols.resize(count);
+        vals.resize(has_vals ? count : 0);
+        for (int64_t i = 0; i < count; ++i) {
+            read_binary_value(stream, rows[i]);
+            read_binary_value(stream, cols[i]);
+            if (has_vals) {
+                read_binary_value(stream, vals[i]);
+            }
+        }
+        remaining -= count;
+        pos = 0;
+    }
+
+    std::ifstream stream;
+    int64_t remaining;
+    bool has_vals;
+    int64_t buffer_entries;
+
+    std::vector<IT> rows;
+    std::vector<IT> cols;
+    std::vector<VT> vals;
+    int64_t pos = 0;
+};
+
+/**
+ * Sort a Matrix Market file using at most approximately `memory_limit` bytes.
+ */
+template <typename KEY, typename IT, typename VT>
+class external_sorter {
+public:
+    external_sorter(const KEY& key, const std::filesystem::path& in_path, const std::filesystem::path& out_path,
+                    int64_t memory_limit, int num_threads)
+        : key(key), in_path(in_path), out_path(out_path), memory_limit(memory_limit), num_threads(num_threads) {}
+
+    void sort() {
+        std::ifstream f(in_path);
+        fast_matrix_market::read_header(f, header);
+
+        // Size the blocks so the text, the parsed triplets, and the sort scratch space fit the limit.
+        int64_t body_bytes = (int64_t)std::filesystem::file_size(in_path);
+        double bytes_per_line = header.nnz > 0 ? (double)body_bytes / (double)header.nnz : 1;
+        double bytes_per_entry = bytes_per_line + 2.0 * (2 * sizeof(IT) + sizeof(VT));
+        entries_per_run = std::max((int64_t)((double)memory_limit / bytes_per_entry), (int64_t)1);
+        block_bytes = std::max((int64_t)(bytes_per_line * (double)entries_per_run), (int64_t)1);
+
+        // the run files are removed however the sort ends, e.g. when the disk fills up during the merge
+        run_file_remover remover{runs};
+        write_runs(f);
+        merge_runs();
+    }
+
+protected:
+    struct run {
+        std::filesystem::path path;
+        int64_t num_entries;
+    };
+
+    /**
+     * Removes the run files when it goes out of scope.
+     */
+    struct run_file_remover {
+        std::vector<run>& runs;
+
+        ~run_file_remover() {
+            for (const auto& r : runs) {
+                std::error_code ec;
+                std::filesystem::remove(r.path, ec);
+            }
+            runs.clear();
+        }
+    };
+
+    /**
+     * Read the next block of whole lines.
+     */
+    bool read_block(std::istream& f, std::string& block) {
+        block.resize(block_bytes);
+        f.read(block.data(), (std::streamsize)block.size());
+        block.resize(f.gcount());
+        if (block.empty()) {
+            return false;
+        }
+
+        if (block.back() != '\n') {
+            std::string rest;
+            std::getline(f, rest);
+            block += rest;
+            block += '\n';
+        }
+        return true;
+    }
+
+    /**
+     * Number of lines in `block` that hold an entry. Like fast_matrix_market, empty and whitespace-only lines are skipped.
+     */
+    static int64_t count_entry_lines(const std::string& block) {
+        int64_t count = 0;
+        bool blank = true;
+        for (char c : block) {
+            if (c == '\n') {
+                count += blank ? 0 : 1;
+                blank = true;
+            } else if (c != ' ' && c != '\t' && c != '\r') {
+                blank = false;
+            }
+        }
+        return count;
+    }
+
+    void write_runs(std::istream& f) {
+        fast_matrix_market::read_options options;
+        options.generalize_symmetry = false;
+        options.num_threads = num_threads;
+
+        int64_t line_num = header.header_line_count;
+        std::string block;
+        while (read_block(f, block)) {
+            // The block header describes just the entries in this block.
+            auto lines_in_block = (int64_t)std::count(block.begin(), block.end(), '\n');
+            fast_matrix_market::matrix_market_header block_header = header;
+            block_header.nnz = count_entry_lines(block);
+            block_header.header_line_count = line_num;
+            line_num += lines_in_block;
+
+            std::vector<IT> rows;
+            std::vector<IT> cols;
+            std::vector<VT> vals;
+            {
+                string_streambuf buf(block);
+                std::istream iss(&buf);
+                read_body_triplet(iss, block_header, rows, cols, vals, options);
+            }
+
+            radix_sort_triplets(key, rows, cols, vals, num_threads);
+
+            std::filesystem::path run_path = out_path;
+            run_path += ".run" + std::to_string(runs.size()) + ".tmp";
+            std::ofstream run_stream(run_path, std::ios_base::binary);
+            if (!run_stream) {
+                throw std::runtime_error("Could not create " + run_path.string());
+            }
+            // recorded before writing, so a partly written file is removed too
+            runs.push_back({run_path, (int64_t)rows.size()});
+            for (std::size_t i = 0; i < rows.size(); ++i) {
+                write_binary_value(run_stream, rows[i]);
+                write_binary_value(run_stream, cols[i]);
+                if (!vals.empty()) {
+                    write_binary_value(run_stream, vals[i]);
+                }
+            }
+            run_stream.close();
+            if (!run_stream) {
+                throw std::runtime_error("Could not write " + run_path.string());
+            }
+        }
+        std::cout << "Wrote " << runs.size() << " sorted runs of up to " << entries_per_run << " entries" << std::endl;
+    }
+
+    void merge_runs() {
+        const bool has_vals = header.field != fast_matrix_market::pattern;
+
+        // Half the budget for run read buffers, half for the output block.
+        int64_t entry_bytes = 2 * sizeof(IT) + sizeof(VT);
+        int64_t buffer_entries = memory_limit / 2 / entry_bytes / std::max((int64_t)runs.size(), (int64_t)1);
+        int64_t out_block_entries = std::max(memory_limit / 2 / entry_bytes, (int64_t)1);
+
+        std::vector<run_reader<IT, VT>> readers;
+        readers.reserve(runs.size());
+        int64_t total_entries = 0;
+        for (const auto& r : runs) {
+            readers.emplace_back(r.path, r.num_entries, has_vals, buffer_entries);
+            total_entries += r.num_entries;
+        }
+
+        // min-heap of run indices by the run's current head
+        auto greater = [&](std::size_t a, std::size_t b) {
+            return key.less(readers[b].row(), readers[b].col(), readers[a].row(), readers[a].col());
+        };
+        std::priority_queue<std::size_t, std::vector<std::size_t>, decltype(greater)> heap(greater);
+        for (std::size_t i = 0; i < readers.size(); ++i) {
+            if (!readers[i].empty()) {
+                heap.push(i);
+            }
+        }
+
+        fast_matrix_market::write_options options;
+        options.num_threads = num_threads;
+
+        fast_matrix_market::matrix_market_header out_header = header;
+        out_header.nnz = total_entries;
+        std::ofstream out(out_path);
+        fast_matrix_market::write_header(out, out_header, options);
+
+        std::vector<IT> rows, cols;
+        std::vector<VT> vals;
+        rows.reserve(out_block_entries);
+        cols.reserve(out_block_entries);
+        vals.reserve(has_vals ? out_block_entries : 0);
+
+        while (!heap.empty()) {
+            while (!heap.empty() && (int64_t)rows.size() < out_block_entries) {
+                std::size_t i = heap.top();
+                heap.pop();
+                rows.push_back(readers[i].row());
+                cols.push_back(readers[i].col());
+                if (has_vals) {
+                    vals.push_back(std::move(readers[i].val()));
+                }
+                readers[i].pop();
+                if (!readers[i].empty()) {
+                    heap.push(i);
+                }
+            }
+
+            fast_matrix_market::line_formatter<IT, VT> lf(out_header, options);
+            auto formatter = fast_matrix_market::triplet_formatter(lf,
+                                                                   rows.begin(), rows.end(),
+                                                                   cols.begin(), cols.end(),
+                                                                   vals.begin(), vals.end());
+            fast_matrix_market::write_body(out, formatter, options);
+
+            rows.clear();
+            cols.clear();
+            vals.clear();
+        }
+    }
+
+    KEY key;
+    std::filesystem::path in_path;
+    std::filesystem::path out_path;
+    int64_t memory_limit;
+    int num_threads;
+
+    fast_matrix_market::matrix_market_header header;
+    int64_t entries_per_run = 0;
+    int64_t block_bytes = 0;
+    std::vector<run> runs;
+};
@@ -2,47 +2,338 @@
 // Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
 // SPDX-License-Identifier: BSD-2-Clause
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
-#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
 #include <fast_matrix_market/app/generator.hpp>
 
 constexpr int64_t index_max = 10000000;
 constexpr int64_t index_min = index_max / 10;
 
-void generate_tuple([[maybe_unused]] int64_t coo_index, int64_t &row, int64_t &col, double& value) {
-    static thread_local std::mt19937 generator{std::random_device{}()};
-    std::uniform_int_distribution<int64_t> index_distribution(index_min,index_max - 1);
-    std::uniform_real_distribution<double> distribution(0,1);
+/**
+ * R-MAT matrices are 2^rmat_scale square.
+ */
+constexpr int rmat_scale = 24;
 
-    row = index_distribution(generator);
-    col = index_distribution(generator);
-    value = distribution(generator);
+/**
+ * Half-width of the band of banded matrices.
+ */
+constexpr int64_t band_half_width = 64;
+
+/**
+ * Block size of block-diagonal matrices.
+ */
+constexpr int64_t diagonal_block_size = 1000;
+
+/**
+ * Counter-based random number stream (SplitMix64).
+ *
+ * The stream for an entry depends only on the seed and the entry's index, so the output is byte-identical
+ * regardless of how many threads generate it or how the entries are chunked.
+ */
+class entry_random {
+public:
+    entry_random(uint64_t seed, int64_t coo_index) : state(mix(seed ^ mix((uint64_t)coo_index))) {}
+
+    uint64_t next() {
+        state += 0x9E3779B97F4A7C15ull;
+        return mix(state);
+    }
+
+    /**
+     * Uniform integer in [lo, hi).
+     */
+    int64_t uniform_int(int64_t lo, int64_t hi) {
+        return lo + (int64_t)(next() % (uint64_t)(hi - lo));
+    }
+
+    /**
+     * Uniform real in [0, 1).
+     */
+    double uniform_real() {
+        return (double)(next() >> 11) * 0x1.0p-53;
+    }
+
+protected:
+    static uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t state;
+};
+
+enum class structure {uniform, rmat, banded, block_diagonal, symmetric};
+
+structure parse_structure(const std::string& str) {
+    if (str == "uniform") return structure::uniform;
+    if (str == "rmat") return structure::rmat;
+    if (str == "banded") return structure::banded;
+    if (str == "block-diagonal") return structure::block_diagonal;
+    if (str == "symmetric") return structure::symmetric;
+    throw std::invalid_argument("Unknown structure: " + str);
 }
 
+/**
+ * Generates the i-th tuple of a matrix with the given structure.
+ */
+struct tuple_generator {
+    structure type;
+    uint64_t seed;
+
+    /**
+     * If true then tuples are generated in row-major order.
+     */
+    bool sorted = false;
+    int64_t nnz = 0;
+
+    [[nodiscard]] int64_t dim() const {
+        return type == structure::rmat ? (int64_t)1 << rmat_scale : index_max;
+    }
+
+    /**
+     * Range of rows that may have entries.
+     */
+    [[nodiscard]] std::pair<int64_t, int64_t> row_range() const {
+        switch (type) {
+            case structure::uniform:
+            case structure::symmetric:
+                return {index_min, index_max};
+            case structure::banded:
+            case structure::block_diagonal:
+                return {0, index_max};
+            default:
+                throw std::invalid_argument("Sorted generation is not supported for this structure.");
+        }
+    }
+
+    /**
+     * Range of columns that may have entries in `row`.
+     */
+    [[nodiscard]] std::pair<int64_t, int64_t> col_range(int64_t row) const {
+        switch (type) {
+            case structure::uniform:
+                return {index_min, index_max};
+            case structure::symmetric:
+                return {index_min, row + 1};
+            case structure::banded:
+                return {std::max(row - band_half_width, (int64_t)0), std::min(row + band_half_width + 1, index_max)};
+            case structure::block_diagonal: {
+                int64_t block_start = row - row % diagonal_block_size;
+                return {block_start, std::min(block_start + diagonal_block_size, index_max)};
+            }
+            default:
+                throw std::invalid_argument("Sorted generation is not supported for this structure.");
+        }
+    }
+
+    /**
+     * Number of cells, i.e. possible entries, in the first `row_offset` rows of the row range.
+     */
+    [[nodiscard]] int64_t cells_before(int64_t row_offset) const {
+        switch (type) {
+            case structure::uniform:
+                return row_offset * (index_max - index_min);
+            case structure::symmetric:
+                // the row at offset r has r + 1 columns
+                return row_offset * (row_offset + 1) / 2;
+            case structure::banded: {
+                // 2h + 1 columns per row, less the part of the band that falls off either edge
+                auto clipped = [](int64_t m) { return m > 0 ? m * (m - 1) / 2 : 0; };
+                return row_offset * (band_half_width + 1) + row_offset * (row_offset - 1) / 2
+                       - clipped(row_offset - band_half_width)
+                       - clipped(row_offset - (index_max - band_half_width - 1));
+            }
+            case structure::block_diagonal: {
+                int64_t full_rows = index_max - index_max % diagonal_block_size;
+                return std::min(row_offset, full_rows) * diagonal_block_size +
+                       std::max(row_offset - full_rows, (int64_t)0) * (index_max % diagonal_block_size);
+            }
+            default:
+                throw std::invalid_argument("Sorted generation is not supported for this structure.");
+        }
+    }
+
+    /**
+     * Throw if sorted generation cannot produce `nnz` distinct entries of this structure.
+     */
+    void check_sorted() const {
+        auto [row_lo, row_hi] = row_range();
+        int64_t num_cells = cells_before(row_hi - row_lo);
+        if (nnz > num_cells) {
+            throw std::invalid_argument("A sorted matrix with this structure has room for only " +
+                                        std::to_string(num_cells) + " entries, not " + std::to_string(nnz) +
+                                        ". Use a smaller size.");
+        }
+    }
+
+    /**
+     * Generate the i-th tuple in row-major order, without any state.
+     *
+     * The cells of the structure are numbered in row-major order and split into nnz equal strata. Entry i picks
+     * a random cell in stratum i, so entries are distinct, in order, and spread evenly over the cells.
+     * Requires nnz to be at most the number of cells; see check_sorted().
+     */
+    void generate_sorted(int64_t coo_index, int64_t &row, int64_t &col, double& value) const {
+        entry_random rng{seed, coo_index};
+
+        auto [row_lo, row_hi] = row_range();
+        int64_t num_cells = cells_before(row_hi - row_lo);
+        auto first_cell_of_entry = [&](int64_t i) {
+            return (int64_t)((unsigned __int128)i * (uint64_t)num_cells / (uint64_t)nnz);
+        };
+
+        int64_t stratum_lo = first_cell_of_entry(coo_index);
+        int64_t stratum_hi = first_cell_of_entry(coo_index + 1);
+        int64_t cell = stratum_lo + rng.uniform_int(0, stratum_hi - stratum_lo);
+
+        // find the row that holds the cell
+        int64_t lo = 0, hi = row_hi - row_lo;
+        while (hi - lo > 1) {
+            int64_t mid = lo + (hi - lo) / 2;
+            if (cells_before(mid) <= cell) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        row = row_lo + lo;
+        col = col_range(row).first + (cell - cells_before(lo));
+
+        value = rng.uniform_real();
+    }
+
+    void operator()(int64_t coo_index, int64_t &row, int64_t &col, double& value) const {
+        if (sorted) {
+            generate_sorted(coo_index, row, col, value);
+            return;
+        }
+
+        entry_random rng{seed, coo_index};
+
+        switch (type) {
+            case structure::uniform:
+                row = rng.uniform_int(index_min, index_max);
+                col = rng.uniform_int(index_min, index_max);
+                break;
+            case structure::rmat: {
+                // Recursively pick a quadrant with the Graph500 probabilities.
+                constexpr double a = 0.57, b = 0.19, c = 0.19;
+                row = 0;
+                col = 0;
+                for (int level = 0; level < rmat_scale; ++level) {
+                    double p = rng.uniform_real();
+                    row = (row << 1) | (p >= a + b ? 1 : 0);
+                    col = (col << 1) | ((p >= a && p < a + b) || p >= a + b + c ? 1 : 0);
+                }
+                break;
+            }
+            case structure::banded:
+                row = rng.uniform_int(0, index_max);
+                col = std::clamp(row + rng.uniform_int(-band_half_width, band_half_width + 1), (int64_t)0, index_max - 1);
+                break;
+            case structure::block_diagonal: {
+                row = rng.uniform_int(0, index_max);
+                int64_t block_start = row - row % diagonal_block_size;
+                col = rng.uniform_int(block_start, std::min(block_start + diagonal_block_size, index_max));
+                break;
+            }
+            case structure::symmetric:
+                // lower triangle only, the header marks the matrix symmetric
+                row = rng.uniform_int(index_min, index_max);
+                col = rng.uniform_int(index_min, index_max);
+                if (col > row) {
+                    std::swap(row, col);
+                }
+                break;
+        }
+
+        value = rng.uniform_real();
+    }
+};
+
 
 int main(int argc, char **argv) {
-    if (argc < 2) {
+    uint64_t seed = 0;
+    std::string structure_name = "uniform";
+    int num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    bool sorted = false;
+    std::string megabytes_arg;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg{argv[i]};
+        if (arg.rfind("--seed=", 0) == 0) {
+            seed = std::stoull(arg.substr(std::string("--seed=").size()));
+        } else if (arg.rfind("--structure=", 0) == 0) {
+            structure_name = arg.substr(std::string("--structure=").size());
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            num_threads = std::max(1, std::stoi(arg.substr(std::string("--threads=").size())));
+        } else if (arg == "--sorted") {
+            sorted = true;
+        } else {
+            megabytes_arg = arg;
+        }
+    }
+
+    if (megabytes_arg.empty()) {
         std::cout << "Generate a random coordinate .mtx of the given target file size." << std::endl;
         std::cout << std::endl;
         std::cout << "Usage:" << std::endl;
-        std::cout << argv[0] << " <matrix_market_file_size_in_megabytes>" << std::endl;
+        std::cout << argv[0] << " [--seed=<n>] [--structure=<structure>] [--threads=<n>] [--sorted] <matrix_market_file_size_in_megabytes>" << std::endl;
         std::cout << std::endl;
         std::cout << "will create a file named '<filesize>MiB.mtx' in the current working directory with the specified file size." << std::endl;
+        std::cout << "Structures other than uniform are named '<filesize>MiB-<structure>.mtx'." << std::endl;
+        std::cout << "Sorted files are named '<filesize>MiB[-<structure>].sorted.mtx'." << std::endl;
+        std::cout << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << "  --seed=<n>               random seed. The output depends only on the seed, not the thread count. Default: 0" << std::endl;
+        std::cout << "  --structure=<structure>  uniform (default): uniformly random coordinates" << std::endl;
+        std::cout << "                           rmat: R-MAT (Kronecker) power-law graph" << std::endl;
+        std::cout << "                           banded: entries within " << band_half_width << " of the diagonal" << std::endl;
+        std::cout << "                           block-diagonal: " << diagonal_block_size << "x" << diagonal_block_size << " diagonal blocks" << std::endl;
+        std::cout << "                           symmetric: uniformly random lower triangle of a symmetric matrix" << std::endl;
+        std::cout << "  --threads=<n>            number of threads to generate with. Default: all cores." << std::endl;
+        std::cout << "  --sorted                 generate coordinates already sorted by row then column, in constant memory." << std::endl;
+        std::cout << "                           Not supported for rmat." << std::endl;
         return 0;
     }
 
-    int64_t megabytes = std::strtoll(argv[1], nullptr, 10);
+    int64_t megabytes = std::strtoll(megabytes_arg.c_str(), nullptr, 10);
     int64_t bytes = megabytes << 20;
 
     // approximately 25 characters per nnz
     int64_t nnz = bytes / 25;
+
+    tuple_generator generator{parse_structure(structure_name), seed, sorted, nnz};
+    if (sorted) {
+        // validate the structure and size before creating the file
+        generator.check_sorted();
+    }
     fast_matrix_market::write_options options;
     options.precision = 6;
+    options.num_threads = num_threads;
+
+    fast_matrix_market::matrix_market_header header{generator.dim(), generator.dim()};
+    if (generator.type == structure::symmetric) {
+        header.symmetry = fast_matrix_market::symmetric;
+    }
+
+    std::string filename = std::to_string(megabytes) + "MiB";
+    if (generator.type != structure::uniform) {
+        filename += "-" + structure_name;
+    }
+    if (sorted) {
+        filename += ".sorted";
+    }
 
-    std::ofstream f{std::to_string(megabytes) + "MiB.mtx", std::ios_base::binary};
+    std::ofstream f{filename + ".mtx", std::ios_base::binary};
     fast_matrix_market::write_matrix_market_generated_triplet<int64_t, double>(
-        f, {index_max, index_max}, nnz, generate_tuple, options);
+        f, header, nnz, generator, options);
 
     return 0;
 }
@@ -3,22 +3,83 @@
 // SPDX-License-Identifier: BSD-2-Clause
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <new>
 #include <numeric>
 #include <mutex>
 #include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__APPLE__)
+#include <sys/mount.h>
+#include <sys/sysctl.h>
+#endif
+
+#if __has_include("dependency_versions.hpp")
+#include "dependency_versions.hpp"
+#endif
+
+#include <fast_matrix_market/fast_matrix_market.hpp>
+
 #include "common.hpp"
+#include "phase_timer.hpp"
 
 namespace fs = std::filesystem;
 
-void load_problems(const fs::path& dir, std::vector<problem>& ret) {
+/**
+ * Whether `path` is a compressed Matrix Market file, e.g. `.mtx.gz`.
+ */
+bool is_compressed_mtx(const fs::path& path) {
+    auto ext = path.extension();
+    return (ext == ".gz" || ext == ".zst" || ext == ".lz4") && path.stem().extension() == ".mtx";
+}
+
+void load_problems(const fs::path& dir, std::vector<problem>& ret, bool compressed) {
     for (const auto & entry : fs::directory_iterator(dir)) {
-        if (entry.path().extension() != ".mtx") {
+        if (compressed ? !is_compressed_mtx(entry.path()) : entry.path().extension() != ".mtx") {
             continue;
         }
 
         problem p;
         p.name = entry.path().filename();
         p.mm_path = entry.path();
+
+        try {
+            if (compressed) {
+                if (read_compressed_header != nullptr) {
+                    read_compressed_header(p);
+                }
+            } else {
+                std::ifstream f(p.mm_path);
+                fast_matrix_market::matrix_market_header header;
+                fast_matrix_market::read_header(f, header);
+                p.nrows = header.nrows;
+                p.ncols = header.ncols;
+                p.nnz = header.nnz;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Skipping " << p.mm_path << ", could not read header: " << e.what() << std::endl;
+            continue;
+        }
+
         ret.push_back(p);
     }
 
@@ -27,29 +88,128 @@ void load_problems(const fs::path& dir, std::vector<problem>& ret) {
     });
 }
 
-void create_problems(std::vector<problem>& ret) {
-    load_problems(std::filesystem::current_path(), ret);
+void create_problems(std::vector<problem>& ret, bool compressed) {
+    load_problems(std::filesystem::current_path(), ret, compressed);
 
     for (std::size_t i = 0; i < ret.size(); ++i) {
-        std::cout << "Problem " << i << ": " << ret[i].name << std::endl;
+        std::cout << (compressed ? "Compressed problem " : "Problem ") << i << ": " << ret[i].name << std::endl;
     }
 }
 
-std::vector<problem> problems;
-std::once_flag problems_initialized_flag;
+/**
+ * The problems, loaded on first use. Benchmarks load them while registering, which happens during the static
+ * initialization of the benchmark translation units, so these are function-local statics rather than globals
+ * that might not be constructed yet when bench_all links several benchmark files.
+ */
+std::vector<problem>& get_problems(bool compressed) {
+    if (compressed) {
+        static std::vector<problem> compressed_problems = [] {
+            std::vector<problem> ret;
+            create_problems(ret, true);
+            return ret;
+        }();
+        return compressed_problems;
+    }
+    static std::vector<problem> problems = [] {
+        std::vector<problem> ret;
+        create_problems(ret, false);
+        return ret;
+    }();
+    return problems;
+}
 std::filesystem::path temporary_write_dir = std::filesystem::current_path();
+compressed_header_reader read_compressed_header = nullptr;
+
+/**
+ * Parse all of `str` as an integer greater than zero.
+ */
+static bool parse_thread_count(const std::string& str, int64_t& value) {
+    const char* end = str.data() + str.size();
+    auto [ptr, ec] = std::from_chars(str.data(), end, value);
+    return ec == std::errc() && ptr == end && value > 0;
+}
+
+/**
+ * Thread counts to benchmark, from the BENCHMARK_THREADS environment variable:
+ *  - unset: all cores
+ *  - "sweep": 1, 2, 4, ... up to all cores
+ *  - a comma-separated list, e.g. "1,2,8"
+ *
+ * This runs while the benchmarks are registered, before main(), so an invalid list is reported and all cores are
+ * used instead of throwing.
+ */
+std::vector<int64_t> get_thread_counts() {
+    auto max_threads = std::max((int64_t)std::thread::hardware_concurrency(), (int64_t)1);
+    const char* env = std::getenv("BENCHMARK_THREADS");
+    if (env == nullptr || std::string(env).empty()) {
+        return {max_threads};
+    }
+
+    std::vector<int64_t> ret;
+    if (std::string(env) == "sweep") {
+        for (int64_t p = 1; p < max_threads; p *= 2) {
+            ret.push_back(p);
+        }
+        ret.push_back(max_threads);
+        return ret;
+    }
+
+    std::istringstream iss{env};
+    std::string p;
+    while (std::getline(iss, p, ',')) {
+        int64_t count;
+        if (!parse_thread_count(p, count)) {
+            std::cerr << "BENCHMARK_THREADS must be \"sweep\" or a comma-separated list of positive integers, not \""
+                      << env << "\". Using " << max_threads << " threads." << std::endl;
+            return {max_threads};
+        }
+        ret.push_back(count);
+    }
+    if (ret.empty()) {
+        return {max_threads};
+    }
+
+    // Ascending, so the p=1 run is reported first. See efficiency_reporter.
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+}
+
+/**
+ * get_thread_counts(), read once so an invalid list is only reported once.
+ */
+const std::vector<int64_t>& thread_counts() {
+    static const std::vector<int64_t> counts = get_thread_counts();
+    return counts;
+}
 
 void BenchmarkArgument(benchmark::internal::Benchmark* b) {
-    std::call_once(problems_initialized_flag, []{ create_problems(problems); });
+    auto& problems = get_problems(false);
     b->ArgNames({"problem", "p"});
 
     std::vector<int64_t> problem_args(problems.size());
     std::iota(problem_args.begin(), problem_args.end(), 0);
 
-    std::vector<int64_t> p_args {
-//        1,
-        std::thread::hardware_concurrency()
-    };
+    const std::vector<int64_t>& p_args = thread_counts();
+
+    b->ArgsProduct({problem_args, p_args});
+
+    // report times in seconds
+    b->Unit(benchmark::kSecond);
+}
+
+void CompressedBenchmarkArgument(benchmark::internal::Benchmark* b) {
+    auto& compressed_problems = get_problems(true);
+    b->ArgNames({"problem", "p"});
+
+    // Google Benchmark runs a benchmark without arguments once, so mark an empty problem list with -1.
+    std::vector<int64_t> problem_args(compressed_problems.size());
+    std::iota(problem_args.begin(), problem_args.end(), 0);
+    if (problem_args.empty()) {
+        problem_args.push_back(-1);
+    }
+
+    const std::vector<int64_t>& p_args = thread_counts();
 
     b->ArgsProduct({problem_args, p_args});
 
@@ -58,8 +218,926 @@ void BenchmarkArgument(benchmark::internal::Benchmark* b) {
 }
 
 problem& get_problem(int i) {
-    return problems[i];
+    return get_problems(false)[i];
+}
+
+problem* get_compressed_problem(int i) {
+    return i < 0 ? nullptr : &get_problems(true)[i];
+}
+
+std::shared_ptr<const triplet_matrix<INDEX_TYPE, VALUE_TYPE>> get_reference_triplet(const problem& prob) {
+    static std::mutex mutex;
+    static std::map<fs::path, std::shared_ptr<const triplet_matrix<INDEX_TYPE, VALUE_TYPE>>> shared;
+    static const bool share = std::getenv("BENCHMARK_SHARE_REFERENCE") != nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = shared.find(prob.mm_path);
+    if (found != shared.end()) {
+        return found->second;
+    }
+
+    auto triplet = std::make_shared<triplet_matrix<INDEX_TYPE, VALUE_TYPE>>();
+    std::ifstream f(prob.mm_path);
+    fast_matrix_market::read_matrix_market_triplet(f, triplet->nrows, triplet->ncols,
+                                                   triplet->rows, triplet->cols, triplet->vals);
+    if (share) {
+        shared[prob.mm_path] = triplet;
+    }
+    return triplet;
+}
+
+/**
+ * Drop a file's pages from the OS page cache.
+ */
+bool evict_from_page_cache(const std::filesystem::path& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok;
+#if defined(POSIX_FADV_DONTNEED)
+    ok = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+#else
+    // No fadvise (macOS). Invalidating a mapping of the file drops its cached pages.
+    ok = false;
+    struct stat st{};
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            ok = msync(addr, st.st_size, MS_INVALIDATE) == 0;
+            munmap(addr, st.st_size);
+        }
+    }
+#endif
+    close(fd);
+    return ok;
+}
+
+/**
+ * Read a whole file so its pages are in the OS page cache.
+ */
+bool load_into_page_cache(const std::filesystem::path& path) {
+    std::ifstream f(path, std::ios_base::binary);
+    std::vector<char> buffer(1u << 20);
+    while (f.read(buffer.data(), (std::streamsize)buffer.size()) || f.gcount() > 0) {
+    }
+    return f.eof();
+}
+
+bool prepare_page_cache(benchmark::State& state, const std::filesystem::path& path, cache_mode mode) {
+    state.PauseTiming();
+    bool ok = (mode == cache_mode::cold) ? evict_from_page_cache(path) : load_into_page_cache(path);
+    state.ResumeTiming();
+
+    if (!ok) {
+        state.SkipWithError(mode == cache_mode::cold ? "could not evict input file from page cache" :
+                                                       "could not read input file into page cache");
+    }
+    return ok;
+}
+
+/*
+ * Allocation counting. Global operator new, including the over-aligned forms, is replaced so every C++ allocation is
+ * counted. C libraries are counted only if they are configured to use the counting_* malloc functions.
+ */
+
+std::atomic<int64_t> allocated_bytes{0};
+std::atomic<int64_t> allocation_count{0};
+
+void count_allocation(std::size_t size) {
+    allocated_bytes.fetch_add((int64_t)size, std::memory_order_relaxed);
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void* counting_malloc(std::size_t size) {
+    count_allocation(size);
+    return std::malloc(size);
+}
+
+void* counting_calloc(std::size_t num, std::size_t size) {
+    count_allocation(num * size);
+    return std::calloc(num, size);
+}
+
+void* counting_realloc(void* ptr, std::size_t size) {
+    count_allocation(size);
+    return std::realloc(ptr, size);
+}
+
+void counting_free(void* ptr) {
+    std::free(ptr);
+}
+
+void* operator new(std::size_t size) {
+    count_allocation(size);
+    void* ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, [[maybe_unused]] std::size_t size) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, [[maybe_unused]] std::size_t size) noexcept {
+    std::free(ptr);
+}
+
+/*
+ * Over-aligned allocations, e.g. of types with alignas() wider than the default new alignment.
+ */
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    count_allocation(size);
+    // aligned_alloc requires the size to be a multiple of the alignment
+    auto align = (std::size_t)alignment;
+    void* ptr = std::aligned_alloc(align, (std::max(size, (std::size_t)1) + align - 1) / align * align);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+void operator delete(void* ptr, [[maybe_unused]] std::align_val_t alignment) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, [[maybe_unused]] std::align_val_t alignment) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, [[maybe_unused]] std::size_t size, [[maybe_unused]] std::align_val_t alignment) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, [[maybe_unused]] std::size_t size, [[maybe_unused]] std::align_val_t alignment) noexcept {
+    std::free(ptr);
+}
+
+/**
+ * Read a `<field>:   <n> kB` line of /proc/self/status, in bytes. Returns -1 if not available.
+ */
+int64_t read_proc_status_bytes(const std::string& field) {
+    std::ifstream f("/proc/self/status");
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.rfind(field + ":", 0) == 0) {
+            return std::stoll(line.substr(field.size() + 1)) * 1024;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Peak resident set size of the process, in bytes.
+ */
+int64_t peak_rss() {
+    int64_t hwm = read_proc_status_bytes("VmHWM");
+    if (hwm >= 0) {
+        return hwm;
+    }
+
+    struct rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss;
+#else
+    return (int64_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+/**
+ * Reset the peak resident set size to the current resident set size, and return it.
+ *
+ * Only Linux supports the reset. Elsewhere this returns the unchanged peak, so only iterations that exceed the
+ * previous peak report a delta.
+ */
+int64_t reset_peak_rss() {
+    {
+        std::ofstream clear_refs("/proc/self/clear_refs");
+        clear_refs << "5";
+    }
+    int64_t rss = read_proc_status_bytes("VmRSS");
+    return rss >= 0 ? rss : peak_rss();
+}
+
+void memory_meter::start() {
+    state.PauseTiming();
+    start_rss = reset_peak_rss();
+    start_alloc_bytes = allocated_bytes.load(std::memory_order_relaxed);
+    start_alloc_count = allocation_count.load(std::memory_order_relaxed);
+    if (perf) {
+        perf->start();
+    }
+    state.ResumeTiming();
+}
+
+void memory_meter::record_structure(std::size_t bytes) {
+    structure_bytes = (int64_t)bytes;
+}
+
+void memory_meter::stop() {
+    state.PauseTiming();
+    if (perf) {
+        perf->stop();
+    }
+    alloc_bytes += allocated_bytes.load(std::memory_order_relaxed) - start_alloc_bytes;
+    alloc_count += allocation_count.load(std::memory_order_relaxed) - start_alloc_count;
+    peak_rss_delta = std::max(peak_rss_delta, peak_rss() - start_rss);
+    ++iterations;
+    state.ResumeTiming();
+}
+
+void memory_meter::report(int64_t nnz, std::size_t bytes) {
+    if (iterations == 0) {
+        return;
+    }
+
+    using benchmark::Counter;
+    state.counters["alloc_bytes"] = Counter((double)alloc_bytes / (double)iterations, Counter::kDefaults, Counter::kIs1024);
+    state.counters["alloc_count"] = Counter((double)alloc_count / (double)iterations);
+    state.counters["peak_rss_delta"] = Counter((double)peak_rss_delta, Counter::kDefaults, Counter::kIs1024);
+    if (structure_bytes > 0) {
+        state.counters["structure_bytes"] = Counter((double)structure_bytes, Counter::kDefaults, Counter::kIs1024);
+    }
+    if (nnz > 0) {
+        // Memory used beyond the structure the iteration built. Can be 0 if the allocator reused freed memory.
+        int64_t overhead = std::max(peak_rss_delta - structure_bytes, (int64_t)0);
+        state.counters["overhead_bytes_per_nnz"] = Counter((double)overhead / (double)nnz);
+    }
+    if (perf) {
+        perf->report(state, iterations, nnz, bytes);
+    }
+}
+
+/*
+ * Hardware performance counters.
+ */
+
+struct perf_event_spec {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+
+    /**
+     * Whether to also export `<name>_per_nnz` and `<name>_per_byte`.
+     */
+    bool ratios;
+};
+
+#if defined(__linux__)
+static const std::array<perf_event_spec, perf_counters::num_events> perf_events = {{
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, true},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, true},
+    {"llc_misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), true},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, true},
+    {"minor_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN, false},
+    {"major_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ, false},
+}};
+
+/**
+ * Open a counter of the calling thread and the threads it creates. Returns -1 on failure.
+ */
+static int open_perf_event(const perf_event_spec& spec) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = spec.type;
+    attr.config = spec.config;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * Read a counter, scaled up for the time the kernel multiplexed it out if there are more events than hardware
+ * counters.
+ */
+static int64_t read_perf_event(int fd) {
+    uint64_t values[3] = {};
+    if (read(fd, values, sizeof(values)) != (ssize_t)sizeof(values) || values[2] == 0) {
+        return 0;
+    }
+    return (int64_t)((double)values[0] * (double)values[1] / (double)values[2]);
+}
+#else
+static const std::array<perf_event_spec, perf_counters::num_events> perf_events = {};
+#endif
+
+bool perf_counters::enabled() {
+    static const bool enabled = std::getenv("BENCHMARK_PERF") != nullptr && *std::getenv("BENCHMARK_PERF") != '\0';
+    return enabled;
+}
+
+perf_counters::perf_counters() {
+    fds.fill(-1);
+#if defined(__linux__)
+    std::string unavailable;
+    int error = 0;
+    for (int i = 0; i < num_events; ++i) {
+        fds[i] = open_perf_event(perf_events[i]);
+        if (fds[i] < 0) {
+            error = errno;
+            unavailable += std::string(unavailable.empty() ? "" : ", ") + perf_events[i].name;
+        }
+    }
+
+    static std::once_flag warned;
+    if (!unavailable.empty()) {
+        std::call_once(warned, [&] {
+            std::cerr << "BENCHMARK_PERF: cannot count " << unavailable << " (" << std::strerror(error)
+                      << "). Check /proc/sys/kernel/perf_event_paranoid; VMs often hide hardware events." << std::endl;
+        });
+    }
+#else
+    static std::once_flag warned;
+    std::call_once(warned, [] { std::cerr << "BENCHMARK_PERF: perf_event_open requires Linux." << std::endl; });
+#endif
+}
+
+perf_counters::~perf_counters() {
+    for (int fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+void perf_counters::start() {
+#if defined(__linux__)
+    for (int i = 0; i < num_events; ++i) {
+        if (fds[i] >= 0) {
+            start_values[i] = read_perf_event(fds[i]);
+        }
+    }
+#endif
+}
+
+void perf_counters::stop() {
+#if defined(__linux__)
+    for (int i = 0; i < num_events; ++i) {
+        if (fds[i] >= 0) {
+            totals[i] += read_perf_event(fds[i]) - start_values[i];
+        }
+    }
+#endif
+}
+
+void perf_counters::report(benchmark::State& state, int64_t iterations, int64_t nnz, std::size_t bytes) const {
+    if (iterations == 0) {
+        return;
+    }
+
+    using benchmark::Counter;
+    for (int i = 0; i < num_events; ++i) {
+        if (fds[i] < 0) {
+            continue;
+        }
+        const std::string name = perf_events[i].name;
+        const double per_iteration = (double)totals[i] / (double)iterations;
+        state.counters[name] = Counter(per_iteration);
+        if (!perf_events[i].ratios) {
+            continue;
+        }
+        if (nnz > 0) {
+            state.counters[name + "_per_nnz"] = Counter(per_iteration / (double)nnz);
+        }
+        if (bytes > 0) {
+            state.counters[name + "_per_byte"] = Counter((double)totals[i] / (double)bytes);
+        }
+    }
+
+    // fds 0 and 1 are cycles and instructions.
+    if (fds[0] >= 0 && fds[1] >= 0 && totals[0] > 0) {
+        state.counters["IPC"] = Counter((double)totals[1] / (double)totals[0]);
+    }
+}
+
+/*
+ * Phase timing and trace events.
+ */
+
+const char* phase_name(phase p) {
+    switch (p) {
+        case phase::io: return "io";
+        case phase::parse: return "parse";
+        case phase::construct: return "construct";
+        case phase::deallocate: return "deallocate";
+    }
+    return "";
+}
+
+struct trace_record {
+    std::string name;
+    std::string category;
+    int64_t begin_ns;
+    int64_t duration_ns;
+    int thread;
+};
+
+std::mutex trace_mutex;
+std::vector<trace_record> trace_records;
+std::map<std::thread::id, int> trace_threads;
+const trace_clock::time_point trace_start = trace_clock::now();
+
+bool tracing_enabled() {
+    static const bool enabled = std::getenv("BENCHMARK_TRACE") != nullptr && *std::getenv("BENCHMARK_TRACE") != '\0';
+    return enabled;
+}
+
+void trace_event(const std::string& name, const std::string& category,
+                 trace_clock::time_point begin, trace_clock::time_point end) {
+    if (!tracing_enabled()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    // Threads are numbered in the order they first record an event.
+    auto thread = trace_threads.emplace(std::this_thread::get_id(), (int)trace_threads.size()).first->second;
+    trace_records.push_back({name, category,
+                             std::chrono::duration_cast<std::chrono::nanoseconds>(begin - trace_start).count(),
+                             std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count(),
+                             thread});
+}
+
+/**
+ * `str` as a JSON string literal.
+ */
+std::string json_string(const std::string& str) {
+    std::string ret = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            ret += '\\';
+            ret += c;
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            ret += escaped;
+        } else {
+            ret += c;
+        }
+    }
+    return ret + "\"";
+}
+
+void write_trace() {
+    if (!tracing_enabled()) {
+        return;
+    }
+    std::string path = std::getenv("BENCHMARK_TRACE");
+    std::ofstream f(path);
+    f << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    bool first = true;
+    for (const auto& [id, thread] : trace_threads) {
+        f << (first ? "" : ",\n") << R"({"ph": "M", "name": "thread_name", "pid": 1, "tid": )" << thread
+          << R"(, "args": {"name": )" << json_string(thread == 0 ? "main" : "thread " + std::to_string(thread)) << "}}";
+        first = false;
+    }
+    for (const auto& r : trace_records) {
+        // Trace event times are in microseconds.
+        char times[96];
+        std::snprintf(times, sizeof(times), R"("ts": %.3f, "dur": %.3f)", (double)r.begin_ns / 1e3, (double)r.duration_ns / 1e3);
+        f << (first ? "" : ",\n") << R"({"ph": "X", "pid": 1, "tid": )" << r.thread << ", " << times
+          << R"(, "name": )" << json_string(r.name) << R"(, "cat": )" << json_string(r.category) << "}";
+        first = false;
+    }
+    f << "\n]}\n";
+    std::cout << "Wrote trace of " << trace_records.size() << " events to " << path << std::endl;
+}
+
+void phase_timer::add(phase p, trace_clock::time_point begin, trace_clock::time_point end) {
+    phase_ns[(int)p].fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count(),
+                               std::memory_order_relaxed);
+    trace_event(phase_name(p), trace_category, begin, end);
+}
+
+void phase_timer::add_parse_chunk(trace_clock::time_point begin, trace_clock::time_point end) {
+    parse_chunk_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count(),
+                             std::memory_order_relaxed);
+    trace_event("parse chunk", trace_category, begin, end);
+}
+
+void phase_timer::report(int num_threads) {
+    using benchmark::Counter;
+    for (int p = 0; p < num_phases; ++p) {
+        auto ns = phase_ns[p].load();
+        if (ns > 0) {
+            state.counters[std::string("time_") + phase_name((phase)p)] = Counter((double)ns / 1e9, Counter::kAvgIterations);
+        }
+    }
+
+    auto parse_ns = phase_ns[(int)phase::parse].load();
+    auto chunk_ns = parse_chunk_ns.load();
+    if (parse_ns > 0 && chunk_ns > 0) {
+        state.counters["parse_utilization"] = Counter((double)chunk_ns / ((double)parse_ns * std::max(num_threads, 1)));
+    }
+}
+
+/**
+ * Whether a run was skipped, e.g. with SkipWithError(). Google Benchmark 1.8 replaced Run::error_occurred with
+ * Run::skipped, and CMake fetches the latest release.
+ */
+template <typename RUN>
+auto was_skipped(const RUN& run, int) -> decltype(static_cast<bool>(run.skipped)) {
+    return static_cast<bool>(run.skipped);
+}
+
+template <typename RUN>
+bool was_skipped(const RUN& run, long) {
+    return run.error_occurred;
+}
+
+/**
+ * Wraps a Google Benchmark reporter to add a `parallel_efficiency` counter to each run.
+ *
+ * Efficiency is t1 / (p * tp), where t1 is the time of the p=1 run of the same benchmark on the same problem.
+ * The p=1 runs come first because get_thread_counts() sorts the thread counts.
+ */
+template <typename BASE_REPORTER>
+class efficiency_reporter : public BASE_REPORTER {
+public:
+    using Run = benchmark::BenchmarkReporter::Run;
+    using BASE_REPORTER::BASE_REPORTER;
+
+    void ReportRuns(const std::vector<Run>& runs) override {
+        std::vector<Run> annotated = runs;
+        for (auto& run : annotated) {
+            add_efficiency(run);
+        }
+        BASE_REPORTER::ReportRuns(annotated);
+    }
+
+protected:
+    void add_efficiency(Run& run) {
+        if (run.run_type != Run::RT_Iteration || was_skipped(run, 0)) {
+            return;
+        }
+        double time = run.GetAdjustedRealTime();
+        if (time <= 0) {
+            return;
+        }
+
+        // Split the thread count out of the benchmark arguments, e.g. "problem:0/p:8".
+        int64_t p = 0;
+        std::string key = run.run_name.function_name;
+        std::istringstream iss{run.run_name.args};
+        std::string arg;
+        while (std::getline(iss, arg, '/')) {
+            if (arg.rfind("p:", 0) == 0) {
+                p = std::stoll(arg.substr(2));
+            } else {
+                key += "/" + arg;
+            }
+        }
+        if (p < 1) {
+            return;
+        }
+
+        if (p == 1) {
+            serial_times[key] = time;
+        }
+
+        auto serial = serial_times.find(key);
+        if (serial != serial_times.end()) {
+            run.counters["parallel_efficiency"] = benchmark::Counter(serial->second / ((double)p * time));
+        }
+    }
+
+    std::map<std::string, double> serial_times;
+};
+
+/**
+ * Wraps a reporter to print, after all benchmarks ran, how much faster each implementation is than the slowest one
+ * on the same operation, format, problem, and thread count.
+ *
+ * The implementation is the `impl:` part of the benchmark name plus any parts that are not the operation, format,
+ * or cache state, such as `index:int32`. Repetitions are averaged.
+ */
+template <typename BASE_REPORTER>
+class speedup_reporter : public BASE_REPORTER {
+public:
+    using Run = benchmark::BenchmarkReporter::Run;
+    using BASE_REPORTER::BASE_REPORTER;
+
+    void ReportRuns(const std::vector<Run>& runs) override {
+        BASE_REPORTER::ReportRuns(runs);
+        for (const auto& run : runs) {
+            add_run(run);
+        }
+    }
+
+    void Finalize() override {
+        BASE_REPORTER::Finalize();
+        print_table(BASE_REPORTER::GetOutputStream());
+    }
+
+protected:
+    struct timing {
+        double total_time = 0;
+        int count = 0;
+    };
+
+    struct comparison {
+        std::string label;
+        std::map<std::string, timing> impls;
+    };
+
+    void add_run(const Run& run) {
+        // runs that stopped with an error may still have partial timings
+        if (run.run_type != Run::RT_Iteration || run.iterations == 0 || was_skipped(run, 0)) {
+            return;
+        }
+        double time = run.GetAdjustedRealTime();
+        if (time <= 0) {
+            return;
+        }
+
+        // e.g. "op:read/impl:FMM/format:MatrixMarket/index:int32/value:float/cache:cold" and "problem:0/p:8"
+        std::string key;
+        std::string impl;
+        std::string impl_details;
+        std::istringstream iss{run.run_name.function_name};
+        std::string part;
+        while (std::getline(iss, part, '/')) {
+            if (part.rfind("impl:", 0) == 0) {
+                impl = part.substr(5);
+            } else if (part.rfind("op:", 0) == 0 || part.rfind("format:", 0) == 0 || part.rfind("cache:", 0) == 0) {
+                key += (key.empty() ? "" : "/") + part;
+            } else {
+                impl_details += (impl_details.empty() ? "" : ",") + part;
+            }
+        }
+        if (impl.empty()) {
+            return;
+        }
+        if (!impl_details.empty()) {
+            impl += "(" + impl_details + ")";
+        }
+        key += "/" + run.run_name.args;
+
+        if (comparisons.find(key) == comparisons.end()) {
+            order.push_back(key);
+        }
+        auto& c = comparisons[key];
+        c.label = run.report_label;
+        auto& t = c.impls[impl];
+        t.total_time += time;
+        t.count += 1;
+    }
+
+    void print_table(std::ostream& out) const {
+        bool header_printed = false;
+        for (const auto& key : order) {
+            const auto& c = comparisons.at(key);
+            if (c.impls.size() < 2) {
+                continue;
+            }
+
+            std::vector<std::pair<double, std::string>> times;
+            for (const auto& [impl, t] : c.impls) {
+                times.emplace_back(t.total_time / t.count, impl);
+            }
+            std::sort(times.begin(), times.end());
+            double slowest = times.back().first;
+
+            if (!header_printed) {
+                out << "\nSpeedup over the slowest implementation (real time):\n";
+                header_printed = true;
+            }
+            out << key << " " << c.label << "\n";
+            for (const auto& [time, impl] : times) {
+                char speedup[32];
+                std::snprintf(speedup, sizeof(speedup), "%10.2fx", slowest / time);
+                out << speedup << "  " << impl << "\n";
+            }
+        }
+        out << std::flush;
+    }
+
+    std::map<std::string, comparison> comparisons;
+    std::vector<std::string> order;
+};
+
+/**
+ * Value of the first `<key> : <value>` line of /proc/cpuinfo that starts with `key`, or empty if there is none.
+ */
+std::string read_cpuinfo(const std::string& key) {
+    std::ifstream f("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(f, line)) {
+        auto colon = line.find(':');
+        if (line.rfind(key, 0) == 0 && colon != std::string::npos) {
+            auto begin = line.find_first_not_of(" \t", colon + 1);
+            return begin == std::string::npos ? "" : line.substr(begin);
+        }
+    }
+    return "";
+}
+
+std::string cpu_model() {
+#if defined(__APPLE__)
+    char brand[256] = {};
+    std::size_t size = sizeof(brand);
+    if (sysctlbyname("machdep.cpu.brand_string", brand, &size, nullptr, 0) == 0) {
+        return brand;
+    }
+    return "";
+#else
+    std::string model = read_cpuinfo("model name");
+    return model.empty() ? read_cpuinfo("Hardware") : model;
+#endif
+}
+
+int64_t physical_memory_bytes() {
+#if defined(__APPLE__)
+    int64_t mem = 0;
+    std::size_t size = sizeof(mem);
+    return sysctlbyname("hw.memsize", &mem, &size, nullptr, 0) == 0 ? mem : -1;
+#else
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    return (pages > 0 && page_size > 0) ? (int64_t)pages * page_size : -1;
+#endif
 }
 
-// Google Benchmark provides main()
-BENCHMARK_MAIN();
+/**
+ * Filesystem type and device that `dir` is on, e.g. "ext4 /dev/nvme0n1p2". Empty if unknown.
+ */
+std::string filesystem_of(const fs::path& dir) {
+    std::string path = fs::weakly_canonical(dir).string();
+#if defined(__APPLE__)
+    struct statfs st{};
+    if (statfs(path.c_str(), &st) != 0) {
+        return "";
+    }
+    return std::string(st.f_fstypename) + " " + st.f_mntfromname;
+#else
+    // The mount with the longest mount point that is a prefix of the path.
+    std::ifstream mounts("/proc/self/mounts");
+    std::string device, mount_point, type, rest;
+    std::string best_mount_point, best;
+    while (mounts >> device >> mount_point >> type && std::getline(mounts, rest)) {
+        bool contains = path.rfind(mount_point, 0) == 0 &&
+                        (mount_point == "/" || path.size() == mount_point.size() || path[mount_point.size()] == '/');
+        if (contains && mount_point.size() >= best_mount_point.size()) {
+            best_mount_point = mount_point;
+            best = type + " " + device;
+        }
+    }
+    return best;
+#endif
+}
+
+/**
+ * Add the machine and the library versions to the `context` of the results.
+ * Google Benchmark already reports the host name, CPU count, caches, and frequency.
+ */
+void add_host_context() {
+    benchmark::AddCustomContext("cpu_model", cpu_model());
+    benchmark::AddCustomContext("physical_memory_bytes", std::to_string(physical_memory_bytes()));
+    benchmark::AddCustomContext("hardware_concurrency", std::to_string(std::thread::hardware_concurrency()));
+    benchmark::AddCustomContext("problem_dir", fs::current_path().string());
+    benchmark::AddCustomContext("problem_filesystem", filesystem_of(fs::current_path()));
+    if (const char* threads = std::getenv("BENCHMARK_THREADS")) {
+        benchmark::AddCustomContext("BENCHMARK_THREADS", threads);
+    }
+#ifdef DEPENDENCY_VERSIONS
+    // "name=sha;name=sha", captured when CMake configured the build.
+    std::istringstream iss{DEPENDENCY_VERSIONS};
+    std::string entry;
+    while (std::getline(iss, entry, ';')) {
+        auto eq = entry.find('=');
+        if (eq != std::string::npos) {
+            benchmark::AddCustomContext("version:" + entry.substr(0, eq), entry.substr(eq + 1));
+        }
+    }
+#endif
+}
+
+/**
+ * Default `--benchmark_out` file: `<results dir>/<executable>-<UTC time>.json`.
+ * The results directory is the BENCHMARK_RESULTS_DIR environment variable, or `results` in the working directory.
+ */
+fs::path default_results_path(const char* argv0) {
+    const char* env = std::getenv("BENCHMARK_RESULTS_DIR");
+    fs::path dir = (env != nullptr && *env != '\0') ? fs::path(env) : fs::current_path() / "results";
+    fs::create_directories(dir);
+
+    std::time_t now = std::time(nullptr);
+    char timestamp[32];
+    std::strftime(timestamp, sizeof(timestamp), "%Y%m%dT%H%M%SZ", std::gmtime(&now));
+    return dir / (fs::path(argv0).filename().string() + "-" + timestamp + ".json");
+}
+
+/**
+ * Value of a Google Benchmark `--flag=value` argument, or of its environment variable equivalent.
+ */
+std::string get_flag(int argc, char** argv, const std::string& flag) {
+    std::string prefix = "--" + flag + "=";
+    for (int i = 1; i < argc; ++i) {
+        std::string arg{argv[i]};
+        if (arg.rfind(prefix, 0) == 0) {
+            return arg.substr(prefix.size());
+        }
+        if (arg == "--" + flag) {
+            // boolean flag without a value
+            return "true";
+        }
+    }
+
+    std::string env_name = flag;
+    std::transform(env_name.begin(), env_name.end(), env_name.begin(), ::toupper);
+    const char* env = std::getenv(env_name.c_str());
+    return env ? env : "";
+}
+
+/**
+ * Whether a boolean flag value is true, with Google Benchmark's rules: anything but empty, 0, f, n, false, no, or off.
+ */
+bool is_truthy_flag(std::string value) {
+    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+    return !(value.empty() || value == "0" || value == "f" || value == "n" ||
+             value == "false" || value == "no" || value == "off");
+}
+
+/**
+ * Console reporter options from `--benchmark_color` and `--benchmark_counters_tabular`, as Google Benchmark sets them
+ * for its own console reporter.
+ */
+benchmark::ConsoleReporter::OutputOptions console_output_options(int argc, char** argv) {
+    std::string color = get_flag(argc, argv, "benchmark_color");
+    bool use_color = (color.empty() || color == "auto") ? isatty(STDOUT_FILENO) != 0 : is_truthy_flag(color);
+
+    int options = benchmark::ConsoleReporter::OO_None;
+    if (use_color) {
+        options |= benchmark::ConsoleReporter::OO_Color;
+    }
+    if (is_truthy_flag(get_flag(argc, argv, "benchmark_counters_tabular"))) {
+        options |= benchmark::ConsoleReporter::OO_Tabular;
+    }
+    return (benchmark::ConsoleReporter::OutputOptions)options;
+}
+
+int main(int argc, char** argv) {
+    // Only the default console and JSON formats are wrapped. Other formats use Google Benchmark's reporters.
+    std::string display_format = get_flag(argc, argv, "benchmark_format");
+    std::string out = get_flag(argc, argv, "benchmark_out");
+    std::string out_format = get_flag(argc, argv, "benchmark_out_format");
+
+    // Always keep a JSON copy of the results, for compare_results.py.
+    std::vector<char*> args(argv, argv + argc);
+    std::string default_out;
+    if (out.empty() && (out_format.empty() || out_format == "json")) {
+        out = default_results_path(argv[0]).string();
+        default_out = "--benchmark_out=" + out;
+        args.push_back(default_out.data());
+        std::cout << "Writing results to " << out << std::endl;
+    }
+    args.push_back(nullptr);
+    int num_args = argc + (default_out.empty() ? 0 : 1);
+
+    add_host_context();
+    benchmark::Initialize(&num_args, args.data());
+    if (benchmark::ReportUnrecognizedArguments(num_args, args.data())) {
+        return 1;
+    }
+
+    speedup_reporter<efficiency_reporter<benchmark::ConsoleReporter>> console_reporter{console_output_options(argc, argv)};
+    efficiency_reporter<benchmark::JSONReporter> json_reporter;
+
+    benchmark::BenchmarkReporter* display_reporter = nullptr;
+    if (display_format.empty() || display_format == "console") {
+        display_reporter = &console_reporter;
+    }
+    benchmark::BenchmarkReporter* file_reporter = nullptr;
+    if (!out.empty() && (out_format.empty() || out_format == "json")) {
+        file_reporter = &json_reporter;
+    }
+
+    benchmark::RunSpecifiedBenchmarks(display_reporter, file_reporter);
+    write_trace();
+    benchmark::Shutdown();
+    return 0;
+}
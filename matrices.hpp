@@ -0,0 +1,77 @@
+// Copyright (C) 2023 Adam Lugowski. All rights reserved.
+// Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Simple in-memory matrix structures that benchmarks read into and write from.
+ */
+
+/**
+ * Value type of pattern matrices. Matrices of this type keep `vals` empty.
+ */
+struct pattern_value {};
+
+template <typename VT>
+constexpr bool is_pattern_v = std::is_same_v<VT, pattern_value>;
+
+template <typename IT, typename VT>
+struct triplet_matrix {
+    int64_t nrows = 0, ncols = 0;
+    std::vector<IT> rows;
+    std::vector<IT> cols;
+    std::vector<VT> vals;
+
+    [[nodiscard]] size_t size_bytes() const {
+        return sizeof(IT)*rows.size() + sizeof(IT)*cols.size() + sizeof(VT)*vals.size();
+    }
+};
+
+/**
+ * Copy a triplet matrix into one with other index and value types. A pattern destination gets no values.
+ */
+template <typename IT, typename VT, typename SRC_IT, typename SRC_VT>
+void convert_triplet(const triplet_matrix<SRC_IT, SRC_VT>& src, triplet_matrix<IT, VT>& dst) {
+    dst.nrows = src.nrows;
+    dst.ncols = src.ncols;
+    dst.rows.assign(src.rows.begin(), src.rows.end());
+    dst.cols.assign(src.cols.begin(), src.cols.end());
+    if constexpr (is_pattern_v<VT>) {
+        dst.vals.clear();
+    } else {
+        dst.vals.assign(src.vals.begin(), src.vals.end());
+    }
+}
+
+template <typename IT, typename VT>
+struct csc_matrix {
+    int64_t nrows = 0, ncols = 0;
+    std::vector<IT> indptr;
+    std::vector<IT> indices;
+    std::vector<VT> vals;
+
+    [[nodiscard]] size_t size_bytes() const {
+        return sizeof(IT)*indptr.size() + sizeof(IT)*indices.size() + sizeof(VT)*vals.size();
+    }
+};
+
+/**
+ * CSR has the same arrays as CSC, with rows as the compressed dimension.
+ */
+template <typename IT, typename VT>
+using csr_matrix = csc_matrix<IT, VT>;
+
+template <typename VT>
+struct array_matrix {
+    int64_t nrows = 0, ncols = 0;
+    std::vector<VT> vals;
+
+    [[nodiscard]] size_t size_bytes() const {
+        return sizeof(VT)*vals.size();
+    }
+};
@@ -0,0 +1,186 @@
+// Copyright (C) 2023 Adam Lugowski. All rights reserved.
+// Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Parallel Matrix Market writer for raw coordinate arrays, such as the ones inside a pigo::COO.
+ *
+ * The arrays are read in place. Threads format chunks of entries with std::to_chars, which prints the shortest
+ * representation that reads back to the same double. Each thread then takes the next file offset in chunk order and
+ * writes its chunk with pwrite, so formatting and writing both run on every thread and output stays in order.
+ */
+
+/**
+ * Matrix Market header of a general coordinate matrix. `field` is `real`, `integer`, or `pattern`.
+ */
+inline std::string matrix_market_coordinate_header(int64_t nrows, int64_t ncols, int64_t nnz, const std::string& field) {
+    return "%%MatrixMarket matrix coordinate " + field + " general\n" +
+           std::to_string(nrows) + " " + std::to_string(ncols) + " " + std::to_string(nnz) + "\n";
+}
+
+/**
+ * Matrix Market field of value type VT.
+ */
+template <typename VT>
+std::string matrix_market_field() {
+    return std::is_integral_v<VT> ? "integer" : "real";
+}
+
+/**
+ * Append `value` to `out`. Floating-point values use the shortest round-trip form.
+ */
+template <typename T>
+char* format_value(char* out, char* end, T value) {
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    return std::to_chars(out, end, value).ptr;
+#else
+    if constexpr (std::is_floating_point_v<T>) {
+        // This standard library cannot print floating point with to_chars. 17 digits round-trip a double.
+        int n = std::snprintf(out, end - out, "%.17g", (double)value);
+        return out + n;
+    } else {
+        return std::to_chars(out, end, value).ptr;
+    }
+#endif
+}
+
+/**
+ * Longest line an entry can format to: two 64-bit integers, a double, separators and newline.
+ */
+constexpr std::size_t max_matrix_market_line = 20 + 1 + 20 + 1 + 32 + 1;
+
+/**
+ * Write coordinate arrays as a Matrix Market file.
+ *
+ * `index_offset` is added to every index, e.g. 1 for 0-based arrays. If `vals` is null the file is written as a
+ * pattern matrix. Returns the size of the file.
+ */
+template <typename IT, typename VT>
+std::size_t write_matrix_market_arrays(const std::filesystem::path& path, int64_t nrows, int64_t ncols, int64_t nnz,
+                                       const IT* rows, const IT* cols, const VT* vals, IT index_offset,
+                                       int num_threads) {
+    static constexpr int64_t chunk_entries = 1u << 16;
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Could not create " + path.string() + ": " + std::strerror(errno));
+    }
+
+    auto write_all = [fd](const char* buf, std::size_t length, std::size_t offset) {
+        while (length > 0) {
+            ssize_t n = pwrite(fd, buf, length, (off_t)offset);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string("Could not write: ") + std::strerror(errno));
+            }
+            buf += n;
+            length -= n;
+            offset += n;
+        }
+    };
+
+    const std::string header = matrix_market_coordinate_header(nrows, ncols, nnz,
+                                                               vals == nullptr ? "pattern" : matrix_market_field<VT>());
+    const int64_t num_chunks = (nnz + chunk_entries - 1) / chunk_entries;
+
+    // Chunks take file offsets in order. `turn` is the next chunk to take one.
+    std::mutex mutex;
+    std::condition_variable cv;
+    int64_t turn = 0;
+    std::size_t file_offset = header.size();
+    std::exception_ptr error;
+    std::atomic<int64_t> next_chunk{0};
+
+    auto worker = [&]() {
+        std::vector<char> buffer(chunk_entries * max_matrix_market_line);
+        try {
+            for (int64_t chunk = next_chunk++; chunk < num_chunks; chunk = next_chunk++) {
+                int64_t begin = chunk * chunk_entries;
+                int64_t end = std::min(begin + chunk_entries, nnz);
+
+                char* out = buffer.data();
+                char* out_end = buffer.data() + buffer.size();
+                for (int64_t i = begin; i < end; ++i) {
+                    out = format_value(out, out_end, rows[i] + index_offset);
+                    *out++ = ' ';
+                    out = format_value(out, out_end, cols[i] + index_offset);
+                    if (vals != nullptr) {
+                        *out++ = ' ';
+                        out = format_value(out, out_end, vals[i]);
+                    }
+                    *out++ = '\n';
+                }
+                std::size_t length = out - buffer.data();
+
+                std::size_t offset;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&] { return error || turn == chunk; });
+                    if (error) {
+                        return;
+                    }
+                    offset = file_offset;
+                    file_offset += length;
+                    ++turn;
+                }
+                cv.notify_all();
+
+                write_all(buffer.data(), length, offset);
+            }
+        } catch (...) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+            cv.notify_all();
+        }
+    };
+
+    try {
+        write_all(header.data(), header.size(), 0);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < std::min((int64_t)num_threads, num_chunks); ++t) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    close(fd);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return file_offset;
+}
@@ -0,0 +1,346 @@
+// Copyright (C) 2023 Adam Lugowski. All rights reserved.
+// Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "binary_format.hpp"
+#include "matrices.hpp"
+
+/*
+ * Index-compressed CSR in the native binary container (layout binary_layout::packed_csr).
+ *
+ * The three arrays of the container are:
+ *  - row lengths (the deltas of indptr), packed
+ *  - column deltas, packed. Each column is stored as the difference from the previous column in the same row.
+ *    The first entry of a row, and the first entry of a page, are stored as-is.
+ *  - vals[nnz], unchanged
+ *
+ * A packed stream is split into blocks of 128 values. Each block is stored as one byte holding the bit width of its
+ * largest value, followed by all 128 values bit-packed at that width into 64-bit words (binary packing, the
+ * exception-free base of PFor). Pages of 16 blocks are independent, and the stream starts with a directory of page
+ * offsets, so pages are encoded and decoded in parallel.
+ *
+ * Stream layout: uint64 num_pages, uint64 page_offsets[num_pages + 1] relative to the end of the directory, pages.
+ *
+ * Column deltas are only non-negative if the columns of each row are sorted, so the writer requires sorted rows.
+ */
+
+constexpr std::size_t packed_block_values = 128;
+constexpr std::size_t packed_page_blocks = 16;
+constexpr std::size_t packed_page_values = packed_block_values * packed_page_blocks;
+
+inline int packed_bit_width(uint64_t value) {
+    return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+inline std::size_t packed_block_bytes(int width) {
+    return 1 + packed_block_values / 64 * width * sizeof(uint64_t);
+}
+
+/**
+ * Pack `count` <= 128 values into `out`. Returns the number of bytes written.
+ */
+inline std::size_t pack_block(const uint64_t* values, std::size_t count, unsigned char* out) {
+    uint64_t max_value = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        max_value |= values[i];
+    }
+    const int width = packed_bit_width(max_value);
+    out[0] = (unsigned char)width;
+
+    uint64_t words[2 * 64] = {};
+    for (std::size_t i = 0; i < count; ++i) {
+        std::size_t bit = i * width;
+        std::size_t shift = bit % 64;
+        words[bit / 64] |= values[i] << shift;
+        if (shift + width > 64) {
+            words[bit / 64 + 1] |= values[i] >> (64 - shift);
+        }
+    }
+    std::memcpy(out + 1, words, packed_block_bytes(width) - 1);
+    return packed_block_bytes(width);
+}
+
+/**
+ * Unpack a block of at most `available` bytes into `count` <= 128 values. Returns the number of bytes read.
+ */
+inline std::size_t unpack_block(const unsigned char* in, std::size_t available, std::size_t count, uint64_t* values) {
+    if (available < 1) {
+        throw std::invalid_argument("Corrupt packed block: page ends before the block");
+    }
+    const int width = in[0];
+    if (width > 64) {
+        throw std::invalid_argument("Corrupt packed block: bit width " + std::to_string(width));
+    }
+    if (packed_block_bytes(width) > available) {
+        throw std::invalid_argument("Corrupt packed block: page ends inside the block");
+    }
+    const uint64_t mask = (width == 64) ? ~(uint64_t)0 : (((uint64_t)1 << width) - 1);
+
+    uint64_t words[2 * 64 + 1] = {};
+    std::memcpy(words, in + 1, packed_block_bytes(width) - 1);
+    for (std::size_t i = 0; i < count; ++i) {
+        std::size_t bit = i * width;
+        std::size_t shift = bit % 64;
+        uint64_t value = words[bit / 64] >> shift;
+        if (shift + width > 64) {
+            value |= words[bit / 64 + 1] << (64 - shift);
+        }
+        values[i] = value & mask;
+    }
+    return packed_block_bytes(width);
+}
+
+/**
+ * Call `func(page, values)` for every page on `num_threads` threads. The first exception thrown by `func` stops the
+ * remaining pages and is rethrown.
+ */
+template <typename FUNC>
+void run_on_pages(std::size_t num_pages, int num_threads, FUNC func) {
+    std::atomic<std::size_t> next_page{0};
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto worker = [&]() {
+        try {
+            std::vector<uint64_t> values(packed_page_values);
+            for (std::size_t p = next_page++; p < num_pages; p = next_page++) {
+                func(p, values.data());
+            }
+        } catch (...) {
+            next_page = num_pages;
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < std::min(num_threads, (int)num_pages); ++t) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+inline std::size_t packed_num_pages(std::size_t n) {
+    return (n + packed_page_values - 1) / packed_page_values;
+}
+
+inline std::size_t packed_page_count(std::size_t n, std::size_t page) {
+    return std::min(packed_page_values, n - page * packed_page_values);
+}
+
+/**
+ * Encode `n` values into a packed stream.
+ *
+ * `page_values(page, values)` fills the values of one page. It is called twice per page: once to size the page and
+ * once to pack it.
+ */
+template <typename FUNC>
+std::vector<char> pack_stream(std::size_t n, int num_threads, FUNC page_values) {
+    const std::size_t num_pages = packed_num_pages(n);
+    const std::size_t directory_bytes = (num_pages + 2) * sizeof(uint64_t);
+
+    // pass 1: size of every page
+    std::vector<uint64_t> offsets(num_pages + 1, 0);
+    run_on_pages(num_pages, num_threads, [&](std::size_t p, uint64_t* values) {
+        std::size_t count = packed_page_count(n, p);
+        page_values(p, values);
+        uint64_t bytes = 0;
+        for (std::size_t b = 0; b < count; b += packed_block_values) {
+            uint64_t max_value = 0;
+            for (std::size_t i = b; i < std::min(b + packed_block_values, count); ++i) {
+                max_value |= values[i];
+            }
+            bytes += packed_block_bytes(packed_bit_width(max_value));
+        }
+        offsets[p + 1] = bytes;
+    });
+    for (std::size_t p = 0; p < num_pages; ++p) {
+        offsets[p + 1] += offsets[p];
+    }
+
+    // pass 2: pack every page at its offset
+    std::vector<char> stream(directory_bytes + offsets[num_pages]);
+    uint64_t header_pages = num_pages;
+    std::memcpy(stream.data(), &header_pages, sizeof(uint64_t));
+    std::memcpy(stream.data() + sizeof(uint64_t), offsets.data(), offsets.size() * sizeof(uint64_t));
+
+    auto* data = reinterpret_cast<unsigned char*>(stream.data() + directory_bytes);
+    run_on_pages(num_pages, num_threads, [&](std::size_t p, uint64_t* values) {
+        std::size_t count = packed_page_count(n, p);
+        page_values(p, values);
+        unsigned char* out = data + offsets[p];
+        for (std::size_t b = 0; b < count; b += packed_block_values) {
+            out += pack_block(values + b, std::min(packed_block_values, count - b), out);
+        }
+    });
+    return stream;
+}
+
+/**
+ * Decode a packed stream of `n` values. `page_values(page, values, count)` receives the values of each page.
+ */
+template <typename FUNC>
+void unpack_stream(const char* stream, std::size_t stream_bytes, std::size_t n, int num_threads, FUNC page_values) {
+    const std::size_t num_pages = packed_num_pages(n);
+    const std::size_t directory_bytes = (num_pages + 2) * sizeof(uint64_t);
+    uint64_t header_pages = 0;
+    if (stream_bytes >= sizeof(uint64_t)) {
+        std::memcpy(&header_pages, stream, sizeof(uint64_t));
+    }
+    if (header_pages != num_pages || stream_bytes < directory_bytes) {
+        throw std::invalid_argument("Corrupt packed stream");
+    }
+    std::vector<uint64_t> offsets(num_pages + 1);
+    std::memcpy(offsets.data(), stream + sizeof(uint64_t), offsets.size() * sizeof(uint64_t));
+    // every page must lie within the stream, after the previous one
+    if (offsets[0] != 0 || offsets[num_pages] > stream_bytes - directory_bytes) {
+        throw std::invalid_argument("Corrupt packed stream: page offsets outside the stream");
+    }
+    for (std::size_t p = 0; p < num_pages; ++p) {
+        if (offsets[p] > offsets[p + 1]) {
+            throw std::invalid_argument("Corrupt packed stream: page offsets out of order");
+        }
+    }
+
+    const auto* data = reinterpret_cast<const unsigned char*>(stream + directory_bytes);
+    run_on_pages(num_pages, num_threads, [&](std::size_t p, uint64_t* values) {
+        std::size_t count = packed_page_count(n, p);
+        const unsigned char* in = data + offsets[p];
+        const unsigned char* page_end = data + offsets[p + 1];
+        for (std::size_t b = 0; b < count; b += packed_block_values) {
+            in += unpack_block(in, page_end - in, std::min(packed_block_values, count - b), values + b);
+        }
+        if (in != page_end) {
+            throw std::invalid_argument("Corrupt packed stream: page size does not match its blocks");
+        }
+        page_values(p, values, count);
+    });
+}
+
+/**
+ * Write a CSR matrix with packed indices. The columns of every row must be sorted.
+ */
+template <typename IT, typename VT>
+void write_binary_packed_csr(const std::filesystem::path& path, const csr_matrix<IT, VT>& mat, int num_threads) {
+    const auto nrows = (std::size_t)mat.nrows;
+    const auto nnz = mat.indices.size();
+
+    auto row_lengths = pack_stream(nrows, num_threads, [&](std::size_t p, uint64_t* values) {
+        std::size_t first = p * packed_page_values;
+        for (std::size_t i = 0; i < packed_page_count(nrows, p); ++i) {
+            values[i] = (uint64_t)(mat.indptr[first + i + 1] - mat.indptr[first + i]);
+        }
+    });
+
+    std::atomic<bool> sorted{true};
+    auto column_deltas = pack_stream(nnz, num_threads, [&](std::size_t p, uint64_t* values) {
+        std::size_t first = p * packed_page_values;
+        std::size_t row = std::upper_bound(mat.indptr.begin(), mat.indptr.end(), (IT)first) - mat.indptr.begin() - 1;
+        for (std::size_t i = 0; i < packed_page_count(nnz, p); ++i) {
+            std::size_t e = first + i;
+            while ((std::size_t)mat.indptr[row + 1] <= e) {
+                ++row;
+            }
+            if (i == 0 || e == (std::size_t)mat.indptr[row]) {
+                values[i] = (uint64_t)mat.indices[e];
+            } else {
+                if (mat.indices[e] < mat.indices[e - 1]) {
+                    sorted = false;
+                }
+                values[i] = (uint64_t)(mat.indices[e] - mat.indices[e - 1]);
+            }
+        }
+    });
+    if (!sorted) {
+        throw std::invalid_argument("Packed CSR requires sorted column indices in every row.");
+    }
+
+    auto header = make_binary_header<IT, VT>(binary_layout::packed_csr, binary_sort_order::row_major,
+                                             mat.nrows, mat.ncols, (int64_t)nnz, 0, !mat.vals.empty());
+    header.array_bytes[0] = row_lengths.size();
+    header.array_bytes[1] = column_deltas.size();
+    place_binary_arrays(header);
+    binary_file_io::write(path, header, {row_lengths.data(), column_deltas.data(), mat.vals.data()}, num_threads);
+}
+
+/**
+ * Read a CSR matrix with packed indices. The arrays are read with parallel pread, then decoded in parallel.
+ */
+template <typename IT, typename VT>
+void read_binary_packed_csr(const std::filesystem::path& path, csr_matrix<IT, VT>& mat, int num_threads) {
+    binary_header header = read_binary_header(path);
+    check_binary_types<IT, VT>(header, binary_layout::packed_csr);
+    const auto nrows = (std::size_t)header.nrows;
+    const auto nnz = (std::size_t)header.nnz;
+
+    std::vector<char> row_lengths(header.array_bytes[0]);
+    std::vector<char> column_deltas(header.array_bytes[1]);
+    mat.nrows = header.nrows;
+    mat.ncols = header.ncols;
+    mat.vals.resize(header.value_bytes > 0 ? nnz : 0);
+    binary_file_io::read(path, header, {row_lengths.data(), column_deltas.data(), mat.vals.data()}, num_threads);
+
+    // indptr: prefix sum within each page, then add the totals of the preceding pages
+    mat.indptr.resize(nrows + 1);
+    mat.indptr[0] = 0;
+    std::vector<uint64_t> page_totals(packed_num_pages(nrows) + 1, 0);
+    unpack_stream(row_lengths.data(), row_lengths.size(), nrows, num_threads,
+                  [&](std::size_t p, const uint64_t* values, std::size_t count) {
+        std::size_t first = p * packed_page_values;
+        uint64_t sum = 0;
+        for (std::size_t i = 0; i < count; ++i) {
+            sum += values[i];
+            mat.indptr[first + i + 1] = (IT)sum;
+        }
+        page_totals[p + 1] = sum;
+    });
+    for (std::size_t p = 1; p < page_totals.size(); ++p) {
+        page_totals[p] += page_totals[p - 1];
+    }
+    run_on_pages(packed_num_pages(nrows), num_threads, [&](std::size_t p, uint64_t*) {
+        std::size_t first = p * packed_page_values;
+        for (std::size_t i = 0; i < packed_page_count(nrows, p); ++i) {
+            mat.indptr[first + i + 1] += (IT)page_totals[p];
+        }
+    });
+    if ((std::size_t)mat.indptr[nrows] != nnz) {
+        throw std::invalid_argument("Packed CSR row lengths do not add up to nnz: " + path.string());
+    }
+
+    mat.indices.resize(nnz);
+    unpack_stream(column_deltas.data(), column_deltas.size(), nnz, num_threads,
+                  [&](std::size_t p, const uint64_t* values, std::size_t count) {
+        std::size_t first = p * packed_page_values;
+        std::size_t row = std::upper_bound(mat.indptr.begin(), mat.indptr.end(), (IT)first) - mat.indptr.begin() - 1;
+        uint64_t column = 0;
+        for (std::size_t i = 0; i < count; ++i) {
+            std::size_t e = first + i;
+            while ((std::size_t)mat.indptr[row + 1] <= e) {
+                ++row;
+            }
+            column = (i == 0 || e == (std::size_t)mat.indptr[row]) ? values[i] : column + values[i];
+            mat.indices[e] = (IT)column;
+        }
+    });
+}
@@ -0,0 +1,229 @@
+// Copyright (C) 2023 Adam Lugowski. All rights reserved.
+// Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fast_matrix_market/fast_matrix_market.hpp>
+
+/**
+ * Parse handler that stores only the coordinates. Used for pattern matrices so no value vector is needed.
+ */
+template <typename IT_ITER>
+class coordinate_parse_handler {
+public:
+    using coordinate_type = typename std::iterator_traits<IT_ITER>::value_type;
+    using value_type = double;
+    static constexpr int flags = fast_matrix_market::kParallelOk;
+
+    explicit coordinate_parse_handler(const IT_ITER& rows, const IT_ITER& cols, int64_t offset = 0)
+        : begin_rows(rows), begin_cols(cols), rows(rows + offset), cols(cols + offset) {}
+
+    void handle(const coordinate_type row, const coordinate_type col, [[maybe_unused]] const value_type value) {
+        *rows++ = row;
+        *cols++ = col;
+    }
+
+    coordinate_parse_handler<IT_ITER> get_chunk_handler(int64_t offset_from_begin) {
+        return coordinate_parse_handler(begin_rows, begin_cols, offset_from_begin);
+    }
+
+protected:
+    IT_ITER begin_rows;
+    IT_ITER begin_cols;
+    IT_ITER rows;
+    IT_ITER cols;
+};
+
+/**
+ * Wraps a parse handler to time how long each chunk takes to parse.
+ *
+ * A chunk is timed from its first entry until the last copy of its chunk handler is destroyed, and `on_chunk(begin, end)`
+ * is called from the thread that parsed it. The wrapped handler's own chunk handlers are not timed.
+ */
+template <typename HANDLER>
+class timed_parse_handler {
+public:
+    using coordinate_type = typename HANDLER::coordinate_type;
+    using value_type = typename HANDLER::value_type;
+    using clock = std::chrono::steady_clock;
+    using callback_type = std::function<void(clock::time_point, clock::time_point)>;
+    static constexpr int flags = HANDLER::flags;
+
+    timed_parse_handler(const HANDLER& handler, callback_type on_chunk)
+        : handler(handler), on_chunk(std::move(on_chunk)) {}
+
+    template <typename... ARGS>
+    void handle(ARGS&&... args) {
+        if (span && !span->started) {
+            span->start();
+        }
+        handler.handle(std::forward<ARGS>(args)...);
+    }
+
+    timed_parse_handler get_chunk_handler(int64_t offset_from_begin) {
+        timed_parse_handler chunk(handler.get_chunk_handler(offset_from_begin), on_chunk);
+        chunk.span = std::make_shared<chunk_span>(on_chunk);
+        return chunk;
+    }
+
+protected:
+    struct chunk_span {
+        explicit chunk_span(callback_type on_chunk) : on_chunk(std::move(on_chunk)) {}
+
+        ~chunk_span() {
+            if (started) {
+                on_chunk(begin, clock::now());
+            }
+        }
+
+        void start() {
+            begin = clock::now();
+            started = true;
+        }
+
+        callback_type on_chunk;
+        clock::time_point begin;
+        bool started = false;
+    };
+
+    HANDLER handler;
+    callback_type on_chunk;
+    std::shared_ptr<chunk_span> span;
+};
+
+/**
+ * Read a Matrix Market body into triplet vectors sized to `header.nnz`.
+ *
+ * Pattern matrices leave `vals` empty.
+ */
+template <typename IT, typename VT>
+void read_body_triplet(std::istream& instream, const fast_matrix_market::matrix_market_header& header,
+                       std::vector<IT>& rows, std::vector<IT>& cols, std::vector<VT>& vals,
+                       const fast_matrix_market::read_options& options) {
+    rows.resize(header.nnz);
+    cols.resize(header.nnz);
+
+    if (header.field == fast_matrix_market::pattern) {
+        vals.clear();
+        auto handler = coordinate_parse_handler(rows.begin(), cols.begin());
+        fast_matrix_market::read_matrix_market_body(instream, header, handler, 1, options);
+    } else {
+        vals.resize(header.nnz);
+        auto handler = fast_matrix_market::triplet_parse_handler(rows.begin(), cols.begin(), vals.begin());
+        fast_matrix_market::read_matrix_market_body(instream, header, handler, VT{}, options);
+    }
+}
+
+/**
+ * A batch of coordinates and values handed to a streaming consumer.
+ */
+template <typename IT, typename VT>
+struct coordinate_batch {
+    std::vector<IT> rows;
+    std::vector<IT> cols;
+    std::vector<VT> vals;
+
+    [[nodiscard]] std::size_t size() const {
+        return rows.size();
+    }
+
+    void clear() {
+        rows.clear();
+        cols.clear();
+        vals.clear();
+    }
+};
+
+/**
+ * Parse handler that streams the matrix to a callback in batches of `batch_size` entries instead of storing it.
+ *
+ * Every parsing thread fills its own batch and calls the callback from that thread when the batch is full, so the
+ * callback must be thread safe. Memory use is bounded by one batch per thread. Call flush() after the read returns
+ * to hand over the partially filled batches.
+ */
+template <typename IT, typename VT>
+class batching_parse_handler {
+public:
+    using coordinate_type = IT;
+    using value_type = VT;
+    using batch_type = coordinate_batch<IT, VT>;
+    using callback_type = std::function<void(const batch_type&)>;
+    static constexpr int flags = fast_matrix_market::kParallelOk;
+
+    batching_parse_handler(std::size_t batch_size, callback_type callback)
+        : shared(std::make_shared<shared_state>(batch_size, std::move(callback))) {}
+
+    void handle(const coordinate_type row, const coordinate_type col, const value_type value) {
+        if (batch == nullptr) {
+            batch = shared->thread_batch();
+        }
+        batch->rows.push_back(row);
+        batch->cols.push_back(col);
+        batch->vals.push_back(value);
+        if (batch->size() >= shared->batch_size) {
+            shared->callback(*batch);
+            batch->clear();
+        }
+    }
+
+    batching_parse_handler get_chunk_handler([[maybe_unused]] int64_t offset_from_begin) {
+        return batching_parse_handler(shared);
+    }
+
+    /**
+     * Hand every partially filled batch to the callback.
+     */
+    void flush() {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        for (auto& [id, thread_batch] : shared->batches) {
+            if (thread_batch->size() > 0) {
+                shared->callback(*thread_batch);
+                thread_batch->clear();
+            }
+        }
+    }
+
+protected:
+    struct shared_state {
+        shared_state(std::size_t batch_size, callback_type callback)
+            : batch_size(batch_size), callback(std::move(callback)) {}
+
+        /**
+         * The calling thread's batch.
+         */
+        batch_type* thread_batch() {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto& thread_batch = batches[std::this_thread::get_id()];
+            if (!thread_batch) {
+                thread_batch = std::make_unique<batch_type>();
+                thread_batch->rows.reserve(batch_size);
+                thread_batch->cols.reserve(batch_size);
+                thread_batch->vals.reserve(batch_size);
+            }
+            return thread_batch.get();
+        }
+
+        const std::size_t batch_size;
+        const callback_type callback;
+        std::mutex mutex;
+        std::map<std::thread::id, std::unique_ptr<batch_type>> batches;
+    };
+
+    explicit batching_parse_handler(std::shared_ptr<shared_state> shared) : shared(std::move(shared)) {}
+
+    std::shared_ptr<shared_state> shared;
+
+    /**
+     * This chunk's batch, looked up on the first entry because chunks are parsed on worker threads.
+     */
+    batch_type* batch = nullptr;
+};
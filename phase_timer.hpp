@@ -0,0 +1,175 @@
+// Copyright (C) 2023 Adam Lugowski. All rights reserved.
+// Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <istream>
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+/*
+ * Per-phase timing of read benchmarks, reported as counters and optionally as a Chrome trace.
+ *
+ * Set the BENCHMARK_TRACE environment variable to a file name to write a trace-event JSON timeline of every timed
+ * phase and every parsed chunk, one row per thread. Open it in chrome://tracing or https://ui.perfetto.dev.
+ */
+
+using trace_clock = std::chrono::steady_clock;
+
+enum class phase {
+    /**
+     * Opening and reading the file. fast_matrix_market parses while it reads, so this overlaps `parse`.
+     */
+    io,
+
+    /**
+     * Tokenizing and parsing the file into triplets, including the I/O it waits on.
+     */
+    parse,
+
+    /**
+     * Building the library's data structure from the triplets.
+     */
+    construct,
+
+    /**
+     * Freeing the data structure.
+     */
+    deallocate,
+};
+
+constexpr int num_phases = 4;
+
+const char* phase_name(phase p);
+
+/**
+ * Whether BENCHMARK_TRACE is set.
+ */
+bool tracing_enabled();
+
+/**
+ * Add an event to the trace on the calling thread's row, if tracing is enabled.
+ */
+void trace_event(const std::string& name, const std::string& category,
+                 trace_clock::time_point begin, trace_clock::time_point end);
+
+/**
+ * Write the trace to the BENCHMARK_TRACE file. Called once all benchmarks ran.
+ */
+void write_trace();
+
+/**
+ * Accumulates the time each iteration of a benchmark spends in each phase.
+ *
+ * Time a phase with a scope, `auto t = timer.time(phase::construct);`, or pass the timer to code that times
+ * itself, such as timed_ifstream and a parse handler wrapped with timed_parse_handler.
+ * report() exports the per-iteration averages as `time_<phase>` counters, and `parse_utilization`: the fraction
+ * of the parse phase that the `p` threads spent parsing chunks.
+ */
+class phase_timer {
+public:
+    /**
+     * `trace_category` labels this benchmark's events in the trace, e.g. the implementation and problem name.
+     */
+    phase_timer(benchmark::State& state, std::string trace_category)
+        : state(state), trace_category(std::move(trace_category)) {}
+
+    class scope {
+    public:
+        scope(phase_timer& timer, phase p) : timer(timer), p(p), begin(trace_clock::now()) {}
+        scope(const scope&) = delete;
+        ~scope() {
+            timer.add(p, begin, trace_clock::now());
+        }
+
+    protected:
+        phase_timer& timer;
+        phase p;
+        trace_clock::time_point begin;
+    };
+
+    [[nodiscard]] scope time(phase p) {
+        return {*this, p};
+    }
+
+    /**
+     * Add time to a phase. Thread safe.
+     */
+    void add(phase p, trace_clock::time_point begin, trace_clock::time_point end);
+
+    /**
+     * Add the time one thread spent parsing one chunk. Thread safe.
+     */
+    void add_parse_chunk(trace_clock::time_point begin, trace_clock::time_point end);
+
+    void report(int num_threads);
+
+protected:
+    benchmark::State& state;
+    std::string trace_category;
+    std::array<std::atomic<int64_t>, num_phases> phase_ns{};
+    std::atomic<int64_t> parse_chunk_ns{0};
+};
+
+/**
+ * File buffer that adds the time spent opening the file and waiting on reads to a phase_timer's `io` phase.
+ */
+class timed_filebuf : public std::filebuf {
+public:
+    explicit timed_filebuf(phase_timer& timer) : timer(timer) {}
+
+    timed_filebuf* open(const std::filesystem::path& path, std::ios_base::openmode mode) {
+        auto t = timer.time(phase::io);
+        return std::filebuf::open(path, mode) ? this : nullptr;
+    }
+
+protected:
+    int_type underflow() override {
+        return timed_read([&] { return std::filebuf::underflow(); });
+    }
+
+    std::streamsize xsgetn(char_type* s, std::streamsize n) override {
+        return timed_read([&] { return std::filebuf::xsgetn(s, n); });
+    }
+
+    /**
+     * xsgetn() may call underflow(), so only the outermost call is timed.
+     */
+    template <typename FUNC>
+    auto timed_read(FUNC read) -> decltype(read()) {
+        if (reading) {
+            return read();
+        }
+        reading = true;
+        auto t = timer.time(phase::io);
+        auto ret = read();
+        reading = false;
+        return ret;
+    }
+
+    phase_timer& timer;
+    bool reading = false;
+};
+
+/**
+ * An input file stream that times its I/O with a timed_filebuf.
+ */
+class timed_ifstream : public std::istream {
+public:
+    timed_ifstream(const std::filesystem::path& path, phase_timer& timer) : std::istream(nullptr), buf(timer) {
+        rdbuf(&buf);
+        if (!buf.open(path, std::ios_base::in)) {
+            setstate(std::ios_base::failbit);
+        }
+    }
+
+protected:
+    timed_filebuf buf;
+};
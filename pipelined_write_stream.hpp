@@ -0,0 +1,289 @@
+// Copyright (C) 2023 Adam Lugowski. All rights reserved.
+// Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * Write-only stream that hands full buffers to a dedicated writer thread.
+ *
+ * Formatted output is copied into one of up to `num_buffers` buffers from a pool. A full buffer is queued for the writer
+ * thread, which writes every queued buffer with a single pwritev() and returns them to the pool. The caller only
+ * waits when all buffers are queued, so formatting continues while the writer waits on the disk.
+ *
+ * Call close() to finish the file and to see errors. The destructor also closes, but discards errors.
+ */
+class pipelined_write_streambuf : public std::streambuf {
+public:
+    static constexpr std::size_t default_buffer_size = 4u << 20;
+    static constexpr int default_num_buffers = 8;
+
+    explicit pipelined_write_streambuf(const std::filesystem::path& path, int num_buffers = default_num_buffers,
+                                       std::size_t buffer_size = default_buffer_size)
+        : buffer_size(buffer_size), num_buffers(std::max(num_buffers, 2)) {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + path.string() + ": " + std::strerror(errno));
+        }
+        next_buffer();
+        writer = std::thread([this]() { write_buffers(); });
+    }
+
+    pipelined_write_streambuf(const pipelined_write_streambuf&) = delete;
+    pipelined_write_streambuf& operator=(const pipelined_write_streambuf&) = delete;
+
+    ~pipelined_write_streambuf() override {
+        try {
+            close();
+        } catch (...) {
+        }
+    }
+
+    /**
+     * Write the remaining output, wait for the writer, and close the file.
+     */
+    void close() {
+        if (fd < 0) {
+            return;
+        }
+        try {
+            queue_current();
+        } catch (...) {
+            fail(std::current_exception());
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finishing = true;
+        }
+        cv.notify_all();
+        writer.join();
+
+        int ret = ::close(fd);
+        fd = -1;
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        if (ret != 0) {
+            throw std::runtime_error("Error closing file");
+        }
+    }
+
+    /**
+     * Bytes written to the file so far.
+     */
+    [[nodiscard]] std::size_t written_bytes() const {
+        return file_offset;
+    }
+
+    /**
+     * Seconds the writer thread spent in pwritev().
+     */
+    [[nodiscard]] double write_seconds() const {
+        return std::chrono::duration<double>(write_time).count();
+    }
+
+    /**
+     * Seconds the formatting side waited for a free buffer.
+     */
+    [[nodiscard]] double stall_seconds() const {
+        return std::chrono::duration<double>(stall_time).count();
+    }
+
+protected:
+    struct buffer {
+        std::unique_ptr<char[]> data;
+
+        /**
+         * Bytes of `data` filled with output.
+         */
+        std::size_t size = 0;
+    };
+
+    int_type overflow(int_type ch) override {
+        queue_current();
+        next_buffer();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    /**
+     * Flushing does not wait for the disk. Buffers are written when full and on close().
+     */
+    int sync() override {
+        return 0;
+    }
+
+    void queue_current() {
+        if (!current.data) {
+            return;
+        }
+        current.size = pptr() - pbase();
+        setp(nullptr, nullptr);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            queue.push_back(std::move(current));
+        }
+        current = {};
+        cv.notify_all();
+    }
+
+    /**
+     * Take a buffer from the pool, waiting for the writer to return one if all are queued.
+     * Buffers are allocated as needed, so small files do not pay for the whole pool.
+     */
+    void next_buffer() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (pool.empty() && allocated < num_buffers) {
+            ++allocated;
+            lock.unlock();
+            current = {std::unique_ptr<char[]>(new char[buffer_size]), 0};
+            setp(current.data.get(), current.data.get() + buffer_size);
+            return;
+        }
+        if (pool.empty()) {
+            auto begin = std::chrono::steady_clock::now();
+            cv.wait(lock, [&] { return error || !pool.empty(); });
+            stall_time += std::chrono::steady_clock::now() - begin;
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        current = std::move(pool.back());
+        pool.pop_back();
+        lock.unlock();
+
+        current.size = 0;
+        setp(current.data.get(), current.data.get() + buffer_size);
+    }
+
+    void fail(std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = e;
+            }
+        }
+        cv.notify_all();
+    }
+
+    /**
+     * Writer thread: write all queued buffers at once, then recycle them.
+     */
+    void write_buffers() {
+        try {
+            while (true) {
+                std::vector<buffer> batch;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&] { return error || finishing || !queue.empty(); });
+                    if (error || queue.empty()) {
+                        return;
+                    }
+                    std::size_t count = std::min(queue.size(), (std::size_t)IOV_MAX);
+                    std::move(queue.begin(), queue.begin() + (std::ptrdiff_t)count, std::back_inserter(batch));
+                    queue.erase(queue.begin(), queue.begin() + (std::ptrdiff_t)count);
+                }
+
+                auto begin = std::chrono::steady_clock::now();
+                pwritev_all(batch);
+                write_time += std::chrono::steady_clock::now() - begin;
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    for (auto& buf : batch) {
+                        pool.push_back(std::move(buf));
+                    }
+                }
+                cv.notify_all();
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    }
+
+    /**
+     * pwritev the buffers at the end of the file, retrying short writes.
+     */
+    void pwritev_all(std::vector<buffer>& batch) {
+        std::vector<iovec> iov;
+        for (auto& buf : batch) {
+            if (buf.size > 0) {
+                iov.push_back({buf.data.get(), buf.size});
+            }
+        }
+
+        std::size_t first = 0;
+        while (first < iov.size()) {
+            ssize_t ret = pwritev(fd, iov.data() + first, (int)(iov.size() - first), (off_t)file_offset);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string("pwritev failed: ") + std::strerror(errno));
+            }
+            file_offset += (std::size_t)ret;
+
+            // skip what was written
+            auto written = (std::size_t)ret;
+            while (first < iov.size() && written >= iov[first].iov_len) {
+                written -= iov[first].iov_len;
+                ++first;
+            }
+            if (first < iov.size()) {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + written;
+                iov[first].iov_len -= written;
+            }
+        }
+    }
+
+    std::size_t buffer_size;
+    int num_buffers;
+    int fd = -1;
+    buffer current;
+    std::thread writer;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<buffer> pool;
+    int allocated = 0;
+    std::deque<buffer> queue;
+    bool finishing = false;
+    std::exception_ptr error;
+
+    /**
+     * Only touched by the writer thread until it is joined.
+     */
+    std::size_t file_offset = 0;
+    std::chrono::steady_clock::duration write_time{};
+
+    std::chrono::steady_clock::duration stall_time{};
+};
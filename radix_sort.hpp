@@ -0,0 +1,375 @@
+// Copyright (C) 2023 Adam Lugowski. All rights reserved.
+// Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Number of bits needed to represent indices in [0, dim).
+ */
+inline int index_bit_width(int64_t dim) {
+    int bits = 0;
+    for (uint64_t max_index = dim > 0 ? (uint64_t)(dim - 1) : 0; max_index != 0; max_index >>= 1) {
+        ++bits;
+    }
+    return bits;
+}
+
+/**
+ * Extract 8 bits starting at `shift` from the concatenation of `high` and `low`, where `low` is `low_bits` wide.
+ */
+inline unsigned concatenated_digit(uint64_t high, uint64_t low, int low_bits, int shift) {
+    if (shift >= low_bits) {
+        return (unsigned)((high >> (shift - low_bits)) & 0xFFu);
+    }
+    uint64_t d = low >> shift;
+    if (shift + 8 > low_bits) {
+        d |= high << (low_bits - shift);
+    }
+    return (unsigned)(d & 0xFFu);
+}
+
+/**
+ * Row-major sort key: order by row, then by column.
+ *
+ * The key is the concatenation of the row and column bits. Only as many bits as the matrix dimensions need
+ * are sorted on, so a 10M-by-10M matrix takes 6 radix passes instead of 16.
+ */
+template <typename IT>
+struct row_major_key {
+    row_major_key(int64_t nrows, int64_t ncols) : row_bits(index_bit_width(nrows)), col_bits(index_bit_width(ncols)) {}
+
+    [[nodiscard]] int bits() const {
+        return row_bits + col_bits;
+    }
+
+    [[nodiscard]] unsigned digit(IT row, IT col, int shift) const {
+        return concatenated_digit((uint64_t)row, (uint64_t)col, col_bits, shift);
+    }
+
+    [[nodiscard]] bool less(IT row_a, IT col_a, IT row_b, IT col_b) const {
+        if (row_a != row_b)
+            return row_a < row_b;
+        return col_a < col_b;
+    }
+
+    int row_bits;
+    int col_bits;
+};
+
+/**
+ * Column-major sort key: order by column, then by row.
+ */
+template <typename IT>
+struct col_major_key {
+    col_major_key(int64_t nrows, int64_t ncols) : row_bits(index_bit_width(nrows)), col_bits(index_bit_width(ncols)) {}
+
+    [[nodiscard]] int bits() const {
+        return row_bits + col_bits;
+    }
+
+    [[nodiscard]] unsigned digit(IT row, IT col, int shift) const {
+        return concatenated_digit((uint64_t)col, (uint64_t)row, row_bits, shift);
+    }
+
+    [[nodiscard]] bool less(IT row_a, IT col_a, IT row_b, IT col_b) const {
+        if (col_a != col_b)
+            return col_a < col_b;
+        return row_a < row_b;
+    }
+
+    int row_bits;
+    int col_bits;
+};
+
+/**
+ * Spread the low 4 bits of `x` to the even bits of a byte.
+ */
+inline unsigned spread_nibble(uint64_t x) {
+    x &= 0xFu;
+    x = (x | (x << 2)) & 0x33u;
+    x = (x | (x << 1)) & 0x55u;
+    return (unsigned)x;
+}
+
+/**
+ * Morton (Z-order) sort key: the row and column bits are interleaved, with row bits more significant.
+ *
+ * Nearby entries in both dimensions end up nearby in the file, which favors blocked and cache-oblivious consumers.
+ */
+template <typename IT>
+struct morton_key {
+    morton_key(int64_t nrows, int64_t ncols)
+        : dim_bits(std::max(index_bit_width(nrows), index_bit_width(ncols))) {}
+
+    [[nodiscard]] int bits() const {
+        return 2 * dim_bits;
+    }
+
+    /**
+     * `shift` is always even because bits() is even and radix digits are 8 bits wide.
+     */
+    [[nodiscard]] unsigned digit(IT row, IT col, int shift) const {
+        int dim_shift = shift / 2;
+        return (spread_nibble((uint64_t)row >> dim_shift) << 1) | spread_nibble((uint64_t)col >> dim_shift);
+    }
+
+    [[nodiscard]] bool less(IT row_a, IT col_a, IT row_b, IT col_b) const {
+        // The dimension with the most significant differing bit decides. Ties go to the row.
+        uint64_t row_diff = (uint64_t)row_a ^ (uint64_t)row_b;
+        uint64_t col_diff = (uint64_t)col_a ^ (uint64_t)col_b;
+        if (row_diff < col_diff && row_diff < (row_diff ^ col_diff))
+            return col_a < col_b;
+        return row_a < row_b;
+    }
+
+    int dim_bits;
+};
+
+/**
+ * Tiled sort key: the matrix is cut into tile_rows-by-tile_cols tiles. Tiles are in row-major order, and
+ * entries within a tile are in row-major order. This is the order of a blocked CSR (BSR) layout.
+ */
+template <typename IT>
+struct tile_key {
+    tile_key(int64_t nrows, int64_t ncols, int64_t tile_rows, int64_t tile_cols)
+        : tile_rows(tile_rows), tile_cols(tile_cols),
+          tile_col_bits(index_bit_width((ncols + tile_cols - 1) / tile_cols)),
+          in_tile_col_bits(index_bit_width(tile_cols)),
+          tile_bits(index_bit_width((nrows + tile_rows - 1) / tile_rows) + tile_col_bits),
+          in_tile_bits(index_bit_width(tile_rows) + in_tile_col_bits) {}
+
+    [[nodiscard]] int bits() const {
+        return tile_bits + in_tile_bits;
+    }
+
+    [[nodiscard]] unsigned digit(IT row, IT col, int shift) const {
+        uint64_t tile = ((uint64_t)row / tile_rows) << tile_col_bits | ((uint64_t)col / tile_cols);
+        uint64_t in_tile = ((uint64_t)row % tile_rows) << in_tile_col_bits | ((uint64_t)col % tile_cols);
+        return concatenated_digit(tile, in_tile, in_tile_bits, shift);
+    }
+
+    [[nodiscard]] bool less(IT row_a, IT col_a, IT row_b, IT col_b) const {
+        if (row_a / tile_rows != row_b / tile_rows)
+            return row_a < row_b;
+        if (col_a / tile_cols != col_b / tile_cols)
+            return col_a < col_b;
+        if (row_a != row_b)
+            return row_a < row_b;
+        return col_a < col_b;
+    }
+
+    int64_t tile_rows;
+    int64_t tile_cols;
+    int tile_col_bits;
+    int in_tile_col_bits;
+    int tile_bits;
+    int in_tile_bits;
+};
+
+/**
+ * Sorts (row, col, val) triplets in place by a radix key.
+ *
+ * The three arrays are permuted together, so no separate permutation array is needed.
+ * If `vals` is empty (pattern matrix) only rows and cols are sorted.
+ *
+ * The most significant digit is distributed by all threads at once into a scratch copy of the triplets.
+ * The resulting buckets are then sorted in place by the threads with an MSD (American flag) radix sort.
+ */
+template <typename KEY, typename IT, typename VT>
+class triplet_radix_sorter {
+public:
+    triplet_radix_sorter(const KEY& key, std::vector<IT>& rows, std::vector<IT>& cols, std::vector<VT>& vals)
+        : key(key), rows(rows), cols(cols), vals(vals), has_vals(!vals.empty()) {}
+
+    void sort(int num_threads) {
+        const auto n = (int64_t)rows.size();
+        if (key.bits() == 0 || n < 2) {
+            return;
+        }
+        if (num_threads <= 1 || n < parallel_cutoff) {
+            sort_range(0, n, 0);
+            return;
+        }
+
+        std::vector<int64_t> bucket_starts = distribute_top_digit(num_threads);
+
+        if (num_levels() == 1) {
+            return;
+        }
+
+        // Sort the buckets. Threads pick up the next unsorted bucket.
+        std::atomic<std::size_t> next_bucket{0};
+        run_on_threads(num_threads, [&](int) {
+            for (std::size_t b = next_bucket++; b < 256; b = next_bucket++) {
+                sort_range(bucket_starts[b], bucket_starts[b + 1], 1);
+            }
+        });
+    }
+
+protected:
+    static constexpr int64_t parallel_cutoff = 1u << 16;
+    static constexpr int64_t insertion_sort_cutoff = 32;
+
+    [[nodiscard]] int num_levels() const {
+        return (key.bits() + 7) / 8;
+    }
+
+    /**
+     * Bit offset of the digit sorted at `level`. The final digit is clamped to 0 and may overlap the previous
+     * one; the overlapping bits are already equal within a bucket so the order is unaffected.
+     */
+    [[nodiscard]] int level_shift(int level) const {
+        return std::max(key.bits() - 8 * (level + 1), 0);
+    }
+
+    [[nodiscard]] unsigned digit(int64_t i, int shift) const {
+        return key.digit(rows[i], cols[i], shift);
+    }
+
+    void swap_entries(int64_t i, int64_t j) {
+        std::swap(rows[i], rows[j]);
+        std::swap(cols[i], cols[j]);
+        if (has_vals) {
+            std::swap(vals[i], vals[j]);
+        }
+    }
+
+    template <typename FUNC>
+    static void run_on_threads(int num_threads, FUNC func) {
+        std::vector<std::thread> threads;
+        for (int t = 1; t < num_threads; ++t) {
+            threads.emplace_back(func, t);
+        }
+        func(0);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    /**
+     * Parallel out-of-place counting sort on the most significant digit.
+     *
+     * @return the 257 bucket boundaries.
+     */
+    std::vector<int64_t> distribute_top_digit(int num_threads) {
+        const auto n = (int64_t)rows.size();
+        const int shift = level_shift(0);
+        auto slice_begin = [&](int t) { return n * t / num_threads; };
+
+        std::vector<std::array<int64_t, 256>> offsets(num_threads);
+        run_on_threads(num_threads, [&](int t) {
+            auto& counts = offsets[t];
+            counts.fill(0);
+            for (int64_t i = slice_begin(t); i < slice_begin(t + 1); ++i) {
+                ++counts[digit(i, shift)];
+            }
+        });
+
+        // Exclusive prefix sum, digit-major then thread-major, so each thread has its own write cursor per bucket.
+        std::vector<int64_t> bucket_starts(257);
+        int64_t sum = 0;
+        for (int d = 0; d < 256; ++d) {
+            bucket_starts[d] = sum;
+            for (int t = 0; t < num_threads; ++t) {
+                int64_t count = offsets[t][d];
+                offsets[t][d] = sum;
+                sum += count;
+            }
+        }
+        bucket_starts[256] = sum;
+
+        std::vector<IT> scratch_rows(n);
+        std::vector<IT> scratch_cols(n);
+        std::vector<VT> scratch_vals(has_vals ? n : 0);
+        run_on_threads(num_threads, [&](int t) {
+            auto& cursors = offsets[t];
+            for (int64_t i = slice_begin(t); i < slice_begin(t + 1); ++i) {
+                int64_t dest = cursors[digit(i, shift)]++;
+                scratch_rows[dest] = rows[i];
+                scratch_cols[dest] = cols[i];
+                if (has_vals) {
+                    scratch_vals[dest] = std::move(vals[i]);
+                }
+            }
+        });
+
+        rows.swap(scratch_rows);
+        cols.swap(scratch_cols);
+        vals.swap(scratch_vals);
+        return bucket_starts;
+    }
+
+    void insertion_sort(int64_t begin, int64_t end) {
+        for (int64_t i = begin + 1; i < end; ++i) {
+            for (int64_t j = i; j > begin && key.less(rows[j], cols[j], rows[j - 1], cols[j - 1]); --j) {
+                swap_entries(j, j - 1);
+            }
+        }
+    }
+
+    /**
+     * In-place MSD radix sort of [begin, end) starting at `level`.
+     */
+    void sort_range(int64_t begin, int64_t end, int level) {
+        if (end - begin <= insertion_sort_cutoff) {
+            insertion_sort(begin, end);
+            return;
+        }
+
+        const int shift = level_shift(level);
+
+        std::array<int64_t, 257> bucket_starts{};
+        for (int64_t i = begin; i < end; ++i) {
+            ++bucket_starts[digit(i, shift) + 1];
+        }
+        bucket_starts[0] = begin;
+        for (int d = 0; d < 256; ++d) {
+            bucket_starts[d + 1] += bucket_starts[d];
+        }
+
+        // American flag permutation: swap each element directly into the next free slot of its bucket.
+        std::array<int64_t, 256> heads;
+        std::copy(bucket_starts.begin(), bucket_starts.end() - 1, heads.begin());
+        for (int b = 0; b < 256; ++b) {
+            while (heads[b] < bucket_starts[b + 1]) {
+                unsigned d = digit(heads[b], shift);
+                if (d == (unsigned)b) {
+                    ++heads[b];
+                } else {
+                    swap_entries(heads[b], heads[d]++);
+                }
+            }
+        }
+
+        if (level + 1 < num_levels()) {
+            for (int b = 0; b < 256; ++b) {
+                if (bucket_starts[b + 1] - bucket_starts[b] > 1) {
+                    sort_range(bucket_starts[b], bucket_starts[b + 1], level + 1);
+                }
+            }
+        }
+    }
+
+    const KEY& key;
+    std::vector<IT>& rows;
+    std::vector<IT>& cols;
+    std::vector<VT>& vals;
+    const bool has_vals;
+};
+
+/**
+ * Sort triplets by `key` using `num_threads` threads.
+ */
+template <typename KEY, typename IT, typename VT>
+void radix_sort_triplets(const KEY& key, std::vector<IT>& rows, std::vector<IT>& cols, std::vector<VT>& vals, int num_threads) {
+    triplet_radix_sorter<KEY, IT, VT>(key, rows, cols, vals).sort(num_threads);
+}
@@ -0,0 +1,498 @@
+// Copyright (C) 2023 Adam Lugowski. All rights reserved.
+// Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
+// SPDX-License-Identifier: BSD-2-Clause
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+// IORING_OP_READ is an enum, so test for a feature flag from the same kernel release (5.6).
+#if defined(IORING_FEAT_CUR_PERSONALITY)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#include "phase_timer.hpp"
+
+/*
+ * Alternatives to std::ifstream for feeding a file to fast_matrix_market. Each is a std::streambuf, so the parser is
+ * unchanged and only the way bytes reach it differs:
+ *  - mmap_streambuf: the whole file is mapped and handed to the parser as one buffer. Pages are read by page faults.
+ *  - uring_streambuf (Linux): a ring of aligned buffers is kept in flight with io_uring, optionally with O_DIRECT.
+ *    Blocks ahead of the parser are read while it parses earlier ones, at a queue depth above 1, and with O_DIRECT
+ *    the data is not copied through the page cache.
+ */
+
+enum class read_backend {ifstream, mmap, io_uring};
+
+inline const char* read_backend_name(read_backend backend) {
+    switch (backend) {
+        case read_backend::ifstream: return "ifstream";
+        case read_backend::mmap: return "mmap";
+        case read_backend::io_uring: return "io_uring";
+    }
+    return "";
+}
+
+/**
+ * Read-only stream over a memory-mapped file.
+ */
+class mmap_streambuf : public std::streambuf {
+public:
+    explicit mmap_streambuf(const std::filesystem::path& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + path.string());
+        }
+        struct stat st{};
+        fstat(fd, &st);
+        size = (std::size_t)st.st_size;
+        if (size > 0) {
+            void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Could not map " + path.string());
+            }
+            data = static_cast<char*>(addr);
+            madvise(data, size, MADV_SEQUENTIAL);
+            setg(data, data, data + size);
+        }
+        close(fd);
+    }
+
+    mmap_streambuf(const mmap_streambuf&) = delete;
+    mmap_streambuf& operator=(const mmap_streambuf&) = delete;
+
+    ~mmap_streambuf() override {
+        if (data != nullptr) {
+            munmap(data, size);
+        }
+    }
+
+protected:
+    char* data = nullptr;
+    std::size_t size = 0;
+};
+
+#ifdef HAVE_IO_URING
+/**
+ * Minimal io_uring submission and completion queue, set up with the raw system calls.
+ *
+ * The destructor waits for every submitted request to complete, so the buffers they target must outlive the queue.
+ */
+class io_uring_queue {
+public:
+    explicit io_uring_queue(unsigned entries) {
+        io_uring_params params{};
+        ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0) {
+            throw std::runtime_error(std::string("io_uring_setup failed: ") + std::strerror(errno));
+        }
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+
+        sq_ring = map(sq_ring_size, IORING_OFF_SQ_RING);
+        cq_ring = single_mmap ? sq_ring : map(cq_ring_size, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(map(sqes_size, IORING_OFF_SQES));
+
+        auto* sq = static_cast<char*>(sq_ring);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+        auto* cq = static_cast<char*>(cq_ring);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    io_uring_queue(const io_uring_queue&) = delete;
+    io_uring_queue& operator=(const io_uring_queue&) = delete;
+
+    ~io_uring_queue() {
+        try {
+            drain();
+        } catch (...) {
+            // the ring is broken, so there is nothing left to wait for
+        }
+        if (sqes != nullptr) munmap(sqes, sqes_size);
+        if (cq_ring != nullptr && !single_mmap) munmap(cq_ring, cq_ring_size);
+        if (sq_ring != nullptr) munmap(sq_ring, sq_ring_size);
+        close(ring_fd);
+    }
+
+    /**
+     * Queue a read. Queued reads are sent to the kernel by submit().
+     */
+    void prepare_read(int fd, void* buf, unsigned len, uint64_t offset, uint64_t user_data) {
+        unsigned tail = *sq_tail + (unsigned)pending;
+        unsigned index = tail & sq_mask;
+        io_uring_sqe& sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = (uint64_t)(uintptr_t)buf;
+        sqe.len = len;
+        sqe.off = offset;
+        sqe.user_data = user_data;
+        sq_array[index] = index;
+        ++pending;
+    }
+
+    void submit() {
+        if (pending == 0) {
+            return;
+        }
+        __atomic_store_n(sq_tail, *sq_tail + (unsigned)pending, __ATOMIC_RELEASE);
+        unsigned to_submit = (unsigned)pending;
+        pending = 0;
+        while (to_submit > 0) {
+            int ret = enter(to_submit, 0, 0);
+            if (ret < 0) {
+                throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+            }
+            to_submit -= (unsigned)ret;
+            submitted += ret;
+        }
+    }
+
+    /**
+     * Wait for the next completion.
+     */
+    io_uring_cqe wait() {
+        unsigned head = *cq_head;
+        while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0) {
+                throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+            }
+        }
+        io_uring_cqe cqe = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        --submitted;
+        return cqe;
+    }
+
+    /**
+     * Wait for every submitted request to complete and discard the completions.
+     */
+    void drain() {
+        while (submitted > 0) {
+            wait();
+        }
+    }
+
+protected:
+    void* map(std::size_t size, off_t offset) {
+        void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+        if (addr == MAP_FAILED) {
+            throw std::runtime_error("Could not map io_uring rings");
+        }
+        return addr;
+    }
+
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+        int ret;
+        do {
+            ret = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+        } while (ret < 0 && errno == EINTR);
+        return ret;
+    }
+
+    int ring_fd = -1;
+    bool single_mmap = false;
+    void* sq_ring = nullptr;
+    void* cq_ring = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    std::size_t sq_ring_size = 0;
+    std::size_t cq_ring_size = 0;
+    std::size_t sqes_size = 0;
+
+    unsigned* sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    /**
+     * Entries prepared but not yet submitted.
+     */
+    int pending = 0;
+
+    /**
+     * Entries the kernel accepted whose completions have not been reaped.
+     */
+    int submitted = 0;
+};
+
+/**
+ * Read-only stream over a file read with io_uring into a ring of `queue_depth` aligned blocks.
+ *
+ * Block `b` is read into buffer `b % queue_depth`. The reads of the first `queue_depth` blocks are submitted up
+ * front. Once the parser moves past a block, its buffer is resubmitted for the block `queue_depth` further along,
+ * so the device always has reads queued while the parser consumes the ones that completed.
+ *
+ * If `direct` is set the file is opened with O_DIRECT, bypassing the page cache. Filesystems that refuse O_DIRECT,
+ * such as tmpfs, fall back to buffered reads; see is_direct().
+ *
+ * With a `timer`, the time the parser waits for a block is added to its `io` phase.
+ *
+ * Reads that complete short are finished with pread(). Read errors are thrown from underflow(), which std::istream
+ * turns into badbit, and so into an early end of file, unless badbit is in its exceptions().
+ */
+class uring_streambuf : public std::streambuf {
+public:
+    /**
+     * O_DIRECT needs buffers, offsets and lengths aligned to the device's logical block size. 4 KiB covers all
+     * common devices.
+     */
+    static constexpr std::size_t alignment = 4096;
+
+    static constexpr std::size_t default_block_size = 1u << 20;
+    static constexpr int default_queue_depth = 16;
+
+    explicit uring_streambuf(const std::filesystem::path& path, bool direct = true, phase_timer* timer = nullptr,
+                             int queue_depth = default_queue_depth, std::size_t block_size = default_block_size)
+        : path(path), queue_depth(queue_depth), block_size((block_size + alignment - 1) / alignment * alignment),
+          timer(timer), ring((unsigned)queue_depth) {
+        std::unique_ptr<phase_timer::scope> t;
+        if (timer != nullptr) {
+            t = std::make_unique<phase_timer::scope>(*timer, phase::io);
+        }
+
+#ifdef O_DIRECT
+        if (direct) {
+            fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+        }
+#endif
+        direct_io = fd >= 0;
+        if (fd < 0) {
+            fd = open(path.c_str(), O_RDONLY);
+        }
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + path.string());
+        }
+        try {
+            struct stat st{};
+            fstat(fd, &st);
+            file_size = (std::size_t)st.st_size;
+            num_blocks = (file_size + this->block_size - 1) / this->block_size;
+
+            buffers.resize(queue_depth);
+            block_bytes.resize(queue_depth, -1);
+            for (auto& buffer : buffers) {
+                buffer.reset(static_cast<char*>(std::aligned_alloc(alignment, this->block_size)));
+                if (!buffer) {
+                    throw std::bad_alloc();
+                }
+            }
+
+            for (std::size_t block = 0; block < std::min(num_blocks, (std::size_t)queue_depth); ++block) {
+                queue_block(block);
+            }
+            ring.submit();
+        } catch (...) {
+            // The destructor does not run. The ring member still waits for submitted reads before the buffers go.
+            close(fd);
+            throw;
+        }
+    }
+
+    uring_streambuf(const uring_streambuf&) = delete;
+    uring_streambuf& operator=(const uring_streambuf&) = delete;
+
+    ~uring_streambuf() override {
+        // The kernel may still be writing into the buffers. The ring's destructor also waits, which covers a throwing
+        // constructor, but the file should stay open until the reads are done.
+        try {
+            ring.drain();
+        } catch (...) {
+            // the ring is broken, so there is nothing left to wait for
+        }
+        close(fd);
+        if (buffered_fd >= 0) {
+            close(buffered_fd);
+        }
+    }
+
+    /**
+     * Whether the file was opened with O_DIRECT.
+     */
+    [[nodiscard]] bool is_direct() const {
+        return direct_io;
+    }
+
+    [[nodiscard]] int get_queue_depth() const {
+        return queue_depth;
+    }
+
+    [[nodiscard]] std::size_t get_block_size() const {
+        return block_size;
+    }
+
+protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+
+        if (has_current) {
+            // The parser is done with the current block. Reuse its buffer for the next block not yet queued.
+            std::size_t next = current_block + queue_depth;
+            if (next < num_blocks) {
+                queue_block(next);
+                ring.submit();
+            }
+            ++current_block;
+        }
+        has_current = true;
+
+        if (current_block >= num_blocks) {
+            return traits_type::eof();
+        }
+
+        int slot = (int)(current_block % queue_depth);
+        wait_for(slot);
+
+        std::size_t expected = std::min(block_size, file_size - current_block * block_size);
+        if ((std::size_t)block_bytes[slot] < expected) {
+            finish_short_read(slot, expected);
+        }
+        char* begin = buffers[slot].get();
+        setg(begin, begin, begin + expected);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    void queue_block(std::size_t block) {
+        int slot = (int)(block % queue_depth);
+        block_bytes[slot] = -1;
+        ring.prepare_read(fd, buffers[slot].get(), (unsigned)block_size, block * block_size, (uint64_t)slot);
+    }
+
+    /**
+     * Read the rest of a block that io_uring completed short, with pread().
+     *
+     * O_DIRECT reads must start at an aligned offset, so an unaligned remainder is read through a second, buffered
+     * descriptor. A read that returns nothing means the file shrank and is an error.
+     */
+    void finish_short_read(int slot, std::size_t expected) {
+        std::unique_ptr<phase_timer::scope> t;
+        if (timer != nullptr) {
+            t = std::make_unique<phase_timer::scope>(*timer, phase::io);
+        }
+        char* buffer = buffers[slot].get();
+        std::size_t offset = current_block * block_size;
+        auto done = (std::size_t)block_bytes[slot];
+        while (done < expected) {
+            bool aligned = done % alignment == 0;
+            int read_fd = (direct_io && !aligned) ? buffered_descriptor() : fd;
+            // O_DIRECT lengths must be aligned too. The buffer holds a whole block, and reads stop at the end of file.
+            std::size_t length = (direct_io && aligned) ? block_size - done : expected - done;
+            ssize_t n = pread(read_fd, buffer + done, length, (off_t)(offset + done));
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Read failed at offset " + std::to_string(offset + done) + ": " +
+                                         std::strerror(errno));
+            }
+            if (n == 0) {
+                throw std::runtime_error("File ended early at offset " + std::to_string(offset + done));
+            }
+            done += (std::size_t)n;
+        }
+        block_bytes[slot] = (int64_t)expected;
+    }
+
+    /**
+     * Descriptor of the same file without O_DIRECT, opened on first use.
+     */
+    int buffered_descriptor() {
+        if (buffered_fd < 0) {
+            buffered_fd = open(path.c_str(), O_RDONLY);
+            if (buffered_fd < 0) {
+                throw std::runtime_error("Could not open " + path.string());
+            }
+        }
+        return buffered_fd;
+    }
+
+    /**
+     * Reap completions until the read into `slot` is done.
+     */
+    void wait_for(int slot) {
+        if (block_bytes[slot] >= 0) {
+            return;
+        }
+        std::unique_ptr<phase_timer::scope> t;
+        if (timer != nullptr) {
+            t = std::make_unique<phase_timer::scope>(*timer, phase::io);
+        }
+        while (block_bytes[slot] < 0) {
+            io_uring_cqe cqe = ring.wait();
+            if (cqe.res < 0) {
+                throw std::runtime_error(std::string("io_uring read failed: ") + std::strerror(-cqe.res));
+            }
+            block_bytes[cqe.user_data] = cqe.res;
+        }
+    }
+
+    struct free_deleter {
+        void operator()(char* p) const {
+            std::free(p);
+        }
+    };
+
+    std::filesystem::path path;
+    int queue_depth;
+    std::size_t block_size;
+    phase_timer* timer;
+
+    int fd = -1;
+    int buffered_fd = -1;
+    bool direct_io = false;
+    std::size_t file_size = 0;
+    std::size_t num_blocks = 0;
+
+    std::vector<std::unique_ptr<char, free_deleter>> buffers;
+
+    /**
+     * Bytes read into each buffer, or -1 while its read is in flight.
+     */
+    std::vector<int64_t> block_bytes;
+
+    /**
+     * Declared after the buffers, so it is destroyed, and waits for the reads into them, first.
+     */
+    io_uring_queue ring;
+
+    std::size_t current_block = 0;
+    bool has_current = false;
+};
+#endif
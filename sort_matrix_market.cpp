@@ -2,80 +2,234 @@
 // Use of this source code is governed by the BSD 2-clause license found in the LICENSE.txt file.
 // SPDX-License-Identifier: BSD-2-Clause
 
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <complex>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <numeric>
+#include <stdexcept>
+#include <thread>
 #include <fast_matrix_market/fast_matrix_market.hpp>
 
+#include "external_sort.hpp"
+#include "parse_handlers.hpp"
+#include "radix_sort.hpp"
+
 namespace fmm = fast_matrix_market;
 
-template <typename IT, typename VT>
-void sort_file(const std::filesystem::path& in_path, const std::filesystem::path& out_path) {
-    std::vector<IT> original_rows, sorted_rows;
-    std::vector<IT> original_cols, sorted_cols;
-    std::vector<VT> original_vals, sorted_vals;
+/**
+ * Seconds elapsed since `start`.
+ */
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Sort in memory. Pattern matrices have no value vector.
+ */
+template <typename IT, typename VT, typename KEY>
+void sort_file(const KEY& key, const std::filesystem::path& in_path, const std::filesystem::path& out_path, int num_threads) {
+    std::vector<IT> rows;
+    std::vector<IT> cols;
+    std::vector<VT> vals;
 
     fmm::matrix_market_header header;
-    
+
     // Load
     {
+        auto start = std::chrono::steady_clock::now();
         fmm::read_options options;
         options.generalize_symmetry = false;
+        options.num_threads = num_threads;
         std::ifstream f(in_path);
-        fmm::read_matrix_market_triplet(f, header, original_rows, original_cols, original_vals, options);
+        fmm::read_header(f, header);
+        read_body_triplet(f, header, rows, cols, vals, options);
+        std::cout << "Read " << rows.size() << " entries in " << seconds_since(start) << " s" << std::endl;
     }
 
-    // Find sort permutation
-    std::vector<std::size_t> perm(original_rows.size());
-    std::iota(perm.begin(), perm.end(), 0);
-    std::sort(perm.begin(), perm.end(),
-              [&](std::size_t i, std::size_t j) {
-                  if (original_rows[i] != original_rows[j])
-                      return original_rows[i] < original_rows[j];
-                  if (original_cols[i] != original_cols[j])
-                      return original_cols[i] < original_cols[j];
-
-                  return false;
-              });
-
-    // Apply permutation
-    sorted_rows.reserve(original_rows.size());
-    std::transform(perm.begin(), perm.end(), std::back_inserter(sorted_rows), [&](auto i) { return original_rows[i]; });
-    original_rows = std::vector<IT>();
-
-    sorted_cols.reserve(original_cols.size());
-    std::transform(perm.begin(), perm.end(), std::back_inserter(sorted_cols), [&](auto i) { return original_cols[i]; });
-    original_cols = std::vector<IT>();
-
-    sorted_vals.reserve(original_vals.size());
-    std::transform(perm.begin(), perm.end(), std::back_inserter(sorted_vals), [&](auto i) { return original_vals[i]; });
-    original_vals = std::vector<VT>();
+    // Sort rows, cols, and vals together
+    {
+        auto start = std::chrono::steady_clock::now();
+        radix_sort_triplets(key, rows, cols, vals, num_threads);
+        std::cout << "Sorted in " << seconds_since(start) << " s using " << num_threads << " threads" << std::endl;
+    }
 
     // Write
     {
+        auto start = std::chrono::steady_clock::now();
         fmm::write_options options;
         options.fill_header_field_type = false;
+        options.num_threads = num_threads;
         std::ofstream f(out_path);
-        fmm::write_matrix_market_triplet(f, header, sorted_rows, sorted_cols, sorted_vals, options);
+        fmm::write_matrix_market_triplet(f, header, rows, cols, vals, options);
+        std::cout << "Wrote " << out_path << " in " << seconds_since(start) << " s" << std::endl;
+    }
+}
+
+
+/**
+ * Sort in memory or out-of-core.
+ */
+template <typename IT, typename VT, typename KEY>
+void sort_keyed(const KEY& key, const std::filesystem::path& in_path, const std::filesystem::path& out_path,
+                int64_t memory_limit, int num_threads) {
+    if (memory_limit > 0) {
+        auto start = std::chrono::steady_clock::now();
+        external_sorter<KEY, IT, VT>(key, in_path, out_path, memory_limit, num_threads).sort();
+        std::cout << "Sorted out-of-core into " << out_path << " in " << seconds_since(start) << " s" << std::endl;
+    } else {
+        sort_file<IT, VT>(key, in_path, out_path, num_threads);
+    }
+}
+
+/**
+ * Output coordinate order.
+ */
+struct sort_order {
+    enum order_type {row, col, morton, tile};
+
+    order_type type = row;
+    int64_t tile_rows = 0;
+    int64_t tile_cols = 0;
+
+    /**
+     * Parse `row`, `col`, `morton`, or `tile:<rows>x<cols>`.
+     */
+    static sort_order parse(const std::string& str) {
+        sort_order order;
+        if (str == "row") {
+            order.type = row;
+        } else if (str == "col") {
+            order.type = col;
+        } else if (str == "morton") {
+            order.type = morton;
+        } else if (str.rfind("tile:", 0) == 0 && str.find('x') != std::string::npos) {
+            order.type = tile;
+            std::size_t x_pos = str.find('x');
+            if (!parse_positive(str.substr(5, x_pos - 5), order.tile_rows) ||
+                !parse_positive(str.substr(x_pos + 1), order.tile_cols)) {
+                throw std::invalid_argument("Tile dimensions must be positive integers: " + str);
+            }
+        } else {
+            throw std::invalid_argument("Unknown order: " + str);
+        }
+        return order;
+    }
+
+    /**
+     * Parse all of `str` as an integer greater than zero.
+     */
+    static bool parse_positive(const std::string& str, int64_t& value) {
+        const char* end = str.data() + str.size();
+        auto [ptr, ec] = std::from_chars(str.data(), end, value);
+        return ec == std::errc() && ptr == end && value > 0;
+    }
+
+    /**
+     * Output file extension. Row-major order keeps the original `.sorted.mtx` name.
+     */
+    [[nodiscard]] std::string extension() const {
+        switch (type) {
+            case col: return ".sorted-col.mtx";
+            case morton: return ".sorted-morton.mtx";
+            case tile: return ".sorted-tile" + std::to_string(tile_rows) + "x" + std::to_string(tile_cols) + ".mtx";
+            default: return ".sorted.mtx";
+        }
+    }
+};
+
+/**
+ * Sort in the requested order.
+ */
+template <typename IT, typename VT>
+void sort_typed(const sort_order& order, const fmm::matrix_market_header& header,
+                const std::filesystem::path& in_path, const std::filesystem::path& out_path,
+                int64_t memory_limit, int num_threads) {
+    switch (order.type) {
+        case sort_order::row:
+            sort_keyed<IT, VT>(row_major_key<IT>(header.nrows, header.ncols), in_path, out_path, memory_limit, num_threads);
+            break;
+        case sort_order::col:
+            sort_keyed<IT, VT>(col_major_key<IT>(header.nrows, header.ncols), in_path, out_path, memory_limit, num_threads);
+            break;
+        case sort_order::morton:
+            sort_keyed<IT, VT>(morton_key<IT>(header.nrows, header.ncols), in_path, out_path, memory_limit, num_threads);
+            break;
+        case sort_order::tile:
+            sort_keyed<IT, VT>(tile_key<IT>(header.nrows, header.ncols, order.tile_rows, order.tile_cols),
+                               in_path, out_path, memory_limit, num_threads);
+            break;
     }
 }
 
+/**
+ * Parse a byte count with an optional K, M, or G (binary) suffix.
+ */
+int64_t parse_byte_size(const std::string& str) {
+    std::size_t suffix_pos = 0;
+    int64_t value = std::stoll(str, &suffix_pos);
+    switch (suffix_pos < str.size() ? std::toupper(str[suffix_pos]) : ' ') {
+        case 'G': return value << 30;
+        case 'M': return value << 20;
+        case 'K': return value << 10;
+        default: return value;
+    }
+}
 
 int main(int argc, char **argv) {
-    if (argc < 2) {
+    int num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    int64_t memory_limit = 0;
+    bool text_values = false;
+    sort_order order;
+    std::string in_arg;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg{argv[i]};
+        if (arg.rfind("--threads=", 0) == 0) {
+            num_threads = std::max(1, std::stoi(arg.substr(std::string("--threads=").size())));
+        } else if (arg.rfind("--memory-limit=", 0) == 0) {
+            memory_limit = parse_byte_size(arg.substr(std::string("--memory-limit=").size()));
+        } else if (arg.rfind("--order=", 0) == 0) {
+            try {
+                order = sort_order::parse(arg.substr(std::string("--order=").size()));
+            } catch (const std::invalid_argument& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+        } else if (arg == "--text-values") {
+            text_values = true;
+        } else {
+            in_arg = arg;
+        }
+    }
+
+    if (in_arg.empty()) {
         std::cout << "Sort the coordinates of a .mtx file." << std::endl;
         std::cout << std::endl;
         std::cout << "Usage:" << std::endl;
-        std::cout << argv[0] << " <file>.mtx" << std::endl;
+        std::cout << argv[0] << " [--threads=<n>] [--order=<order>] [--memory-limit=<bytes>] [--text-values] <file>.mtx" << std::endl;
         std::cout << std::endl;
         std::cout << "will create a file named '<file>.sorted.mtx' in the current working directory." << std::endl;
+        std::cout << "Orders other than row-major are named '<file>.sorted-<order>.mtx'." << std::endl;
+        std::cout << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << "  --threads=<n>           number of threads to read, sort, and write with. Default: all cores." << std::endl;
+        std::cout << "  --order=<order>         row (default): by row then column" << std::endl;
+        std::cout << "                          col: by column then row" << std::endl;
+        std::cout << "                          morton: Z-order curve" << std::endl;
+        std::cout << "                          tile:<r>x<c>: r-by-c tiles in row-major order, row-major within a tile" << std::endl;
+        std::cout << "  --memory-limit=<bytes>  sort out-of-core using about this much memory, e.g. 4G or 512M." << std::endl;
+        std::cout << "                          Temporary run files are written next to the output file." << std::endl;
+        std::cout << "  --text-values           copy values as text instead of parsing them, to keep their exact formatting." << std::endl;
         return 0;
     }
 
-    std::filesystem::path in_path{argv[1]};
-    std::filesystem::path out_path{argv[1]};
-    out_path.replace_extension(".sorted.mtx");
+    std::filesystem::path in_path{in_arg};
+    std::filesystem::path out_path{in_arg};
+    out_path.replace_extension(order.extension());
 
     // find the type
     fmm::matrix_market_header header;
@@ -89,7 +243,35 @@ int main(int argc, char **argv) {
         return 0;
     }
 
-    sort_file<int64_t, std::string>(in_path, out_path);
+    // Errors are caught so the stack unwinds, which removes the temporary run files of an out-of-core sort.
+    try {
+        // Sort values in their binary type unless asked to keep the original text.
+        if (text_values) {
+            sort_typed<int64_t, std::string>(order, header, in_path, out_path, memory_limit, num_threads);
+            return 0;
+        }
+
+        switch (header.field) {
+            case fmm::real:
+            case fmm::double_:
+            case fmm::pattern:
+                // pattern matrices use no value vector
+                sort_typed<int64_t, double>(order, header, in_path, out_path, memory_limit, num_threads);
+                break;
+            case fmm::integer:
+                sort_typed<int64_t, int64_t>(order, header, in_path, out_path, memory_limit, num_threads);
+                break;
+            case fmm::unsigned_integer:
+                sort_typed<int64_t, uint64_t>(order, header, in_path, out_path, memory_limit, num_threads);
+                break;
+            case fmm::complex:
+                sort_typed<int64_t, std::complex<double>>(order, header, in_path, out_path, memory_limit, num_threads);
+                break;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Could not sort " << in_path << ": " << e.what() << std::endl;
+        return 1;
+    }
 
     return 0;
 }